@@ -0,0 +1,406 @@
+/*-------------------------------------------------------------------------
+ *
+ * tsf_bench.c
+ *
+ * Reader benchmarks: open time, full scans, projections, random access,
+ * genomic region queries and matrix scans. Each result is printed as a
+ * single line JSON object so runs of different builds can be compared.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "tsf.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+typedef struct bench_opts {
+  int repeat;       // Open/close iterations
+  int queries;      // Random access lookups and region queries
+  int region_width;
+  int entities;     // Entities read by the matrix scan
+  int64_t matrix_budget;  // Decompressed matrix chunk bytes kept, 0 for all
+  uint64_t seed;
+} bench_opts;
+
+typedef struct bench_result {
+  const char* name;
+  int64_t records;
+  int64_t ns;
+  int64_t checksum;  // Keeps value reads from being optimized away
+  tsf_stats stats;
+  int64_t* latencies;  // Per query, if not NULL
+  int latency_count;
+} bench_result;
+
+static uint64_t rng_next(uint64_t* state)
+{
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ULL;
+}
+
+static int cmp_int64(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+static int64_t percentile(int64_t* sorted, int n, int pct)
+{
+  if (n == 0)
+    return 0;
+  int i = (int)((int64_t)n * pct / 100);
+  return sorted[i < n ? i : n - 1];
+}
+
+static void print_result(const char* path, bench_result* r)
+{
+  double seconds = r->ns / 1e9;
+  printf("{\"bench\": \"%s\", \"file\": \"%s\", \"records\": %lld, \"seconds\": %.6f, "
+         "\"records_per_sec\": %.0f, \"read_chunks\": %lld, \"read_chunk_bytes\": %lld, "
+         "\"decompressed_bytes\": %lld, \"fetch_ns\": %lld, \"decompress_ns\": %lld",
+         r->name, path, (long long)r->records, seconds,
+         seconds > 0 ? r->records / seconds : 0.0, (long long)r->stats.read_chunks,
+         (long long)r->stats.read_chunk_bytes, (long long)r->stats.decompressed_bytes,
+         (long long)r->stats.read_time_ns, (long long)r->stats.decompress_time_ns);
+  if (r->latencies) {
+    qsort(r->latencies, r->latency_count, sizeof(int64_t), cmp_int64);
+    printf(", \"queries\": %d, \"p50_ns\": %lld, \"p99_ns\": %lld, \"max_ns\": %lld",
+           r->latency_count, (long long)percentile(r->latencies, r->latency_count, 50),
+           (long long)percentile(r->latencies, r->latency_count, 99),
+           (long long)(r->latency_count ? r->latencies[r->latency_count - 1] : 0));
+  }
+  printf(", \"checksum\": %lld}\n", (long long)r->checksum);
+  fflush(stdout);
+}
+
+// Folds the current values of iter into a checksum, touching each value
+static int64_t touch_values(tsf_iter* iter)
+{
+  int64_t sum = 0;
+  for (int i = 0; i < iter->field_count; i++) {
+    if (iter->cur_nulls[i])
+      continue;
+    tsf_v v = iter->cur_values[i];
+    switch (iter->fields[i]->value_type) {
+      case TypeInt32:
+      case TypeEnum:
+        sum += v_int32(v);
+        break;
+      case TypeInt64:
+        sum += v_int64(v);
+        break;
+      case TypeFloat32:
+        sum += (int64_t)(v_float32(v) * 1000);
+        break;
+      case TypeFloat64:
+        sum += (int64_t)v_float64(v);
+        break;
+      case TypeBool:
+        sum += v_bool(v);
+        break;
+      case TypeString:
+        sum += v_str(v)[0];
+        break;
+      default:
+        sum += va_size(v);
+        break;
+    }
+  }
+  return sum;
+}
+
+static bool bench_open(const char* path, bench_opts* o, bench_result* r)
+{
+  r->name = "open";
+  r->latencies = malloc(sizeof(int64_t) * o->repeat);
+  for (int i = 0; i < o->repeat; i++) {
+    int64_t start = tsf_clock_ns();
+    tsf_file* tsf = tsf_open_file(path);
+    bool ok = tsf && !tsf->errmsg;
+    if (ok)
+      r->checksum += tsf->sources[0].field_count;
+    tsf_close_file(tsf);
+    int64_t ns = tsf_clock_ns() - start;
+    if (!ok)
+      return false;
+    r->ns += ns;
+    r->latencies[r->latency_count++] = ns;
+  }
+  return true;
+}
+
+static bool bench_scan(tsf_file* tsf, const char* name, int field_count, int* field_idxs,
+                       bench_result* r)
+{
+  r->name = name;
+  int64_t start = tsf_clock_ns();
+  tsf_iter* iter = tsf_query_table(tsf, 1, field_count, field_idxs, -1, NULL,
+                                   FieldLocusAttribute);
+  if (!iter)
+    return false;
+  while (tsf_iter_next(iter)) {
+    r->checksum += touch_values(iter);
+    r->records++;
+  }
+  r->ns = tsf_clock_ns() - start;
+  r->stats = iter->stats;
+  tsf_iter_close(iter);
+  return true;
+}
+
+static bool bench_random(tsf_file* tsf, bench_opts* o, bench_result* r)
+{
+  r->name = "random_access";
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  if (!iter)
+    return false;
+  uint64_t rng = o->seed;
+  r->latencies = malloc(sizeof(int64_t) * o->queries);
+  for (int i = 0; i < o->queries; i++) {
+    int id = (int)(rng_next(&rng) % (uint64_t)iter->max_record_id);
+    int64_t start = tsf_clock_ns();
+    if (!tsf_iter_id(iter, id)) {
+      tsf_iter_close(iter);
+      return false;
+    }
+    r->checksum += touch_values(iter);
+    int64_t ns = tsf_clock_ns() - start;
+    r->ns += ns;
+    r->latencies[r->latency_count++] = ns;
+    r->records++;
+  }
+  r->stats = iter->stats;
+  tsf_iter_close(iter);
+  return true;
+}
+
+static bool bench_region(tsf_file* tsf, bench_opts* o, bench_result* r)
+{
+  r->name = "region";
+  tsf_source* s = &tsf->sources[0];
+  tsf_field* chr = tsf_field_by_symbol(s, "Chr");
+  tsf_field* stop = tsf_field_by_symbol(s, "Stop");
+  if (!s->gidx_query_table || !chr || !stop || chr->enum_count == 0)
+    return true;  // Not a genomic source
+  // Regions fall anywhere up to the largest Stop
+  int64_t extent = stop->extents_max > 0 ? (int64_t)stop->extents_max : 250000000;
+
+  uint64_t rng = o->seed ^ 0x9E3779B97F4A7C15ULL;
+  r->latencies = malloc(sizeof(int64_t) * o->queries);
+  for (int i = 0; i < o->queries; i++) {
+    const char* chr_name = chr->enum_names[rng_next(&rng) % chr->enum_count];
+    int start = (int)(rng_next(&rng) % (uint64_t)extent);
+    int64_t t0 = tsf_clock_ns();
+    tsf_gidx_iter* g = tsf_query_genomic_index(tsf, 1, (char*)chr_name, start,
+                                               start + o->region_width, -1, NULL, -1, NULL);
+    if (!g)
+      return false;
+    while (tsf_gidx_iter_next(g)) {
+      r->checksum += touch_values(&g->iter);
+      r->records++;
+    }
+    int64_t ns = tsf_clock_ns() - t0;
+    r->ns += ns;
+    r->latencies[r->latency_count++] = ns;
+    tsf_stats_merge(&r->stats, &g->iter.stats);
+    tsf_gidx_iter_close(g);
+  }
+  return true;
+}
+
+static bool bench_matrix(tsf_file* tsf, bench_opts* o, bool entity_major, bench_result* r)
+{
+  r->name = entity_major ? "matrix_entity_scan" : "matrix_scan";
+  tsf_source* s = &tsf->sources[0];
+  int field_idx = -1;
+  for (int i = 0; i < s->field_count && field_idx < 0; i++)
+    if (s->fields[i].field_type == FieldMatrix)
+      field_idx = i;
+  if (field_idx < 0 || s->entity_count <= 0)
+    return true;  // No matrix fields
+
+  int entity_count = o->entities < s->entity_count ? o->entities : s->entity_count;
+  int* entity_ids = malloc(sizeof(int) * entity_count);
+  for (int i = 0; i < entity_count; i++)
+    entity_ids[i] = i;
+  int64_t start = tsf_clock_ns();
+  tsf_iter* iter = tsf_query_table(tsf, 1, 1, &field_idx, entity_count, entity_ids, FieldMatrix);
+  free(entity_ids);
+  if (!iter)
+    return false;
+  iter->entity_major = entity_major;
+  iter->matrix_budget = o->matrix_budget;
+  while (tsf_iter_next(iter)) {
+    r->checksum += touch_values(iter);
+    r->records++;
+  }
+  r->ns = tsf_clock_ns() - start;
+  r->stats = iter->stats;
+  tsf_iter_close(iter);
+  return true;
+}
+
+// Every record of the matrix scan's entities, a dense block at a time,
+// or summarized per record by tsf_iter_reduce_matrix if reduce
+static bool bench_matrix_block(tsf_file* tsf, bench_opts* o, bool reduce, bench_result* r)
+{
+  r->name = reduce ? "matrix_reduce" : "matrix_block";
+  tsf_source* s = &tsf->sources[0];
+  int field_idx = -1;
+  for (int i = 0; i < s->field_count && field_idx < 0; i++)
+    if (s->fields[i].field_type == FieldMatrix && s->fields[i].value_type != TypeString &&
+        !tsf_value_type_is_array(s->fields[i].value_type))
+      field_idx = i;
+  if (field_idx < 0 || s->entity_count <= 0)
+    return true;  // No fixed size matrix fields
+
+  int entity_count = o->entities < s->entity_count ? o->entities : s->entity_count;
+  int* entity_ids = malloc(sizeof(int) * entity_count);
+  for (int i = 0; i < entity_count; i++)
+    entity_ids[i] = i;
+  const int block_records = 4096;
+  int64_t* values = malloc(sizeof(int64_t) * block_records * entity_count);
+  bool* nulls = malloc(sizeof(bool) * block_records * entity_count);
+  int counts[4096];
+  double sums[4096];
+  tsf_matrix_reduction red = {counts, sums, NULL, NULL, NULL};
+  int64_t start = tsf_clock_ns();
+  tsf_iter* iter = tsf_query_table(tsf, 1, 1, &field_idx, entity_count, entity_ids, FieldMatrix);
+  free(entity_ids);
+  bool ok = iter != NULL;
+  for (int first = 0; ok && first < s->locus_count; first += block_records) {
+    int count = s->locus_count - first < block_records ? s->locus_count - first : block_records;
+    if (reduce) {
+      ok = tsf_iter_reduce_matrix(iter, 0, first, count, 0, &red);
+      for (int i = 0; ok && i < count; i++)
+        r->checksum += counts[i] + (int64_t)sums[i];
+    } else {
+      ok = tsf_iter_read_matrix_block(iter, 0, first, count, 0, values, nulls);
+      for (int i = 0; ok && i < count * entity_count; i++)
+        r->checksum += nulls[i];
+    }
+    r->records += (int64_t)count * entity_count;
+  }
+  r->ns = tsf_clock_ns() - start;
+  if (iter)
+    r->stats = iter->stats;
+  tsf_iter_close(iter);
+  free(values);
+  free(nulls);
+  return ok;
+}
+
+static bool run(const char* path, bench_opts* o)
+{
+  bench_result r;
+  memset(&r, 0, sizeof(r));
+  bool ok = bench_open(path, o, &r);
+  if (ok)
+    print_result(path, &r);
+  free(r.latencies);
+  if (!ok) {
+    fprintf(stderr, "Unable to open %s\n", path);
+    return false;
+  }
+
+  tsf_file* tsf = tsf_open_file(path);
+  tsf_source* s = &tsf->sources[0];
+
+  // Projection of the first plain numeric attribute field other than the position
+  int projected = -1;
+  for (int i = 0; i < s->field_count && projected < 0; i++) {
+    tsf_field* f = &s->fields[i];
+    if (f->field_type == FieldLocusAttribute && f->locus_idx_map_table < 0 &&
+        strcmp(f->symbol, "Start") != 0 && strcmp(f->symbol, "Stop") != 0 &&
+        (f->value_type == TypeInt32 || f->value_type == TypeFloat32 ||
+         f->value_type == TypeFloat64 || f->value_type == TypeInt64))
+      projected = i;
+  }
+
+  for (int b = 0; b < 8 && ok; b++) {
+    memset(&r, 0, sizeof(r));
+    switch (b) {
+      case 0:
+        ok = bench_scan(tsf, "full_scan", -1, NULL, &r);
+        break;
+      case 1:
+        if (projected < 0)
+          continue;
+        ok = bench_scan(tsf, "projection", 1, &projected, &r);
+        break;
+      case 2:
+        ok = bench_random(tsf, o, &r);
+        break;
+      case 3:
+        ok = bench_region(tsf, o, &r);
+        break;
+      case 4:
+        ok = bench_matrix(tsf, o, false, &r);
+        break;
+      case 5:
+        ok = bench_matrix(tsf, o, true, &r);
+        break;
+      case 6:
+        ok = bench_matrix_block(tsf, o, false, &r);
+        break;
+      case 7:
+        ok = bench_matrix_block(tsf, o, true, &r);
+        break;
+    }
+    if (ok && (r.records > 0 || r.latency_count > 0))
+      print_result(path, &r);
+    free(r.latencies);
+  }
+  if (!ok)
+    fprintf(stderr, "Benchmark %s failed on %s\n", r.name, path);
+  tsf_close_file(tsf);
+  return ok;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: tsf_bench [options] file.tsf [file.tsf ...]\n"
+          "  -o repeat   Open/close iterations (default 20)\n"
+          "  -q queries  Random access lookups and region queries (default 1000)\n"
+          "  -w width    Region query width in bases (default 100000)\n"
+          "  -e count    Entities read by the matrix scan (default 100)\n"
+          "  -m MB       Decompressed matrix chunks kept by the matrix scan (default all)\n"
+          "  -r seed     Random seed (default 1)\n");
+}
+
+int main(int argc, char** argv)
+{
+  bench_opts o = {20, 1000, 100000, 100, 0, 1};
+  int c;
+  while ((c = getopt(argc, argv, "o:q:w:e:m:r:h")) != -1) {
+    switch (c) {
+      case 'o': o.repeat = atoi(optarg); break;
+      case 'q': o.queries = atoi(optarg); break;
+      case 'w': o.region_width = atoi(optarg); break;
+      case 'e': o.entities = atoi(optarg); break;
+      case 'm': o.matrix_budget = (int64_t)atoi(optarg) << 20; break;
+      case 'r': o.seed = strtoull(optarg, NULL, 10); break;
+      default: usage(); return 1;
+    }
+  }
+  if (optind >= argc || o.repeat < 1 || o.queries < 1 || o.entities < 1) {
+    usage();
+    return 1;
+  }
+  if (o.seed == 0)
+    o.seed = 1;
+
+  bool ok = true;
+  for (int i = optind; i < argc; i++)
+    ok = run(argv[i], &o) && ok;
+  return ok ? 0 : 1;
+}
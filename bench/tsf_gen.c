@@ -0,0 +1,439 @@
+/*-------------------------------------------------------------------------
+ *
+ * tsf_gen.c
+ *
+ * Generates synthetic TSF files for benchmarking the reader, written
+ * with tsf_writer.
+ *
+ * Produces a single genomic source in genomic order with Chr/Start/Stop,
+ * a genomic index, a configurable set of locus attribute fields and
+ * optionally a genotype-like enum matrix over N entities (with a Sample
+ * name entity attribute). Values are pseudo-random but deterministic for
+ * a given seed.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "tsf_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define CHR_COUNT 24
+static const char* chr_names[CHR_COUNT] = {"1",  "2",  "3",  "4",  "5",  "6",  "7",  "8",
+                                           "9",  "10", "11", "12", "13", "14", "15", "16",
+                                           "17", "18", "19", "20", "21", "22", "X",  "Y"};
+
+#define ENUM_COUNT 4
+static const char* enum_names[ENUM_COUNT] = {"Benign", "Likely Benign", "Uncertain", "Pathogenic"};
+static const char* genotype_names[ENUM_COUNT] = {"0/0", "0/1", "1/1", "1/2"};
+
+#define VOCAB_SIZE 4096
+#define NULL_PERCENT 5
+
+typedef struct gen_opts {
+  const char* path;
+  int64_t records;
+  int codec;
+  int level;
+  int chunk_bits;
+  int threads;
+  int dict_size;
+  bool pack_positions;  // Start and Stop with EncodingDeltaFOR
+  const char* field_types;
+  int string_len;
+  int array_size;
+  int entities;
+  uint64_t seed;
+} gen_opts;
+
+typedef struct gen_field {
+  char format[4];
+  tsf_value_type type;
+  int type_size;  // Element size, pointer size for strings
+} gen_field;
+
+typedef struct gen_buf {
+  char* data;
+  size_t len;
+  size_t cap;
+} gen_buf;
+
+static void buf_put(gen_buf* b, const void* p, size_t n)
+{
+  while (b->len + n > b->cap) {
+    b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+static uint64_t rng_next(uint64_t* state)
+{
+  // xorshift64*
+  uint64_t x = *state;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  *state = x;
+  return x * 2685821657736338717ULL;
+}
+
+static int rng_range(uint64_t* state, int n)
+{
+  return (int)((rng_next(state) >> 33) % (uint64_t)n);
+}
+
+static bool rng_null(uint64_t* state)
+{
+  return rng_range(state, 100) < NULL_PERCENT;
+}
+
+static char** vocab;
+
+// Repetitive vocabulary, like gene symbols or consequence terms
+static void init_vocab(int len, uint64_t seed)
+{
+  uint64_t rng = seed ^ 0x5851F42D4C957F2DULL;
+  vocab = malloc(sizeof(char*) * VOCAB_SIZE);
+  for (int i = 0; i < VOCAB_SIZE; i++) {
+    vocab[i] = malloc(len + 1);
+    for (int j = 0; j < len; j++)
+      vocab[i][j] = j < 3 ? "GEN"[j] : 'A' + rng_range(&rng, 26);
+    vocab[i][len] = '\0';
+  }
+}
+
+static const char* vocab_word(uint64_t* rng)
+{
+  // Skewed so a few words dominate
+  int i = rng_range(rng, VOCAB_SIZE);
+  return vocab[rng_range(rng, 2) ? i % 64 : i];
+}
+
+static bool parse_field(const char* format, gen_field* f)
+{
+  snprintf(f->format, sizeof(f->format), "%s", format);
+  f->type_size = 4;
+  if (strcmp(format, "i") == 0) f->type = TypeInt32;
+  else if (strcmp(format, "i8") == 0) f->type = TypeInt64;
+  else if (strcmp(format, "f4") == 0) f->type = TypeFloat32;
+  else if (strcmp(format, "f8") == 0) f->type = TypeFloat64;
+  else if (strcmp(format, "?") == 0) f->type = TypeBool;
+  else if (strcmp(format, "s") == 0) f->type = TypeString;
+  else if (strcmp(format, "e") == 0) f->type = TypeEnum;
+  else if (strcmp(format, "@i") == 0) f->type = TypeInt32Array;
+  else if (strcmp(format, "@f4") == 0) f->type = TypeFloat32Array;
+  else if (strcmp(format, "@f8") == 0) f->type = TypeFloat64Array;
+  else if (strcmp(format, "@?") == 0) f->type = TypeBoolArray;
+  else if (strcmp(format, "@s") == 0) f->type = TypeStringArray;
+  else if (strcmp(format, "@e") == 0) f->type = TypeEnumArray;
+  else return false;
+  if (f->type == TypeInt64 || f->type == TypeFloat64 || f->type == TypeFloat64Array)
+    f->type_size = 8;
+  if (f->type == TypeBool || f->type == TypeBoolArray)
+    f->type_size = 1;
+  if (f->type == TypeString || f->type == TypeStringArray)
+    f->type_size = sizeof(const char*);
+  return true;
+}
+
+// Appends one random scalar element of f's type
+static void gen_scalar(gen_field* f, uint64_t* rng, gen_buf* b, bool allow_null)
+{
+  bool missing = allow_null && rng_null(rng);
+  switch (f->type) {
+    case TypeInt32:
+    case TypeInt32Array: {
+      int v = missing ? INT_MISSING : rng_range(rng, 110000) - 10000;
+      buf_put(b, &v, 4);
+      break;
+    }
+    case TypeInt64: {
+      int64_t v = missing ? INT64_MISSING : (int64_t)rng_range(rng, 1 << 30) * 1000;
+      buf_put(b, &v, 8);
+      break;
+    }
+    case TypeFloat32:
+    case TypeFloat32Array: {
+      // Scores with three decimals
+      float v = missing ? FLOAT_MISSING : rng_range(rng, 1000) / 1000.0f;
+      buf_put(b, &v, 4);
+      break;
+    }
+    case TypeFloat64:
+    case TypeFloat64Array: {
+      double v = missing ? DOUBLE_MISSING : rng_range(rng, 1000000) / 1000.0;
+      buf_put(b, &v, 8);
+      break;
+    }
+    case TypeBool:
+    case TypeBoolArray: {
+      char v = missing ? BOOL_MISSING : (char)rng_range(rng, 2);
+      buf_put(b, &v, 1);
+      break;
+    }
+    case TypeEnum:
+    case TypeEnumArray: {
+      int v = missing ? INT_MISSING : rng_range(rng, ENUM_COUNT);
+      buf_put(b, &v, 4);
+      break;
+    }
+    case TypeString:
+    case TypeStringArray: {
+      const char* v = missing ? NULL : vocab_word(rng);
+      buf_put(b, &v, sizeof(const char*));
+      break;
+    }
+    default:
+      break;
+  }
+}
+
+// Generates rows values of a field as passed to the writer, with sizes
+// set for array fields
+static void gen_column(gen_field* f, int rows, int array_size, uint64_t* rng, gen_buf* b,
+                       int* sizes)
+{
+  b->len = 0;
+  bool is_array = tsf_value_type_is_array(f->type);
+  for (int i = 0; i < rows; i++) {
+    if (!is_array) {
+      gen_scalar(f, rng, b, true);
+      continue;
+    }
+    sizes[i] = rng_range(rng, array_size + 1);
+    for (int j = 0; j < sizes[i]; j++)
+      gen_scalar(f, rng, b, false);
+  }
+}
+
+static bool generate(const gen_opts* o)
+{
+  int field_count = 0;
+  gen_field fields[64];
+  char* types = strdup(o->field_types);
+  for (char* tok = strtok(types, ","); tok; tok = strtok(NULL, ",")) {
+    if (field_count == 64 || !parse_field(tok, &fields[field_count])) {
+      fprintf(stderr, "Unsupported field type '%s'\n", tok);
+      free(types);
+      return false;
+    }
+    field_count++;
+  }
+  free(types);
+
+  tsf_writer_opts wopts;
+  tsf_writer_opts_init(&wopts);
+  wopts.codec = o->codec;
+  wopts.level = o->level;
+  wopts.chunk_bits = o->chunk_bits;
+  wopts.threads = o->threads;
+  wopts.zstd_dict_size = o->dict_size;
+  tsf_writer* w = tsf_writer_open(o->path, &wopts);
+  if (!w)
+    return false;
+
+  tsf_writer_source src;
+  memset(&src, 0, sizeof(src));
+  src.name = "Synthetic";
+  src.docs_json = "{\"curatedBy\": \"tsf_gen\", \"seriesName\": \"synthetic\"}";
+  src.coord_sys_id = "Synthetic,Species,Chromosome";
+  src.entity_count = o->entities;
+  src.genomic_order = true;
+  int source_id = tsf_writer_add_source(w, &src);
+
+  // Chr, Start, Stop, the attribute fields, then the matrix field
+  tsf_writer_field def;
+  memset(&def, 0, sizeof(def));
+  def.field_type = FieldLocusAttribute;
+  def.codec = -1;
+  def.level = -1;
+  def.name = "Chr";
+  def.value_type = TypeEnum;
+  def.enum_count = CHR_COUNT;
+  def.enum_names = chr_names;
+  tsf_writer_add_field(w, source_id, &def);
+  def.enum_count = 0;
+  def.enum_names = NULL;
+  def.value_type = TypeInt32;
+  def.encoding = o->pack_positions ? EncodingDeltaFOR : EncodingNone;
+  def.name = "Start";
+  tsf_writer_add_field(w, source_id, &def);
+  def.name = "Stop";
+  tsf_writer_add_field(w, source_id, &def);
+  def.encoding = EncodingNone;
+  for (int i = 0; i < field_count; i++) {
+    char name[64];
+    snprintf(name, sizeof(name), "Field %d %.3s", i, fields[i].format);
+    def.name = name;
+    def.value_type = fields[i].type;
+    bool is_enum = fields[i].type == TypeEnum || fields[i].type == TypeEnumArray;
+    def.enum_count = is_enum ? ENUM_COUNT : 0;
+    def.enum_names = is_enum ? enum_names : NULL;
+    tsf_writer_add_field(w, source_id, &def);
+  }
+  int geno_field = -1, sample_field = -1;
+  if (o->entities > 0) {
+    def.name = "Genotype";
+    def.value_type = TypeEnum;
+    def.field_type = FieldMatrix;
+    def.enum_count = ENUM_COUNT;
+    def.enum_names = genotype_names;
+    geno_field = tsf_writer_add_field(w, source_id, &def);
+    def.name = "Sample";
+    def.value_type = TypeString;
+    def.field_type = FieldEntityAttribute;
+    def.enum_count = 0;
+    def.enum_names = NULL;
+    sample_field = tsf_writer_add_field(w, source_id, &def);
+  }
+
+  // Records are spread evenly over the chromosomes
+  uint64_t rng = o->seed;
+  int64_t per_chr = (o->records + CHR_COUNT - 1) / CHR_COUNT;
+  int block_size = 1 << o->chunk_bits;
+  int* chr = malloc(sizeof(int) * block_size);
+  int* start = malloc(sizeof(int) * block_size);
+  int* stop = malloc(sizeof(int) * block_size);
+  int* sizes = malloc(sizeof(int) * block_size);
+  gen_buf values = {0};
+  int cur_chr = -1, position = 0;
+  bool ok = !tsf_writer_errmsg(w);
+
+  for (int64_t first = 0; ok && first < o->records; first += block_size) {
+    int rows = o->records - first < block_size ? (int)(o->records - first) : block_size;
+    for (int i = 0; i < rows; i++) {
+      chr[i] = (int)((first + i) / per_chr);
+      if (chr[i] != cur_chr)
+        position = 0;
+      cur_chr = chr[i];
+      position += 1 + rng_range(&rng, 100);
+      start[i] = position;
+      stop[i] = position + 1 + rng_range(&rng, 50);
+    }
+    ok = tsf_writer_append(w, source_id, 0, rows, chr) &&
+         tsf_writer_append(w, source_id, 1, rows, start) &&
+         tsf_writer_append(w, source_id, 2, rows, stop);
+    for (int j = 0; j < field_count && ok; j++) {
+      gen_column(&fields[j], rows, o->array_size, &rng, &values, sizes);
+      if (tsf_value_type_is_array(fields[j].type))
+        ok = tsf_writer_append_array(w, source_id, j + 3, rows, sizes, values.data);
+      else
+        ok = tsf_writer_append(w, source_id, j + 3, rows, values.data);
+    }
+    for (int e = 0; e < o->entities && ok; e++) {
+      // Mostly reference calls, as in real cohorts
+      for (int i = 0; i < rows; i++) {
+        int r = rng_range(&rng, 100);
+        chr[i] = r < 2 ? INT_MISSING : (r < 80 ? 0 : (r < 95 ? 1 : (r < 99 ? 2 : 3)));
+      }
+      ok = tsf_writer_append_matrix(w, source_id, geno_field, e, rows, chr);
+    }
+  }
+
+  // Sample names
+  char (*names)[16] = malloc(16 * (o->entities + 1));
+  const char** name_ptrs = malloc(sizeof(char*) * (o->entities + 1));
+  for (int e = 0; e < o->entities; e++) {
+    snprintf(names[e], 16, "S%06d", e);
+    name_ptrs[e] = names[e];
+  }
+  if (ok && o->entities > 0)
+    ok = tsf_writer_append(w, source_id, sample_field, o->entities, name_ptrs);
+
+  ok = tsf_writer_close(w) && ok;
+  free(names);
+  free(name_ptrs);
+  free(chr);
+  free(start);
+  free(stop);
+  free(sizes);
+  free(values.data);
+  return ok;
+}
+
+static int parse_codec(const char* name)
+{
+  if (strcmp(name, "zstd") == 0)
+    return CompressionZstd;
+  if (strcmp(name, "zlib") == 0)
+    return CompressionZlib;
+  if (strcmp(name, "blosc") == 0)
+    return CompressionBlosc;
+  if (strcmp(name, "lz4") == 0)
+    return CompressionLZ4;
+  if (strcmp(name, "none") == 0)
+    return CompressionNone;
+  return -1;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: tsf_gen -o out.tsf [options]\n"
+          "  -n records     Number of records (default 1000000)\n"
+          "  -c codec       zstd, zlib, lz4, blosc or none (default zstd)\n"
+          "  -l level       Compression level (default per codec)\n"
+          "  -t threads     Compression threads (default one per CPU)\n"
+          "  -d bytes       zstd dictionary size of string fields (default none)\n"
+          "  -b chunk_bits  Records per chunk as a power of 2 (default 12)\n"
+          "  -p             Bit pack Start and Stop deltas (extended chunk headers)\n"
+          "  -f types       Attribute field formats (default i,i8,f4,f8,?,s,e,@i,@f4,@s)\n"
+          "  -s length      String length (default 12)\n"
+          "  -a size        Maximum array size (default 4)\n"
+          "  -e entities    Entities of a genotype matrix field (default 0)\n"
+          "  -r seed        Random seed (default 1)\n");
+}
+
+int main(int argc, char** argv)
+{
+  gen_opts o;
+  memset(&o, 0, sizeof(o));
+  o.records = 1000000;
+  o.codec = CompressionZstd;
+  o.level = -1;
+  o.chunk_bits = 12;
+  o.field_types = "i,i8,f4,f8,?,s,e,@i,@f4,@s";
+  o.string_len = 12;
+  o.array_size = 4;
+  o.seed = 1;
+
+  int c;
+  while ((c = getopt(argc, argv, "o:n:c:l:t:d:pb:f:s:a:e:r:h")) != -1) {
+    switch (c) {
+      case 'o': o.path = optarg; break;
+      case 'n': o.records = atoll(optarg); break;
+      case 'c': o.codec = parse_codec(optarg); break;
+      case 'l': o.level = atoi(optarg); break;
+      case 't': o.threads = atoi(optarg); break;
+      case 'd': o.dict_size = atoi(optarg); break;
+      case 'p': o.pack_positions = true; break;
+      case 'b': o.chunk_bits = atoi(optarg); break;
+      case 'f': o.field_types = optarg; break;
+      case 's': o.string_len = atoi(optarg); break;
+      case 'a': o.array_size = atoi(optarg); break;
+      case 'e': o.entities = atoi(optarg); break;
+      case 'r': o.seed = strtoull(optarg, NULL, 10); break;
+      default: usage(); return 1;
+    }
+  }
+  if (!o.path || o.records <= 0 || o.records > INT_MAX || o.codec < 0 || o.chunk_bits < 1 ||
+      o.chunk_bits > 20 || o.string_len < 3 || o.array_size < 0 || o.entities < 0) {
+    usage();
+    return 1;
+  }
+  if (o.seed == 0)
+    o.seed = 1;  // xorshift state must be non-zero
+
+  init_vocab(o.string_len, o.seed);
+  int64_t start = tsf_clock_ns();
+  if (!generate(&o))
+    return 1;
+  fprintf(stderr, "Generated %s: %lld records in %.2fs\n", o.path, (long long)o.records,
+          (tsf_clock_ns() - start) / 1e9);
+  return 0;
+}
@@ -231,7 +231,8 @@ static int32_t sw32(int32_t a)
 
 
 /* Shuffle & compress a single block */
-static int blosc_c(int32_t blocksize, int32_t leftoverblock,
+static int blosc_c(int32_t typesize, int32_t flags, int32_t clevel,
+                   int32_t blocksize, int32_t leftoverblock,
                    int32_t ntbytes, int32_t maxbytes,
                    uint8_t *src, uint8_t *dest, uint8_t *tmp)
 {
@@ -239,10 +240,9 @@ static int blosc_c(int32_t blocksize, int32_t leftoverblock,
   int32_t cbytes;                   /* number of compressed bytes in split */
   int32_t ctbytes = 0;              /* number of compressed bytes in block */
   int32_t maxout;
-  int32_t typesize = params.typesize;
   uint8_t *_tmp;
 
-  if ((params.flags & BLOSC_DOSHUFFLE) && (typesize > 1)) {
+  if ((flags & BLOSC_DOSHUFFLE) && (typesize > 1)) {
     /* Shuffle this block (this makes sense only if typesize > 1) */
     shuffle(typesize, blocksize, src, tmp);
     _tmp = tmp;
@@ -273,7 +273,7 @@ static int blosc_c(int32_t blocksize, int32_t leftoverblock,
         return 0;                  /* non-compressible block */
       }
     }
-    cbytes = blosclz_compress(params.clevel, _tmp+j*neblock, neblock,
+    cbytes = blosclz_compress(clevel, _tmp+j*neblock, neblock,
                               dest, maxout);
     if (cbytes >= maxout) {
       /* Buffer overrun caused by blosclz_compress (should never happen) */
@@ -304,7 +304,8 @@ static int blosc_c(int32_t blocksize, int32_t leftoverblock,
 
 
 /* Decompress & unshuffle a single block */
-static int blosc_d(int32_t blocksize, int32_t leftoverblock,
+static int blosc_d(int32_t typesize, int32_t flags,
+                   int32_t blocksize, int32_t leftoverblock,
                    uint8_t *src, uint8_t *dest, uint8_t *tmp, uint8_t *tmp2)
 {
   int32_t j, neblock, nsplits;
@@ -313,9 +314,8 @@ static int blosc_d(int32_t blocksize, int32_t leftoverblock,
   int32_t ctbytes = 0;           /* number of compressed bytes in block */
   int32_t ntbytes = 0;           /* number of uncompressed bytes in block */
   uint8_t *_tmp;
-  int32_t typesize = params.typesize;
 
-  if ((params.flags & BLOSC_DOSHUFFLE) && (typesize > 1)) {
+  if ((flags & BLOSC_DOSHUFFLE) && (typesize > 1)) {
     _tmp = tmp;
   }
   else {
@@ -352,7 +352,7 @@ static int blosc_d(int32_t blocksize, int32_t leftoverblock,
     ntbytes += nbytes;
   } /* Closes j < nsplits */
 
-  if ((params.flags & BLOSC_DOSHUFFLE) && (typesize > 1)) {
+  if ((flags & BLOSC_DOSHUFFLE) && (typesize > 1)) {
     if ((uintptr_t)dest % 16 == 0) {
       /* 16-bytes aligned dest.  SSE2 unshuffle will work. */
       unshuffle(typesize, blocksize, tmp, dest);
@@ -408,7 +408,8 @@ static int serial_blosc(void)
       }
       else {
         /* Regular compression */
-        cbytes = blosc_c(bsize, leftoverblock, ntbytes, maxbytes,
+        cbytes = blosc_c(params.typesize, flags, params.clevel, bsize,
+                         leftoverblock, ntbytes, maxbytes,
                          src+j*blocksize, dest+ntbytes, tmp);
         if (cbytes == 0) {
           ntbytes = 0;              /* uncompressible data */
@@ -424,7 +425,7 @@ static int serial_blosc(void)
       }
       else {
         /* Regular decompression */
-        cbytes = blosc_d(bsize, leftoverblock,
+        cbytes = blosc_d(params.typesize, flags, bsize, leftoverblock,
                          src+sw32(bstarts[j]), dest+j*blocksize, tmp, tmp2);
       }
     }
@@ -613,22 +614,28 @@ static int32_t compute_blocksize(int32_t clevel, int32_t typesize,
 }
 
 
-/* The public routine for compression.  See blosc.h for docstrings. */
-int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
-      const void *src, void *dest, size_t destsize)
+/* Header and block layout of a buffer being compressed */
+struct c_header {
+  uint8_t *flags;               /* flags for header.  Currently booked:
+                                   - 0: shuffled?
+                                   - 1: memcpy'ed? */
+  int32_t typesize;
+  int32_t nbytes;               /* number of bytes in source buffer */
+  int32_t blocksize;            /* length of the block in bytes */
+  int32_t nblocks;              /* number of total blocks in buffer */
+  int32_t leftover;             /* extra bytes at end of buffer */
+  int32_t *bstarts;             /* start pointers for each block */
+  int32_t *ntbytes_;            /* placeholder for bytes in output buffer */
+  int32_t ntbytes;              /* bytes of the header and block starts */
+};
+
+
+/* Check the compression parameters and write the header of `dest`.
+   Returns 0, or the error code of the compression routines. */
+static int write_c_header(int clevel, int doshuffle, size_t typesize,
+                          size_t nbytes, void *dest, struct c_header *h)
 {
-  uint8_t *_dest=NULL;         /* current pos for destination buffer */
-  uint8_t *flags;              /* flags for header.  Currently booked:
-                                  - 0: shuffled?
-                                  - 1: memcpy'ed? */
-  int32_t nbytes_;            /* number of bytes in source buffer */
-  int32_t nblocks;            /* number of total blocks in buffer */
-  int32_t leftover;           /* extra bytes at end of buffer */
-  int32_t *bstarts;           /* start pointers for each block */
-  int32_t blocksize;          /* length of the block in bytes */
-  int32_t ntbytes = 0;        /* the number of compressed bytes */
-  int32_t *ntbytes_;          /* placeholder for bytes in output buffer */
-  int32_t maxbytes = (int32_t)destsize;  /* maximum size for dest buffer */
+  uint8_t *_dest;
 
   /* Check buffer size limits */
   if (nbytes > BLOSC_MAX_BUFFERSIZE) {
@@ -639,7 +646,7 @@ int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
   }
 
   /* We can safely do this assignation now */
-  nbytes_ = (int32_t)nbytes;
+  h->nbytes = (int32_t)nbytes;
 
   /* Compression level */
   if (clevel < 0 || clevel > 9) {
@@ -659,83 +666,101 @@ int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
     /* If typesize is too large, treat buffer as an 1-byte stream. */
     typesize = 1;
   }
+  h->typesize = (int32_t)typesize;
 
   /* Get the blocksize */
-  blocksize = compute_blocksize(clevel, (int32_t)typesize, nbytes_);
+  h->blocksize = compute_blocksize(clevel, h->typesize, h->nbytes);
 
   /* Compute number of blocks in buffer */
-  nblocks = nbytes_ / blocksize;
-  leftover = nbytes_ % blocksize;
-  nblocks = (leftover>0)? nblocks+1: nblocks;
+  h->nblocks = h->nbytes / h->blocksize;
+  h->leftover = h->nbytes % h->blocksize;
+  h->nblocks = (h->leftover>0)? h->nblocks+1: h->nblocks;
 
   _dest = (uint8_t *)(dest);
   /* Write header for this block */
   _dest[0] = BLOSC_VERSION_FORMAT;         /* blosc format version */
   _dest[1] = BLOSCLZ_VERSION_FORMAT;       /* blosclz format version */
-  flags = _dest+2;                         /* flags */
+  h->flags = _dest+2;                      /* flags */
   _dest[2] = 0;                            /* zeroes flags */
   _dest[3] = (uint8_t)typesize;            /* type size */
   _dest += 4;
-  ((int32_t *)_dest)[0] = sw32(nbytes_);  /* size of the buffer */
-  ((int32_t *)_dest)[1] = sw32(blocksize);/* block size */
-  ntbytes_ = (int32_t *)(_dest+8);        /* compressed buffer size */
+  ((int32_t *)_dest)[0] = sw32(h->nbytes);    /* size of the buffer */
+  ((int32_t *)_dest)[1] = sw32(h->blocksize); /* block size */
+  h->ntbytes_ = (int32_t *)(_dest+8);      /* compressed buffer size */
   _dest += sizeof(int32_t)*3;
-  bstarts = (int32_t *)_dest;             /* starts for every block */
-  _dest += sizeof(int32_t)*nblocks;        /* space for pointers to blocks */
-  ntbytes = (int32_t)(_dest - (uint8_t *)dest);
+  h->bstarts = (int32_t *)_dest;           /* starts for every block */
+  _dest += sizeof(int32_t)*h->nblocks;     /* space for pointers to blocks */
+  h->ntbytes = (int32_t)(_dest - (uint8_t *)dest);
 
   if (clevel == 0) {
     /* Compression level 0 means buffer to be memcpy'ed */
-    *flags |= BLOSC_MEMCPYED;
+    *h->flags |= BLOSC_MEMCPYED;
   }
 
-  if (nbytes_ < MIN_BUFFERSIZE) {
+  if (h->nbytes < MIN_BUFFERSIZE) {
     /* Buffer is too small.  Try memcpy'ing. */
-    *flags |= BLOSC_MEMCPYED;
+    *h->flags |= BLOSC_MEMCPYED;
   }
 
   if (doshuffle == 1) {
     /* Shuffle is active */
-    *flags |= BLOSC_DOSHUFFLE;              /* bit 0 set to one in flags */
+    *h->flags |= BLOSC_DOSHUFFLE;           /* bit 0 set to one in flags */
+  }
+  return 0;
+}
+
+
+/* The public routine for compression.  See blosc.h for docstrings. */
+int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
+      const void *src, void *dest, size_t destsize)
+{
+  struct c_header h;
+  int32_t ntbytes = 0;        /* the number of compressed bytes */
+  int32_t maxbytes = (int32_t)destsize;  /* maximum size for dest buffer */
+  int status = write_c_header(clevel, doshuffle, typesize, nbytes, dest, &h);
+
+  if (status < 0) {
+    return status;
   }
+  ntbytes = h.ntbytes;
 
   /* Take global lock for the time of compression */
   pthread_mutex_lock(&global_comp_mutex);
   /* Populate parameters for compression routines */
   params.compress = 1;
   params.clevel = clevel;
-  params.flags = (int32_t)*flags;
-  params.typesize = (int32_t)typesize;
-  params.blocksize = blocksize;
+  params.flags = (int32_t)*h.flags;
+  params.typesize = h.typesize;
+  params.blocksize = h.blocksize;
   params.ntbytes = ntbytes;
-  params.nbytes = nbytes_;
+  params.nbytes = h.nbytes;
   params.maxbytes = maxbytes;
-  params.nblocks = nblocks;
-  params.leftover = leftover;
-  params.bstarts = bstarts;
+  params.nblocks = h.nblocks;
+  params.leftover = h.leftover;
+  params.bstarts = h.bstarts;
   params.src = (uint8_t *)src;
   params.dest = (uint8_t *)dest;
 
-  if (!(*flags & BLOSC_MEMCPYED)) {
+  if (!(*h.flags & BLOSC_MEMCPYED)) {
     /* Do the actual compression */
     ntbytes = do_job();
     if (ntbytes < 0) {
       return -1;
     }
-    if ((ntbytes == 0) && (nbytes_+BLOSC_MAX_OVERHEAD <= maxbytes)) {
+    if ((ntbytes == 0) && (h.nbytes+BLOSC_MAX_OVERHEAD <= maxbytes)) {
       /* Last chance for fitting `src` buffer in `dest`.  Update flags
        and do a memcpy later on. */
-      *flags |= BLOSC_MEMCPYED;
+      *h.flags |= BLOSC_MEMCPYED;
       params.flags |= BLOSC_MEMCPYED;
     }
   }
 
-  if (*flags & BLOSC_MEMCPYED) {
-    if (nbytes_+BLOSC_MAX_OVERHEAD > maxbytes) {
+  if (*h.flags & BLOSC_MEMCPYED) {
+    if (h.nbytes+BLOSC_MAX_OVERHEAD > maxbytes) {
       /* We are exceeding maximum output size */
       ntbytes = 0;
     }
-    else if (((nbytes_ % L1) == 0) || (nthreads > 1)) {
+    else if (((h.nbytes % L1) == 0) || (nthreads > 1)) {
       /* More effective with large buffers that are multiples of the
        cache size or multi-cores */
       params.ntbytes = BLOSC_MAX_OVERHEAD;
@@ -745,13 +770,13 @@ int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
       }
     }
     else {
-      memcpy((uint8_t *)dest+BLOSC_MAX_OVERHEAD, src, nbytes_);
-      ntbytes = nbytes_ + BLOSC_MAX_OVERHEAD;
+      memcpy((uint8_t *)dest+BLOSC_MAX_OVERHEAD, src, h.nbytes);
+      ntbytes = h.nbytes + BLOSC_MAX_OVERHEAD;
     }
   }
 
   /* Set the number of compressed bytes in header */
-  *ntbytes_ = sw32(ntbytes);
+  *h.ntbytes_ = sw32(ntbytes);
 
   /* Release global lock */
   pthread_mutex_unlock(&global_comp_mutex);
@@ -761,6 +786,77 @@ int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
 }
 
 
+/* Re-entrant compression.  See blosc.h for docstrings. */
+int blosc_compress_ctx(int clevel, int doshuffle, size_t typesize,
+                       size_t nbytes, const void *src, void *dest,
+                       size_t destsize)
+{
+  struct c_header h;
+  int32_t j, bsize, leftoverblock, cbytes;
+  int32_t ntbytes = 0;        /* the number of compressed bytes */
+  int32_t maxbytes = (int32_t)destsize;  /* maximum size for dest buffer */
+  uint8_t *_src = (uint8_t *)src;
+  uint8_t *tmp;
+  int status = write_c_header(clevel, doshuffle, typesize, nbytes, dest, &h);
+
+  if (status < 0) {
+    return status;
+  }
+  ntbytes = h.ntbytes;
+
+  if (!(*h.flags & BLOSC_MEMCPYED)) {
+    /* Compress block by block as serial_blosc does, with own temporary */
+    tmp = my_malloc(h.blocksize);
+    if (tmp == NULL) {
+      return -1;
+    }
+    for (j = 0; j < h.nblocks; j++) {
+      h.bstarts[j] = sw32(ntbytes);
+      bsize = h.blocksize;
+      leftoverblock = 0;
+      if ((j == h.nblocks - 1) && (h.leftover > 0)) {
+        bsize = h.leftover;
+        leftoverblock = 1;
+      }
+      cbytes = blosc_c(h.typesize, (int32_t)*h.flags, clevel, bsize,
+                       leftoverblock, ntbytes, maxbytes,
+                       _src+j*h.blocksize, (uint8_t *)dest+ntbytes, tmp);
+      if (cbytes == 0) {
+        ntbytes = 0;              /* uncompressible data */
+        break;
+      }
+      if (cbytes < 0) {
+        my_free(tmp);
+        return -1;
+      }
+      ntbytes += cbytes;
+    }
+    my_free(tmp);
+    if ((ntbytes == 0) && (h.nbytes+BLOSC_MAX_OVERHEAD <= maxbytes)) {
+      /* Last chance for fitting `src` buffer in `dest` */
+      *h.flags |= BLOSC_MEMCPYED;
+    }
+  }
+
+  if (*h.flags & BLOSC_MEMCPYED) {
+    if (h.nbytes+BLOSC_MAX_OVERHEAD > maxbytes) {
+      /* We are exceeding maximum output size */
+      ntbytes = 0;
+    }
+    else {
+      memcpy((uint8_t *)dest+BLOSC_MAX_OVERHEAD, src, h.nbytes);
+      ntbytes = h.nbytes + BLOSC_MAX_OVERHEAD;
+    }
+  }
+
+  /* Set the number of compressed bytes in header */
+  *h.ntbytes_ = sw32(ntbytes);
+
+  assert((int32_t)ntbytes <= (int32_t)maxbytes);
+  return ntbytes;
+}
+
+
 /* The public routine for decompression.  See blosc.h for docstrings. */
 int blosc_decompress(const void *src, void *dest, size_t destsize)
 {
@@ -850,6 +946,162 @@ int blosc_decompress(const void *src, void *dest, size_t destsize)
 }
 
 
+/* Block range of a buffer decompressed by one blosc_decompress_ctx thread */
+struct d_context {
+  int32_t typesize;
+  int32_t flags;
+  int32_t blocksize;
+  int32_t nbytes;
+  int32_t nblocks;
+  int32_t leftover;
+  int32_t *bstarts;
+  uint8_t *src;
+  uint8_t *dest;
+  int32_t first;                /* first block of the range */
+  int32_t last;                 /* one past the last block of the range */
+  int32_t ntbytes;              /* result: bytes decompressed or error code */
+};
+
+
+/* Decompress the blocks of one range with its own temporaries */
+static int32_t d_blocks(struct d_context *ctx)
+{
+  int32_t j, bsize, leftoverblock, cbytes;
+  int32_t ntbytes = 0;
+  int32_t blocksize = ctx->blocksize;
+  uint8_t *tmp = NULL, *tmp2 = NULL;
+
+  if (!(ctx->flags & BLOSC_MEMCPYED)) {
+    tmp = my_malloc(blocksize);
+    tmp2 = my_malloc(blocksize);
+    if (tmp == NULL || tmp2 == NULL) {
+      my_free(tmp);
+      my_free(tmp2);
+      return -1;
+    }
+  }
+
+  for (j = ctx->first; j < ctx->last; j++) {
+    bsize = blocksize;
+    leftoverblock = 0;
+    if ((j == ctx->nblocks - 1) && (ctx->leftover > 0)) {
+      bsize = ctx->leftover;
+      leftoverblock = 1;
+    }
+    if (ctx->flags & BLOSC_MEMCPYED) {
+      memcpy(ctx->dest+j*blocksize, ctx->src+BLOSC_MAX_OVERHEAD+j*blocksize,
+             bsize);
+      cbytes = bsize;
+    }
+    else {
+      cbytes = blosc_d(ctx->typesize, ctx->flags, bsize, leftoverblock,
+                       ctx->src+sw32(ctx->bstarts[j]), ctx->dest+j*blocksize,
+                       tmp, tmp2);
+    }
+    if (cbytes < 0) {
+      ntbytes = cbytes;
+      break;
+    }
+    ntbytes += cbytes;
+  }
+
+  my_free(tmp);
+  my_free(tmp2);
+  return ntbytes;
+}
+
+
+static void *t_blosc_d(void *arg)
+{
+  struct d_context *ctx = (struct d_context *)arg;
+  ctx->ntbytes = d_blocks(ctx);
+  return NULL;
+}
+
+
+/* Reentrant decompression.  See blosc.h for docstrings. */
+int blosc_decompress_ctx(const void *src, void *dest, size_t destsize,
+                         int numinternalthreads)
+{
+  uint8_t *_src = (uint8_t *)(src);
+  struct d_context ctx[BLOSC_MAX_THREADS];
+  pthread_t threads_[BLOSC_MAX_THREADS];
+  int32_t nbytes, blocksize, nblocks, leftover, tblocks, ntbytes;
+  int32_t i, nthreads_, started;
+
+  /* Read the header block */
+  ctx[0].flags = (int32_t)_src[2];
+  ctx[0].typesize = (int32_t)_src[3];
+  nbytes = sw32(((int32_t *)(_src + 4))[0]);
+  blocksize = sw32(((int32_t *)(_src + 4))[1]);
+  if (nbytes < 0 || blocksize <= 0) {
+    return -1;
+  }
+  nblocks = nbytes / blocksize;
+  leftover = nbytes % blocksize;
+  nblocks = (leftover>0)? nblocks+1: nblocks;
+
+  /* Check that we have enough space to decompress */
+  if (nbytes > (int32_t)destsize) {
+    return -1;
+  }
+
+  ctx[0].blocksize = blocksize;
+  ctx[0].nbytes = nbytes;
+  ctx[0].nblocks = nblocks;
+  ctx[0].leftover = leftover;
+  ctx[0].bstarts = (int32_t *)(_src + BLOSC_MIN_HEADER_LENGTH);
+  ctx[0].src = _src;
+  ctx[0].dest = (uint8_t *)dest;
+
+  /* Split the blocks into sequential ranges, one per thread */
+  nthreads_ = numinternalthreads;
+  if (nthreads_ > BLOSC_MAX_THREADS) {
+    nthreads_ = BLOSC_MAX_THREADS;
+  }
+  if (nthreads_ > nblocks) {
+    nthreads_ = nblocks;
+  }
+  if (nthreads_ < 1) {
+    nthreads_ = 1;
+  }
+  tblocks = (nblocks + nthreads_ - 1) / nthreads_;
+  for (i = 0; i < nthreads_; i++) {
+    ctx[i] = ctx[0];
+    ctx[i].first = i * tblocks;
+    ctx[i].last = (i + 1) * tblocks < nblocks ? (i + 1) * tblocks : nblocks;
+    ctx[i].ntbytes = 0;
+  }
+
+  /* The calling thread takes the first range, and any range a thread
+     could not be started for */
+  for (started = 1; started < nthreads_; started++) {
+    if (pthread_create(&threads_[started], NULL, t_blosc_d,
+                       &ctx[started]) != 0) {
+      break;
+    }
+  }
+  for (i = started; i < nthreads_; i++) {
+    t_blosc_d(&ctx[i]);
+  }
+  ctx[0].ntbytes = d_blocks(&ctx[0]);
+  for (i = 1; i < started; i++) {
+    pthread_join(threads_[i], NULL);
+  }
+
+  ntbytes = 0;
+  for (i = 0; i < nthreads_; i++) {
+    if (ctx[i].ntbytes < 0) {
+      return -1;
+    }
+    ntbytes += ctx[i].ntbytes;
+  }
+
+  assert(ntbytes <= (int32_t)destsize);
+  return ntbytes;
+}
+
+
 /* Specific routine optimized for decompression a small number of
    items out of a compressed chunk.  This does not use threads because
    it would affect negatively to performance. */
@@ -909,10 +1161,6 @@ int blosc_getitem(const void *src, int start, int nitems, void *dest)
     return (-1);
   }
 
-  /* Parameters needed by blosc_d */
-  params.typesize = typesize;
-  params.flags = flags;
-
   /* Initialize temporaries if needed */
   if (tmp == NULL || tmp2 == NULL || current_temp.blocksize < blocksize) {
     tmp = my_malloc(blocksize);
@@ -958,7 +1206,7 @@ int blosc_getitem(const void *src, int start, int nitems, void *dest)
     }
     else {
       /* Regular decompression.  Put results in tmp2. */
-      cbytes = blosc_d(bsize, leftoverblock,
+      cbytes = blosc_d(typesize, flags, bsize, leftoverblock,
                        (uint8_t *)src+sw32(bstarts[j]), tmp2, tmp, tmp2);
       if (cbytes < 0) {
         ntbytes = cbytes;
@@ -1086,7 +1334,8 @@ static int t_blosc(void *tids)
         }
         else {
           /* Regular compression */
-          cbytes = blosc_c(bsize, leftoverblock, 0, ebsize,
+          cbytes = blosc_c(params.typesize, flags, params.clevel, bsize,
+                           leftoverblock, 0, ebsize,
                            src+nblock_*blocksize, tmp2, tmp);
         }
       }
@@ -1098,7 +1347,7 @@ static int t_blosc(void *tids)
           cbytes = bsize;
         }
         else {
-          cbytes = blosc_d(bsize, leftoverblock,
+          cbytes = blosc_d(params.typesize, flags, bsize, leftoverblock,
                            src+sw32(bstarts[nblock_]), dest+nblock_*blocksize,
                            tmp, tmp2);
         }
@@ -113,6 +113,19 @@ int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
                    const void *src, void *dest, size_t destsize);
 
 
+/**
+  Like `blosc_compress`, but re-entrant and thread-safe: it compresses
+  the blocks of `src` serially in the calling thread with its own
+  temporaries and never takes the global lock, so any number of threads
+  can compress different buffers at once.  Produces the same format
+  (a blocksize forced by `blosc_set_blocksize` still applies).
+*/
+
+int blosc_compress_ctx(int clevel, int doshuffle, size_t typesize,
+                       size_t nbytes, const void *src, void *dest,
+                       size_t destsize);
+
+
 /**
   Decompress a block of compressed data in `src`, put the result in
   `dest` and returns the size of the decompressed block. If error
@@ -131,6 +144,20 @@ int blosc_compress(int clevel, int doshuffle, size_t typesize, size_t nbytes,
 int blosc_decompress(const void *src, void *dest, size_t destsize);
 
 
+/**
+  Like `blosc_decompress`, but re-entrant and thread-safe: it keeps all
+  state on the stack of the caller and never takes the global lock, so
+  any number of threads can decompress different buffers at once.  The
+  blocks of `src` are split among up to `numinternalthreads` threads
+  (the calling thread included) that are started for this call only,
+  which only pays off for buffers of many blocks.  Returns the size of
+  the decompressed data, or a negative value on error.
+*/
+
+int blosc_decompress_ctx(const void *src, void *dest, size_t destsize,
+                         int numinternalthreads);
+
+
 /**
   Get `nitems` (of typesize size) in `src` buffer starting in `start`.
   The items are returned in `dest` buffer, which has to have enough
@@ -4,56 +4,173 @@
 #include <stdlib.h>
 #include <string.h>
 #include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
 
 #include <zlib.h>
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define TSF_HAVE_AVX2_UNPACK
+#endif
 
 // Third party libraries
 #include "sqlite3/sqlite3.h"
 #include "jansson/jansson.h"
 #include "blosc/blosc.h"
+#include "blosc/shuffle.h"
 #include "zstd/lib/zstd.h"
 #include "lz4/lib/lz4.h"
 
+// Decompressed bytes per blosc thread for large chunks, and the most
+// threads one chunk is decompressed with
+#define BLOSC_BYTES_PER_THREAD (1 << 20)
+#define BLOSC_MAX_READ_THREADS 4
+
 #define RETURN_ERR(return_arg)                                                         \
   {                                                                                    \
-    tsf->errmsg = malloc(strlen(fileName) + 100 + strlen(sqlite3_errmsg(tsf->db)));    \
+    tsf->errmsg = tsf_malloc(strlen(fileName) + 100 + strlen(sqlite3_errmsg(tsf->db))); \
     sprintf(tsf->errmsg, "Error opening '%s': %s", fileName, sqlite3_errmsg(tsf->db)); \
     return return_arg;                                                                 \
   }
 
 #define PREP(q, stmt) sqlite3_prepare_v2(tsf->db, q, -1, &stmt, 0);
 
-static char* str_dup(const char* str)
+/*
+ * All allocations go through the pluggable allocator (see tsf_set_allocator)
+ */
+static tsf_malloc_t malloc_fn = malloc;
+static tsf_realloc_t realloc_fn = realloc;
+static tsf_free_t free_fn = free;
+
+bool tsf_set_allocator(tsf_malloc_t m, tsf_realloc_t r, tsf_free_t f)
 {
-  int size = strlen(str) + 1;  // 1 for NULL byte
-  char* dup = malloc(size);
-  memcpy(dup, str, size);
-  return dup;
+  // Mixing allocators would free memory with the wrong one
+  if ((m == NULL) != (r == NULL) || (m == NULL) != (f == NULL))
+    return false;
+  malloc_fn = m ? m : malloc;
+  realloc_fn = r ? r : realloc;
+  free_fn = f ? f : free;
+
+  // Meta-data JSON is parsed with jansson, keep it on the same allocator
+  json_set_alloc_funcs(malloc_fn, free_fn);
+  return true;
+}
+
+void* tsf_malloc(size_t size)
+{
+  return malloc_fn(size);
+}
+
+void* tsf_calloc(size_t count, size_t size)
+{
+  if (size && count > SIZE_MAX / size)
+    return NULL;
+  void* p = malloc_fn(count * size);
+  if (p)
+    memset(p, 0, count * size);
+  return p;
+}
+
+void* tsf_realloc(void* p, size_t size)
+{
+  return realloc_fn(p, size);
+}
+
+void tsf_free(void* p)
+{
+  if (p)
+    free_fn(p);
+}
+
+/*
+ * Bump allocator for per-file meta-data (names, docs, enums, etc). It
+ * is owned by the tsf_file and released in one go when it is closed.
+ */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct tsf_arena_block {
+  struct tsf_arena_block* next;
+  size_t size;
+  size_t used;
+  char data[];
+} tsf_arena_block;
+
+typedef struct tsf_arena {
+  tsf_arena_block* head;  // Current block we bump allocate from
+} tsf_arena;
+
+static tsf_arena_block* arena_new_block(size_t size)
+{
+  tsf_arena_block* b = tsf_malloc(sizeof(tsf_arena_block) + size);
+  b->next = NULL;
+  b->size = size;
+  b->used = 0;
+  return b;
+}
+
+static void* arena_alloc(tsf_arena* a, size_t size)
+{
+  size = (size + 7) & ~(size_t)7;  // Keep 8-byte alignment
+  tsf_arena_block* b = a->head;
+  if (b && b->used + size <= b->size) {
+    void* p = b->data + b->used;
+    b->used += size;
+    return p;
+  }
+  if (b && size > ARENA_BLOCK_SIZE / 4) {
+    // Large allocations get their own block so the current one can keep
+    // being filled.
+    tsf_arena_block* big = arena_new_block(size);
+    big->used = size;
+    big->next = b->next;
+    b->next = big;
+    return big->data;
+  }
+  b = arena_new_block(size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE);
+  b->next = a->head;
+  a->head = b;
+  b->used = size;
+  return b->data;
+}
+
+static void* arena_calloc(tsf_arena* a, size_t count, size_t size)
+{
+  void* p = arena_alloc(a, count * size);
+  memset(p, 0, count * size);
+  return p;
 }
 
-static char* str_join(const char* left, const char* right, char joiner)
+static void arena_free(tsf_arena* a)
 {
-  bool use_joiner = joiner != '\0';
-  int left_size = left ? strlen(left) : 0;
-  int size = left_size + (use_joiner ? 1 : 0) + strlen(right) + 1;
-  char* joined = malloc(size);
-  if (left) {
-    memcpy(joined, left, left_size);
-    free((char*)left);
+  if (!a)
+    return;
+  tsf_arena_block* b = a->head;
+  while (b) {
+    tsf_arena_block* next = b->next;
+    tsf_free(b);
+    b = next;
   }
-  int offset = left_size;
-  if (use_joiner)
-    joined[offset++] = joiner;
-  memcpy(joined + offset, right, strlen(right) + 1);
-  return joined;
+  tsf_free(a);
+}
+
+static char* str_dup(tsf_arena* a, const char* str)
+{
+  if (!str)
+    return NULL;
+  int size = strlen(str) + 1;  // 1 for NULL byte
+  char* dup = arena_alloc(a, size);
+  memcpy(dup, str, size);
+  return dup;
 }
 
-static const char* column_string_clone(sqlite3_stmt* stmt, int iCol)
+static const char* column_string_clone(tsf_arena* a, sqlite3_stmt* stmt, int iCol)
 {
   const unsigned char* str = sqlite3_column_text(stmt, iCol);
+  if (!str)
+    return str_dup(a, "");
   int bytes = sqlite3_column_bytes(stmt, iCol);
   bytes++;  // SQLite always adds a null byte and we want to copy it as well
-  unsigned char* buf = malloc(bytes);
+  unsigned char* buf = arena_alloc(a, bytes);
   memcpy(buf, str, bytes);
   return (const char*)buf;
 }
@@ -107,46 +224,108 @@ static bool is_code_identifier(const char* str)
   return strlen(str) > 0;
 }
 
-static bool field_list_contains_symbol(tsf_field* fields, int size, const char* symbol)
+/*
+ * Open addressing hash from string to int (such as a field or source
+ * offset). Keys are borrowed and must outlive the index. Storage comes
+ * from the file's arena.
+ */
+typedef struct tsf_str_index {
+  int mask;  // capacity - 1, capacity is always a power of two
+  int count;
+  const char** keys;
+  int* values;
+  tsf_arena* arena;
+} tsf_str_index;
+
+static uint32_t str_hash(const char* str)
 {
-  for (int i = 0; i < size; i++)
-    if (strcmp(fields[i].symbol, symbol) == 0)
-      return true;
-  return false;
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *str; str++) {
+    h ^= (unsigned char)*str;
+    h *= 16777619u;
+  }
+  return h;
 }
 
-// Always clone the string
-static const char* str_to_code_identifier(const char* str)
+static tsf_str_index* str_index_new(tsf_arena* a, int expected_count)
 {
-  if (is_code_identifier(str))
-    return str_dup(str);
+  int capacity = 8;
+  while (capacity < expected_count * 2)
+    capacity <<= 1;
+  tsf_str_index* idx = arena_calloc(a, sizeof(tsf_str_index), 1);
+  idx->arena = a;
+  idx->mask = capacity - 1;
+  idx->keys = arena_calloc(a, sizeof(const char*), capacity);
+  idx->values = arena_calloc(a, sizeof(int), capacity);
+  return idx;
+}
 
-  // Remove all non-valid characters
-  char* newStr = calloc(strlen(str) + 1, 1);
-  char* strPtr = newStr;
-  for (int i = 0; i < strlen(str); i++) {
+static int str_index_get(const tsf_str_index* idx, const char* key)
+{
+  if (!idx || !key)
+    return -1;
+  for (uint32_t i = str_hash(key) & idx->mask; idx->keys[i]; i = (i + 1) & idx->mask)
+    if (strcmp(idx->keys[i], key) == 0)
+      return idx->values[i];
+  return -1;
+}
+
+// The first value put for a key wins, returns false if key was present
+static bool str_index_put(tsf_str_index* idx, const char* key, int value)
+{
+  if (!key)
+    return false;
+  if ((idx->count + 1) * 2 > idx->mask + 1) {
+    // Grow and rehash (the old arrays stay in the arena until close)
+    tsf_str_index old = *idx;
+    idx->mask = (idx->mask + 1) * 2 - 1;
+    idx->keys = arena_calloc(idx->arena, sizeof(const char*), idx->mask + 1);
+    idx->values = arena_calloc(idx->arena, sizeof(int), idx->mask + 1);
+    for (int i = 0; i <= old.mask; i++) {
+      if (!old.keys[i])
+        continue;
+      uint32_t j = str_hash(old.keys[i]) & idx->mask;
+      while (idx->keys[j])
+        j = (j + 1) & idx->mask;
+      idx->keys[j] = old.keys[i];
+      idx->values[j] = old.values[i];
+    }
+  }
+  uint32_t i = str_hash(key) & idx->mask;
+  for (; idx->keys[i]; i = (i + 1) & idx->mask)
+    if (strcmp(idx->keys[i], key) == 0)
+      return false;
+  idx->keys[i] = key;
+  idx->values[i] = value;
+  idx->count++;
+  return true;
+}
+
+// Always clone the string. Leaves room to append a 10 digit suffix.
+static char* str_to_code_identifier(tsf_arena* a, const char* str)
+{
+  int len = strlen(str);
+  char* newStr = arena_calloc(a, len + 14, 1);
+  if (is_code_identifier(str)) {
+    memcpy(newStr, str, len);
+    return newStr;
+  }
+
+  // Remove all non-valid characters. If the first char is not a letter
+  // (must be a digit), or nothing is left, prepend 'col'
+  char* strPtr = newStr + 3;
+  for (int i = 0; i < len; i++) {
     if (IS_DIGIT(str[i]) || IS_LETTER(str[i])) {
       *strPtr = str[i];
       strPtr++;
     }
   }
-
-  // If empty return 'col'
-  if (strlen(newStr) == 0) {
+  if (strPtr == newStr + 3 || !IS_LETTER(newStr[3])) {
     memcpy(newStr, "col", 3);
     return newStr;
   }
-
-  // If first char is not letter (must be a digit), prepend 'col'
-  if (!IS_LETTER(newStr[0])) {
-    char* p = calloc(strlen(newStr) + 4, 1);
-    memcpy(p, "col", 3);
-    memcpy(p + 3, newStr, strlen(newStr));
-    free(newStr);
-    return p;
-  }
-
-  return newStr;
+  return newStr + 3;
 }
 
 const char* va_str(tsf_v va, int i)
@@ -163,14 +342,44 @@ const char* va_str(tsf_v va, int i)
   return s;
 }
 
+static bool pool_detach(struct tsf_pool* pool, tsf_file* tsf);
+static void dict_cache_free(struct tsf_dict_cache* cache);
+static void idxmap_cache_free(struct tsf_idxmap_cache* cache);
+
+static int prepare_chunk_tables(tsf_file* tsf)
+{
+  for (int i = 0; i < tsf->chunk_table_count; i++) {
+    tsf_chunk_table* t = &tsf->chunk_tables[i];
+    if (!t->is_chunk_table || !t->name)
+      continue;
+    int buflen = 100 + strlen(t->name);
+    char* buf = tsf_malloc(buflen);
+    snprintf(buf, buflen, "SELECT chunk FROM %s WHERE chunk_id = ?", t->name);
+    int res = PREP(buf, t->q);
+    if (res == SQLITE_OK) {
+      snprintf(buf, buflen,
+               "SELECT chunk_id, chunk FROM %s WHERE chunk_id BETWEEN ? AND ? ORDER BY chunk_id",
+               t->name);
+      res = PREP(buf, t->range_q);
+    }
+    tsf_free(buf);
+    if (res != SQLITE_OK)
+      return res;
+  }
+  return SQLITE_OK;
+}
+
 tsf_file* tsf_open_file(const char* fileName)
 {
   sqlite3* db = NULL;
   int res = sqlite3_open_v2(fileName, &db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0);
   if (db == NULL)
     return NULL;  // Should never happen, sqlite3 always sets db
-  tsf_file* tsf = calloc(sizeof(tsf_file), 1);
+  tsf_file* tsf = tsf_calloc(sizeof(tsf_file), 1);
   tsf->db = db;
+  tsf->arena = tsf_calloc(sizeof(tsf_arena), 1);
+  tsf_arena* a = tsf->arena;
+  tsf->file_name = str_dup(a, fileName);
 
   if (res != SQLITE_OK)
     RETURN_ERR(tsf);
@@ -211,28 +420,28 @@ tsf_file* tsf_open_file(const char* fileName)
   if (res != SQLITE_OK)
     has_idx_table = false;
 
+  int sources_capacity = 0;
   while (sqlite3_step(q_src) == SQLITE_ROW) {
     // Expand our sources array
-    tsf_source* prev = tsf->sources;
-    tsf->sources = calloc(sizeof(tsf_source), tsf->source_count + 1);
-    if (tsf->source_count > 0) {
-      memcpy(tsf->sources, prev, sizeof(tsf_source) * tsf->source_count);
-      free(prev);
+    if (tsf->source_count == sources_capacity) {
+      sources_capacity = sources_capacity ? sources_capacity * 2 : 4;
+      tsf->sources = tsf_realloc(tsf->sources, sizeof(tsf_source) * sources_capacity);
     }
+    memset(&tsf->sources[tsf->source_count], 0, sizeof(tsf_source));
     tsf->source_count++;
 
     tsf_source* s = &tsf->sources[tsf->source_count - 1];
 
     s->source_id = sqlite3_column_int(q_src, 0);
-    s->name = column_string_clone(q_src, 1);
+    s->name = column_string_clone(a, q_src, 1);
     s->entity_count = sqlite3_column_int(q_src, 2);
     if (s->entity_count == 0)
       s->entity_count = -1;  // prefer -1 as indication of "not known"
     s->locus_count = sqlite3_column_int(q_src, 3);
     if (s->locus_count == 0)
       s->locus_count = -1;
-    s->uuid = column_string_clone(q_src, 4);
-    s->date_curated = column_string_clone(q_src, 5);
+    s->uuid = column_string_clone(a, q_src, 4);
+    s->date_curated = column_string_clone(a, q_src, 5);
 
     // Read the doc fields
     const char* docs_json = (const char*)sqlite3_column_text(q_src, 6);
@@ -244,27 +453,42 @@ tsf_file* tsf_open_file(const char* fileName)
       json_object_foreach(docs, key, value)
       {
         if (strcmp(key, "curatedBy") == 0)
-          s->curated_by = str_dup(json_string_value(value));
+          s->curated_by = str_dup(a, json_string_value(value));
         if (strcmp(key, "seriesName") == 0)
-          s->series_name = str_dup(json_string_value(value));
+          s->series_name = str_dup(a, json_string_value(value));
         if (strcmp(key, "sourceVersion") == 0)
-          s->source_version = str_dup(json_string_value(value));
+          s->source_version = str_dup(a, json_string_value(value));
         if (strcmp(key, "descriptionHtml") == 0)
-          s->description_html = str_dup(json_string_value(value));
+          s->description_html = str_dup(a, json_string_value(value));
         if (strcmp(key, "sourceCreditHtml") == 0)
-          s->credit_html = str_dup(json_string_value(value));
+          s->credit_html = str_dup(a, json_string_value(value));
         if (strcmp(key, "curationNotesHtml") == 0)
-          s->notes_html = str_dup(json_string_value(value));
+          s->notes_html = str_dup(a, json_string_value(value));
         if (strcmp(key, "primarySourceUuid") == 0)
-          s->primary_source_uuid = str_dup(json_string_value(value));
+          s->primary_source_uuid = str_dup(a, json_string_value(value));
         if (strcmp(key, "headerLines") == 0) {
-          // go through each array and strcat
-          char* str = 0;
+          // go through each array and join with newlines
+          size_t size = 0;
           for (unsigned int i = 0; i < json_array_size(value); i++) {
             json_t* e = json_array_get(value, i);
             if (json_typeof(e) == JSON_STRING)
-              str = str_join(str, json_string_value(e), '\n');
+              size += strlen(json_string_value(e)) + 1;
+          }
+          if (size == 0)
+            continue;
+          char* str = arena_alloc(a, size);
+          char* cursor = str;
+          for (unsigned int i = 0; i < json_array_size(value); i++) {
+            json_t* e = json_array_get(value, i);
+            if (json_typeof(e) != JSON_STRING)
+              continue;
+            if (cursor != str)
+              *cursor++ = '\n';
+            size_t len = strlen(json_string_value(e));
+            memcpy(cursor, json_string_value(e), len);
+            cursor += len;
           }
+          *cursor = '\0';
           s->header_lines = str;
         }
       }
@@ -296,8 +520,8 @@ tsf_file* tsf_open_file(const char* fileName)
       const char* meta_json = (const char*)sqlite3_column_text(q_idx, 4);
       if (strcmp(type, "idx_gidx") == 0) {
         // Genomic Index
-        s->gidx_query_table = str_dup(query_table);
-        s->gidx_data_table = str_dup(data_table);
+        s->gidx_query_table = str_dup(a, query_table);
+        s->gidx_data_table = str_dup(a, data_table);
         json_t* meta = json_loads(meta_json, 0, &error);
         if (meta) {
           const char* key;
@@ -305,7 +529,7 @@ tsf_file* tsf_open_file(const char* fileName)
           json_object_foreach(meta, key, value)
           {
             if (strcmp(key, "coordSysId") == 0)
-              s->coord_sys_id = str_dup(json_string_value(value));
+              s->coord_sys_id = str_dup(a, json_string_value(value));
             // TODO: Potentially grab and store "usageSpace"
           }
         }
@@ -314,24 +538,24 @@ tsf_file* tsf_open_file(const char* fileName)
     }
 
     // Read the fields
+    int fields_capacity = 0;
     sqlite3_reset(q_field);
     sqlite3_bind_int(q_field, 1, s->source_id);
     while (sqlite3_step(q_field) == SQLITE_ROW) {
       // Expand our fields array
-      tsf_field* prev = s->fields;
-      s->fields = calloc(sizeof(tsf_field), s->field_count + 1);
-      if (s->field_count > 0) {
-        memcpy(s->fields, prev, sizeof(tsf_field) * s->field_count);
-        free(prev);
+      if (s->field_count == fields_capacity) {
+        fields_capacity = fields_capacity ? fields_capacity * 2 : 16;
+        s->fields = tsf_realloc(s->fields, sizeof(tsf_field) * fields_capacity);
       }
+      memset(&s->fields[s->field_count], 0, sizeof(tsf_field));
       s->field_count++;
 
       tsf_field* f = &s->fields[s->field_count - 1];
 
       f->idx = sqlite3_column_int(q_field, 0);
       f->table_idx = sqlite3_column_int(q_field, 1) - 1;
-      f->locus_idx_map = column_string_clone(q_field, 2);
-      f->entity_idx_map = column_string_clone(q_field, 3);
+      f->locus_idx_map = column_string_clone(a, q_field, 2);
+      f->entity_idx_map = column_string_clone(a, q_field, 3);
       f->table_field_idx = sqlite3_column_int(q_field, 4);  // Coerce from TEXT field
 
       f->value_type = str_to_value_type((const char*)sqlite3_column_text(q_field, 5));
@@ -371,42 +595,42 @@ tsf_file* tsf_open_file(const char* fileName)
         json_object_foreach(meta, key, value)
         {
           if (strcmp(key, "name") == 0)
-            f->name = str_dup(json_string_value(value));
+            f->name = str_dup(a, json_string_value(value));
           if (strcmp(key, "symbol") == 0)
-            f->symbol = str_dup(json_string_value(value));
+            f->symbol = str_dup(a, json_string_value(value));
           // TODO: Could support format_flags
           // if(strcmp(key, "format") == 0)
-          //  f->format_flags = str_dup(json_string_value(value));
+          //  f->format_flags = str_dup(a, json_string_value(value));
           if (strcmp(key, "doc") == 0)
-            f->doc = str_dup(json_string_value(value));
+            f->doc = str_dup(a, json_string_value(value));
           if (strcmp(key, "urlTemplate") == 0)
-            f->url_template = str_dup(json_string_value(value));
+            f->url_template = str_dup(a, json_string_value(value));
           if (strcmp(key, "enum") == 0) {
             if (f->enum_count == 0) {
               f->enum_count = json_array_size(value);
-              f->enum_names = calloc(sizeof(const char*), f->enum_count);
-              f->enum_docs = calloc(sizeof(const char*), f->enum_count);
+              f->enum_names = arena_calloc(a, sizeof(const char*), f->enum_count);
+              f->enum_docs = arena_calloc(a, sizeof(const char*), f->enum_count);
             }
             for (unsigned int i = 0; i < f->enum_count; i++) {
               json_t* e = json_array_get(value, i);
               if (json_typeof(e) == JSON_ARRAY) {
                 if (json_array_size(e) < 2) {
                   // Shouldn't happen, but need placeholder
-                  f->enum_names[i] = str_dup("");
-                  f->enum_docs[i] = str_dup("");
+                  f->enum_names[i] = str_dup(a, "");
+                  f->enum_docs[i] = str_dup(a, "");
                   continue;
                 }
-                f->enum_names[i] = str_dup(json_string_value(json_array_get(e, 0)));
+                f->enum_names[i] = str_dup(a, json_string_value(json_array_get(e, 0)));
                 json_t* enum_params_pairs = json_array_get(e, 1);
                 for (int j = 0; j < json_array_size(enum_params_pairs); j++) {
                   json_t* pair = json_array_get(enum_params_pairs, j);
                   const char* key = json_string_value(json_array_get(pair, 0));
                   const char* value = json_string_value(json_array_get(pair, 0));
                   if (key && value && strcmp(key, "doc") == 0)
-                    f->enum_docs[i] = str_dup(value);
+                    f->enum_docs[i] = str_dup(a, value);
                 }
                 if (!f->enum_docs[i])
-                  f->enum_docs[i] = str_dup("");
+                  f->enum_docs[i] = str_dup(a, "");
               }
             }
           }
@@ -426,34 +650,47 @@ tsf_file* tsf_open_file(const char* fileName)
       json_decref(meta);
     }
 
-    // Fill in symbol if not set by source
+    // Fill in symbol if not set by source and index the field lookups
+    s->symbol_index = str_index_new(a, s->field_count);
+    s->name_index = str_index_new(a, s->field_count);
     for (int i = 0; i < s->field_count; i++) {
-      if (s->fields[i].symbol)
-        continue;
-      s->fields[i].symbol = str_to_code_identifier(s->fields[i].name);
-      char* base_str = str_dup(s->fields[i].symbol);
-      // Make sure its unique
-      int count = 2;
-      while (field_list_contains_symbol(s->fields, i, s->fields[i].symbol)) {
-        int size = strlen(base_str) + 5;
-        free((char*)s->fields[i].symbol);
-        s->fields[i].symbol = calloc(size, 1);
-        snprintf((char*)s->fields[i].symbol, size, "%s%d", base_str, count);
-        count++;
+      tsf_field* f = &s->fields[i];
+      if (!f->symbol) {
+        char* symbol = str_to_code_identifier(a, f->name);
+        f->symbol = symbol;
+        // Make sure its unique by appending a count to the base symbol
+        int base_len = strlen(symbol);
+        int count = 2;
+        while (str_index_get(s->symbol_index, f->symbol) >= 0) {
+          snprintf(symbol + base_len, 11, "%d", count);
+          count++;
+        }
+      }
+      str_index_put(s->symbol_index, f->symbol, i);
+      str_index_put(s->name_index, f->name, i);
+
+      if (f->enum_count > 0) {
+        f->enum_index = str_index_new(a, f->enum_count);
+        for (int k = 0; k < f->enum_count; k++)
+          str_index_put(f->enum_index, f->enum_names[k], k);
       }
-      free(base_str);
     }
   }
 
+  tsf->uuid_index = str_index_new(a, tsf->source_count);
+  for (int i = 0; i < tsf->source_count; i++)
+    str_index_put(tsf->uuid_index, tsf->sources[i].uuid, i);
+
   // Read state and prep queries for chunk tables
+  int tables_capacity = 0;
   while (sqlite3_step(q_tbl) == SQLITE_ROW) {
     // Expand our chunk_tables array
-    tsf_chunk_table* prev = tsf->chunk_tables;
-    tsf->chunk_tables = calloc(sizeof(tsf_chunk_table), tsf->chunk_table_count + 1);
-    if (tsf->chunk_table_count > 0) {
-      memcpy(tsf->chunk_tables, prev, sizeof(tsf_chunk_table) * tsf->chunk_table_count);
-      free(prev);
+    if (tsf->chunk_table_count == tables_capacity) {
+      tables_capacity = tables_capacity ? tables_capacity * 2 : 4;
+      tsf->chunk_tables =
+          tsf_realloc(tsf->chunk_tables, sizeof(tsf_chunk_table) * tables_capacity);
     }
+    memset(&tsf->chunk_tables[tsf->chunk_table_count], 0, sizeof(tsf_chunk_table));
     tsf->chunk_table_count++;
 
     tsf_chunk_table* t = &tsf->chunk_tables[tsf->chunk_table_count - 1];
@@ -470,17 +707,9 @@ tsf_file* tsf_open_file(const char* fileName)
       len = strchr(uri, '&') - uri;
     if (len <= 0)
       continue;  // Unable to parse a name
-    t->name = calloc(len + 1, 1);
+    t->name = arena_calloc(a, len + 1, 1);
     memcpy((char*)t->name, uri, len);
 
-    int buflen = 57 + strlen(t->name);
-    char* buf = calloc(buflen, 1);
-    snprintf(buf, buflen, "SELECT chunk FROM %s WHERE chunk_id = ?", t->name);
-    res = PREP(buf, t->q);
-    free(buf);
-    if (res != SQLITE_OK)
-      RETURN_ERR(tsf);
-
     // Now parse the meta-data
     const char* table_meta = (const char*)sqlite3_column_text(q_tbl, 3);
     json_error_t error;
@@ -501,7 +730,7 @@ tsf_file* tsf_open_file(const char* fileName)
     }
     json_decref(meta);
     t->chunk_size = 1 << t->chunk_bits;
-    t->scratch_array_sizes = malloc(t->chunk_size * sizeof(int));
+    t->scratch_array_sizes = tsf_malloc(t->chunk_size * sizeof(int));
   }
 
   sqlite3_finalize(q_src);
@@ -509,61 +738,306 @@ tsf_file* tsf_open_file(const char* fileName)
   sqlite3_finalize(q_field);
   sqlite3_finalize(q_idx);
 
+  res = prepare_chunk_tables(tsf);
+  if (res != SQLITE_OK)
+    RETURN_ERR(tsf);
+
   return tsf;
 }
 
-void tsf_close_file(tsf_file* tsf)
+// Close the SQLite connection but keep all the parsed meta-data
+static void tsf_disconnect(tsf_file* tsf)
 {
-  free(tsf->errmsg);
-  for (int i = 0; i < tsf->source_count; i++) {
-    tsf_source* s = &tsf->sources[i];
-    free((char*)s->name);
-    free((char*)s->uuid);
-    free((char*)s->err);
-    free((char*)s->date_curated);
-    free((char*)s->curated_by);
-    free((char*)s->series_name);
-    free((char*)s->source_version);
-    free((char*)s->description_html);
-    free((char*)s->credit_html);
-    free((char*)s->notes_html);
-    free((char*)s->header_lines);
-    free((char*)s->coord_sys_id);
-    free((char*)s->gidx_query_table);
-    free((char*)s->gidx_data_table);
-    free((char*)s->primary_source_uuid);
-    for (int j = 0; j < s->field_count; j++) {
-      tsf_field* f = &s->fields[j];
-      free((char*)f->name);
-      free((char*)f->symbol);
-      free((char*)f->doc);
-      free((char*)f->url_template);
-      for (int k = 0; k < f->enum_count; k++) {
-        free((char*)f->enum_names[k]);
-        free((char*)f->enum_docs[k]);
-      }
-      free(f->enum_names);
-      free(f->enum_docs);
-      free((char*)f->locus_idx_map);
-      free((char*)f->entity_idx_map);
-    }
-    free(s->fields);
-  }
-  free(tsf->sources);
-
   for (int i = 0; i < tsf->chunk_table_count; i++) {
-    free((char*)tsf->chunk_tables[i].name);
-    free(tsf->chunk_tables[i].scratch_array_sizes);
     sqlite3_finalize(tsf->chunk_tables[i].q);
+    tsf->chunk_tables[i].q = NULL;
+    sqlite3_finalize(tsf->chunk_tables[i].range_q);
+    tsf->chunk_tables[i].range_q = NULL;
   }
-  free(tsf->chunk_tables);
-
   int res = sqlite3_close_v2(tsf->db);
   if (res == SQLITE_BUSY)
     fprintf(stderr, "TSF SQLite database failed to close because of un-finalized() statements");
-  free(tsf);
+  tsf->db = NULL;
+}
+
+// Re-open the SQLite connection of a file whose meta-data is already
+// loaded (see tsf_pool).
+static bool tsf_connect(tsf_file* tsf)
+{
+  if (tsf->db)
+    return true;
+  const char* fileName = tsf->file_name;
+  tsf_free(tsf->errmsg);
+  tsf->errmsg = NULL;
+  int res = sqlite3_open_v2(fileName, &tsf->db, SQLITE_OPEN_READONLY | SQLITE_OPEN_NOMUTEX, 0);
+  if (res == SQLITE_OK)
+    res = prepare_chunk_tables(tsf);
+  if (res != SQLITE_OK) {
+    tsf->errmsg = tsf_malloc(strlen(fileName) + 100 + strlen(sqlite3_errmsg(tsf->db)));
+    sprintf(tsf->errmsg, "Error opening '%s': %s", fileName, sqlite3_errmsg(tsf->db));
+    tsf_disconnect(tsf);
+    return false;
+  }
+  return true;
+}
+
+void tsf_close_file(tsf_file* tsf)
+{
+  if (tsf->pool && !pool_detach(tsf->pool, tsf))
+    return;  // Still open by other tsf_pool_open callers
+
+  tsf_free(tsf->errmsg);
+
+  // All strings and lookup tables live in the arena
+  for (int i = 0; i < tsf->source_count; i++)
+    tsf_free(tsf->sources[i].fields);
+  tsf_free(tsf->sources);
+
+  if (tsf->db)
+    tsf_disconnect(tsf);
+  for (int i = 0; i < tsf->chunk_table_count; i++)
+    tsf_free(tsf->chunk_tables[i].scratch_array_sizes);
+  tsf_free(tsf->chunk_tables);
+  dict_cache_free(tsf->dicts);
+  idxmap_cache_free(tsf->idxmaps);
+  arena_free(tsf->arena);
+  tsf_free(tsf);
+}
+
+/*
+ * File pool: caps the number of open SQLite connections across many
+ * files. Files that are not pinned by an iterator sit on an LRU list
+ * and the least recently used are disconnected when over the cap. Their
+ * meta-data stays resident and they reconnect on the next acquire.
+ */
+struct tsf_pool {
+  pthread_mutex_t mutex;
+  int max_connections;
+  int connection_count;
+
+  int file_count;
+  int file_capacity;
+  tsf_file** files;
+
+  // Idle (connected, unpinned) files, most recently used at the head
+  tsf_file* lru_head;
+  tsf_file* lru_tail;
+};
+
+static void lru_remove(tsf_pool* pool, tsf_file* tsf)
+{
+  if (tsf->lru_prev)
+    tsf->lru_prev->lru_next = tsf->lru_next;
+  else if (pool->lru_head == tsf)
+    pool->lru_head = tsf->lru_next;
+  else
+    return;  // Not on the list
+  if (tsf->lru_next)
+    tsf->lru_next->lru_prev = tsf->lru_prev;
+  else
+    pool->lru_tail = tsf->lru_prev;
+  tsf->lru_prev = tsf->lru_next = NULL;
+}
+
+static void lru_push_head(tsf_pool* pool, tsf_file* tsf)
+{
+  tsf->lru_prev = NULL;
+  tsf->lru_next = pool->lru_head;
+  if (pool->lru_head)
+    pool->lru_head->lru_prev = tsf;
+  pool->lru_head = tsf;
+  if (!pool->lru_tail)
+    pool->lru_tail = tsf;
+}
+
+// Disconnect idle files until there is room for `needed` more connections
+static void pool_evict(tsf_pool* pool, int needed)
+{
+  while (pool->connection_count + needed > pool->max_connections && pool->lru_tail) {
+    tsf_file* victim = pool->lru_tail;
+    lru_remove(pool, victim);
+    tsf_disconnect(victim);
+    pool->connection_count--;
+  }
+}
+
+// Drops a reference to a pooled file, removing it from the pool and
+// returning true if it was the last
+static bool pool_detach(tsf_pool* pool, tsf_file* tsf)
+{
+  pthread_mutex_lock(&pool->mutex);
+  if (--tsf->pool_refs > 0) {
+    pthread_mutex_unlock(&pool->mutex);
+    return false;
+  }
+  lru_remove(pool, tsf);
+  if (tsf->db)
+    pool->connection_count--;
+  for (int i = 0; i < pool->file_count; i++) {
+    if (pool->files[i] == tsf) {
+      pool->files[i] = pool->files[--pool->file_count];
+      break;
+    }
+  }
+  tsf->pool = NULL;
+  pthread_mutex_unlock(&pool->mutex);
+  return true;
+}
+
+tsf_pool* tsf_pool_create(int max_connections)
+{
+  tsf_pool* pool = tsf_calloc(sizeof(tsf_pool), 1);
+  pthread_mutex_init(&pool->mutex, NULL);
+  pool->max_connections = max_connections > 0 ? max_connections : 1;
+  return pool;
+}
+
+// The pooled file opened from fileName with a new reference, or NULL
+static tsf_file* pool_find(tsf_pool* pool, const char* fileName)
+{
+  for (int i = 0; i < pool->file_count; i++) {
+    if (strcmp(pool->files[i]->file_name, fileName) == 0) {
+      pool->files[i]->pool_refs++;
+      return pool->files[i];
+    }
+  }
+  return NULL;
+}
+
+tsf_file* tsf_pool_open(tsf_pool* pool, const char* fileName)
+{
+  pthread_mutex_lock(&pool->mutex);
+  tsf_file* found = pool_find(pool, fileName);
+  pthread_mutex_unlock(&pool->mutex);
+  if (found)
+    return found;
+
+  // Parsed without holding the pool, which is briefly over its cap
+  tsf_file* tsf = tsf_open_file(fileName);
+  if (!tsf || tsf->errmsg)
+    return tsf;  // Not pooled, caller closes it
+
+  pthread_mutex_lock(&pool->mutex);
+  found = pool_find(pool, fileName);
+  if (found) {
+    // Opened by another thread meanwhile
+    pthread_mutex_unlock(&pool->mutex);
+    tsf_close_file(tsf);
+    return found;
+  }
+  pool_evict(pool, 1);
+  if (pool->file_count == pool->file_capacity) {
+    pool->file_capacity = pool->file_capacity ? pool->file_capacity * 2 : 16;
+    pool->files = tsf_realloc(pool->files, sizeof(tsf_file*) * pool->file_capacity);
+  }
+  pool->files[pool->file_count++] = tsf;
+  tsf->pool = pool;
+  tsf->pool_refs = 1;
+  pool->connection_count++;
+  lru_push_head(pool, tsf);
+  pthread_mutex_unlock(&pool->mutex);
+  return tsf;
+}
+
+int tsf_pool_connection_count(tsf_pool* pool)
+{
+  pthread_mutex_lock(&pool->mutex);
+  int count = pool->connection_count;
+  pthread_mutex_unlock(&pool->mutex);
+  return count;
+}
+
+void tsf_pool_close(tsf_pool* pool)
+{
+  if (!pool)
+    return;
+  while (pool->file_count > 0) {
+    tsf_file* tsf = pool->files[pool->file_count - 1];
+    tsf->pool_refs = 1;  // Closed whoever else holds it
+    tsf_close_file(tsf);
+  }
+  tsf_free(pool->files);
+  pthread_mutex_destroy(&pool->mutex);
+  tsf_free(pool);
+}
+
+bool tsf_file_acquire(tsf_file* tsf)
+{
+  tsf_pool* pool = tsf->pool;
+  if (!pool) {
+    if (!tsf->db)
+      return false;
+    tsf->pin_count++;
+    return true;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  if (tsf->db) {
+    lru_remove(pool, tsf);
+    tsf->pin_count++;
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+  }
+
+  // Reserve the connection, then connect without holding the pool. The
+  // file is off the LRU list while disconnected, so no eviction sees it.
+  pool_evict(pool, 1);
+  pool->connection_count++;
+  pthread_mutex_unlock(&pool->mutex);
+
+  bool ok = tsf_connect(tsf);
+
+  pthread_mutex_lock(&pool->mutex);
+  if (ok)
+    tsf->pin_count++;
+  else
+    pool->connection_count--;
+  pthread_mutex_unlock(&pool->mutex);
+  return ok;
+}
+
+void tsf_file_release(tsf_file* tsf)
+{
+  tsf_pool* pool = tsf->pool;
+  if (!pool) {
+    tsf->pin_count--;
+    return;
+  }
+
+  pthread_mutex_lock(&pool->mutex);
+  tsf->pin_count--;
+  if (tsf->pin_count == 0 && tsf->db) {
+    lru_push_head(pool, tsf);
+    pool_evict(pool, 0);
+  }
+  pthread_mutex_unlock(&pool->mutex);
+}
+
+tsf_source* tsf_source_by_uuid(tsf_file* tsf, const char* uuid)
+{
+  int i = str_index_get(tsf->uuid_index, uuid);
+  return i < 0 ? NULL : &tsf->sources[i];
+}
+
+tsf_field* tsf_field_by_symbol(tsf_source* s, const char* symbol)
+{
+  int i = str_index_get(s->symbol_index, symbol);
+  return i < 0 ? NULL : &s->fields[i];
+}
+
+tsf_field* tsf_field_by_name(tsf_source* s, const char* name)
+{
+  int i = str_index_get(s->name_index, name);
+  return i < 0 ? NULL : &s->fields[i];
+}
+
+int tsf_enum_value_by_name(tsf_field* f, const char* name)
+{
+  return str_index_get(f->enum_index, name);
 }
 
+static int fixed_value_size(tsf_value_type type);
+
 static void* error(const char* msg)
 {
   fprintf(stderr, "%s\n", msg);
@@ -577,7 +1051,7 @@ tsf_iter* tsf_query_table(tsf_file* tsf, int source_id, int field_count, int* fi
     return NULL;
 
   // Prepare some queries before we continue
-  tsf_iter* iter = calloc(sizeof(tsf_iter), 1);
+  tsf_iter* iter = tsf_calloc(sizeof(tsf_iter), 1);
   iter->tsf = tsf;
   iter->source_id = source_id;
   iter->cur_record_id = -1;
@@ -592,14 +1066,14 @@ tsf_iter* tsf_query_table(tsf_file* tsf, int source_id, int field_count, int* fi
   if (field_count < 0) {
     // Default to all locus attribute fields
     iter->field_count = 0;
-    iter->fields = calloc(sizeof(tsf_file*), s->field_count);
+    iter->fields = tsf_calloc(sizeof(tsf_file*), s->field_count);
     for (int i = 0; i < s->field_count; i++) {
       if (s->fields[i].field_type == iter->field_type)
         iter->fields[iter->field_count++] = &s->fields[i];
     }
   } else {
     iter->field_count = field_count;
-    iter->fields = calloc(sizeof(tsf_file*), iter->field_count);
+    iter->fields = tsf_calloc(sizeof(tsf_file*), iter->field_count);
     if(field_count > 0 && iter->field_type == FieldTypeInvalid)
       iter->field_type = s->fields[field_idxs[0]].field_type;
     for (int i = 0; i < iter->field_count; i++) {
@@ -619,29 +1093,113 @@ tsf_iter* tsf_query_table(tsf_file* tsf, int source_id, int field_count, int* fi
     if (entity_count <= 0) {
       // Default to all entities
       iter->entity_count = s->entity_count;
-      iter->entity_ids = malloc(sizeof(int) * s->entity_count);
+      iter->entity_ids = tsf_malloc(sizeof(int) * s->entity_count);
       for (int i = 0; i < iter->entity_count; i++)
         iter->entity_ids[i] = i;
     } else {
       iter->entity_count = entity_count;
-      iter->entity_ids = malloc(sizeof(int) * entity_count);
+      iter->entity_ids = tsf_malloc(sizeof(int) * entity_count);
       memcpy(iter->entity_ids, entity_ids, sizeof(int) * entity_count);
     }
   }
 
-  iter->cur_values = calloc(sizeof(tsf_v), iter->field_count);
-  iter->cur_nulls = calloc(sizeof(bool), iter->field_count);
-  int chunk_count =
-      iter->is_matrix_iter ? iter->field_count * iter->entity_count : iter->field_count;
-  iter->chunks = calloc(sizeof(tsf_chunk), chunk_count);
+  iter->cur_values = tsf_calloc(sizeof(tsf_v), iter->field_count);
+  iter->cur_nulls = tsf_calloc(sizeof(bool), iter->field_count);
+  iter->field_stats = tsf_calloc(sizeof(tsf_field_stats), iter->field_count);
+  iter->chunks = tsf_calloc(sizeof(tsf_chunk), iter->field_count);
 
   // Intialize chunk_id to an invalid number (0 is valid).
-  for (int i = 0; i < chunk_count; i++)
+  for (int i = 0; i < iter->field_count; i++)
     iter->chunks[i].chunk_id = -1;
+  if (iter->is_matrix_iter && iter->entity_count > 0)
+    iter->matrix_slots =
+        tsf_calloc(sizeof(tsf_matrix_slot*), (size_t)iter->field_count * iter->entity_count);
+
+  iter->trace_start_ns = tsf_clock_ns();
 
+  // Keep the file connected for the lifetime of the iterator
+  if (!tsf_file_acquire(tsf)) {
+    iter->tsf = NULL;
+    tsf_iter_close(iter);
+    return error("Unable to connect to TSF file");
+  }
   return iter;
 }
 
+/*
+ * Entity attributes loaded into columns once per source, with a hashed
+ * lookup of entities by name. Everything lives in the file's arena.
+ */
+const tsf_entity_table* tsf_source_entities(tsf_file* tsf, int source_id)
+{
+  if (!tsf || source_id < 1 || source_id > tsf->source_count)
+    return NULL;
+  tsf_source* s = &tsf->sources[source_id - 1];
+  if (s->entities)
+    return s->entities;
+  if (s->entity_count <= 0)
+    return error("Source has no entities");
+
+  tsf_iter* iter = tsf_query_table(tsf, source_id, -1, NULL, -1, NULL, FieldEntityAttribute);
+  if (!iter)
+    return NULL;
+  tsf_arena* a = tsf->arena;
+  int n = s->entity_count;
+  tsf_entity_table* e = arena_calloc(a, sizeof(tsf_entity_table), 1);
+  e->entity_count = n;
+  e->field_count = iter->field_count;
+  e->fields = arena_calloc(a, sizeof(tsf_field*), iter->field_count);
+  e->columns = arena_calloc(a, sizeof(void*), iter->field_count);
+  e->nulls = arena_calloc(a, sizeof(bool*), iter->field_count);
+  e->name_field = -1;
+  bool ok = true;
+  for (int i = 0; i < iter->field_count && ok; i++) {
+    tsf_field* f = iter->fields[i];
+    e->fields[i] = f;
+    bool is_string = f->value_type == TypeString;
+    int value_size = is_string ? (int)sizeof(const char*) : fixed_value_size(f->value_type);
+    if (value_size == 0)
+      continue;  // Array fields are not loaded
+    char* column = arena_alloc(a, (size_t)value_size * n);
+    e->columns[i] = column;
+    e->nulls[i] = arena_alloc(a, sizeof(bool) * n);
+    if (is_string && e->name_field < 0)
+      e->name_field = i;
+
+    tsf_batch batch;
+    for (int r = 0; r < n && ok; r += batch.count) {
+      ok = tsf_iter_read_batch(iter, i, r, n - r, &batch);
+      for (int j = 0; ok && j < batch.count; j++) {
+        tsf_v v = batch.values[batch.is_constant ? 0 : j];
+        bool is_null = batch.nulls[batch.is_constant ? 0 : j];
+        e->nulls[i][r + j] = is_null;
+        if (is_string)
+          ((const char**)column)[r + j] = is_null ? NULL : str_dup(a, v_str(v));
+        else
+          memcpy(column + (size_t)(r + j) * value_size, v, value_size);
+      }
+    }
+  }
+  tsf_iter_close(iter);
+  if (!ok)
+    return NULL;
+
+  if (e->name_field >= 0) {
+    const char** names = e->columns[e->name_field];
+    e->name_index = str_index_new(a, n);
+    for (int r = 0; r < n; r++)
+      str_index_put(e->name_index, names[r], r);
+  }
+  s->entities = e;
+  return e;
+}
+
+int tsf_entity_by_name(tsf_file* tsf, int source_id, const char* name)
+{
+  const tsf_entity_table* e = tsf_source_entities(tsf, source_id);
+  return e ? str_index_get(e->name_index, name) : -1;
+}
+
 static int expcted_size(const unsigned char* data)
 {
   if (!data)
@@ -674,14 +1232,81 @@ static bool zlib_uncompress(char* dest, unsigned long expectedSize,
   return true;
 }
 
-static bool zstd_uncompress(char* dest, int expectedSize, const char* data, int nbytes)
+/*
+ * Zstd dictionaries. Chunks with header.zstd_dict set were compressed
+ * with the zstd_dict row future4 (one is trained per string field by
+ * the writer). Each is loaded once per file and decompressed with a
+ * single reused context, as a file is only read by one thread at a time.
+ */
+struct tsf_dict_cache {
+  int count;
+  uint32_t* ids;
+  ZSTD_DDict** ddicts;
+  ZSTD_DCtx* dctx;
+};
+
+static ZSTD_DDict* zstd_dict(tsf_file* tsf, uint32_t id)
+{
+  if (!tsf->dicts)
+    tsf->dicts = tsf_calloc(1, sizeof(struct tsf_dict_cache));
+  struct tsf_dict_cache* cache = tsf->dicts;
+  for (int i = 0; i < cache->count; i++)
+    if (cache->ids[i] == id)
+      return cache->ddicts[i];
+
+  sqlite3_stmt* q;
+  if (sqlite3_prepare_v2(tsf->db, "SELECT dict FROM zstd_dict WHERE id = ?", -1, &q, 0) !=
+      SQLITE_OK)
+    return error("File has dictionary compressed chunks but no zstd_dict table");
+  sqlite3_bind_int64(q, 1, id);
+  ZSTD_DDict* ddict = NULL;
+  if (sqlite3_step(q) == SQLITE_ROW)
+    ddict = ZSTD_createDDict(sqlite3_column_blob(q, 0), sqlite3_column_bytes(q, 0));
+  sqlite3_finalize(q);
+  if (!ddict)
+    return error("zstd dictionary of chunk not found");
+
+  cache->ids = tsf_realloc(cache->ids, sizeof(uint32_t) * (cache->count + 1));
+  cache->ddicts = tsf_realloc(cache->ddicts, sizeof(ZSTD_DDict*) * (cache->count + 1));
+  cache->ids[cache->count] = id;
+  cache->ddicts[cache->count] = ddict;
+  cache->count++;
+  return ddict;
+}
+
+static void dict_cache_free(struct tsf_dict_cache* cache)
+{
+  if (!cache)
+    return;
+  for (int i = 0; i < cache->count; i++)
+    ZSTD_freeDDict(cache->ddicts[i]);
+  if (cache->dctx)
+    ZSTD_freeDCtx(cache->dctx);
+  tsf_free(cache->ids);
+  tsf_free(cache->ddicts);
+  tsf_free(cache);
+}
+
+static bool zstd_uncompress(tsf_file* tsf, tsf_chunk_header* header, char* dest,
+                            int expectedSize, const char* data, int nbytes)
 {
   if (!data)
     return false;
 
   // 4 is the size header in the beginning of our compressed buffer
-  size_t size = ZSTD_decompress(dest, expectedSize, data + 4, nbytes - 4);
-  if(size != expectedSize)
+  size_t size;
+  if (header->zstd_dict) {
+    ZSTD_DDict* ddict = zstd_dict(tsf, header->future4);
+    if (!ddict)
+      return false;
+    if (!tsf->dicts->dctx)
+      tsf->dicts->dctx = ZSTD_createDCtx();
+    size = ZSTD_decompress_usingDDict(tsf->dicts->dctx, dest, expectedSize, data + 4, nbytes - 4,
+                                      ddict);
+  } else {
+    size = ZSTD_decompress(dest, expectedSize, data + 4, nbytes - 4);
+  }
+  if(size != (size_t)expectedSize)
     return false;
   return true;
 }
@@ -698,90 +1323,877 @@ static bool lz4_uncompress(char* dest, int expectedSize, const char* data, int n
   return true;
 }
 
-static bool read_chunk(tsf_chunk_table* t, tsf_chunk* c, int64_t chunk_id, tsf_stats* stats)
+/*
+ * Lightweight encodings (see tsf_chunk_encoding), decoded after the
+ * codec into a plain array of header.n 4-byte values.
+ */
+static uint32_t read_le32(const unsigned char* p)
 {
-  clock_t cstart = clock();
-  clock_t cend = 0;
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
 
-  sqlite3_reset(t->q);
-  sqlite3_bind_int64(t->q, 1, chunk_id);
-  if (sqlite3_step(t->q) != SQLITE_ROW)
-    return (bool)error("Expected chunk was not found in DB");
-  const char* raw_data = (const char*)sqlite3_column_blob(t->q, 0);
-  int size = sqlite3_column_bytes(t->q, 0);
+// Words of n bit-packed values
+static int64_t packed_words(int n, int bits)
+{
+  return ((int64_t)n * bits + 31) / 32;
+}
 
-  cend = clock();
-  stats->read_time += (int)(cend-cstart);
-  stats->read_chunk_bytes += size;
-  cstart = cend;
+#ifdef TSF_HAVE_AVX2_UNPACK
+// Unpacks 8 values at a time, each lane gathering the two words its bits
+// span. Stops before the group whose last lane would read past the
+// words, returning the number of values unpacked.
+__attribute__((target("avx2")))
+static int bit_unpack_avx2(const unsigned char* words, int bits, int n, uint32_t base,
+                           uint32_t* out)
+{
+  int64_t word_count = packed_words(n, bits);
+  __m256i lane_bits = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7),
+                                         _mm256_set1_epi32(bits));
+  __m256i mask = _mm256_set1_epi32(bits == 32 ? -1 : (int)((1U << bits) - 1));
+  __m256i vbase = _mm256_set1_epi32((int)base);
+  __m256i thirty_one = _mm256_set1_epi32(31);
+  __m256i thirty_two = _mm256_set1_epi32(32);
+  int i = 0;
+  for (; i + 8 <= n && (((int64_t)(i + 7) * bits) >> 5) + 1 < word_count; i += 8) {
+    __m256i pos = _mm256_add_epi32(_mm256_set1_epi32(i * bits), lane_bits);
+    __m256i idx = _mm256_srli_epi32(pos, 5);
+    __m256i shift = _mm256_and_si256(pos, thirty_one);
+    __m256i lo = _mm256_i32gather_epi32((const int*)words, idx, 4);
+    __m256i hi = _mm256_i32gather_epi32((const int*)(words + 4), idx, 4);
+    // Shifting hi left by 32 when shift is 0 yields 0, as wanted
+    __m256i v = _mm256_or_si256(_mm256_srlv_epi32(lo, shift),
+                                _mm256_sllv_epi32(hi, _mm256_sub_epi32(thirty_two, shift)));
+    v = _mm256_add_epi32(_mm256_and_si256(v, mask), vbase);
+    _mm256_storeu_si256((__m256i*)(out + i), v);
+  }
+  return i;
+}
 
-  if (size < HEADER_SIZE) {
-    return (bool)error("Less than 16 bytes expected for header of chunk");
+static bool have_avx2(void)
+{
+  static int supported = -1;  // Benign race, every thread computes the same
+  if (supported < 0)
+    supported = __builtin_cpu_supports("avx2") ? 1 : 0;
+  return supported;
+}
+#endif
+
+// Unpacks n values of bits (0-32) each, LSB first, adding base
+static void bit_unpack(const unsigned char* words, int bits, int n, uint32_t base,
+                       uint32_t* out)
+{
+  if (bits == 0) {
+    for (int i = 0; i < n; i++)
+      out[i] = base;
+    return;
   }
-  memcpy(&c->header, raw_data, HEADER_SIZE);
-  if (c->header.magic[0] != CHUNK_MAGIC_B0 || c->header.magic[1] != CHUNK_MAGIC_B1) {
-    return (bool)error(
-        "Chunk did not start with expected magic 2 bytes. Possibly corrupted or created with newer "
-        "software.");
+  int first = 0;
+#ifdef TSF_HAVE_AVX2_UNPACK
+  if (have_avx2())
+    first = bit_unpack_avx2(words, bits, n, base, out);
+#endif
+  uint64_t mask = bits == 32 ? 0xFFFFFFFFULL : (1ULL << bits) - 1;
+  int64_t bit = (int64_t)first * bits;
+  int64_t w = bit >> 5;
+  uint64_t window = 0;
+  int window_bits = 0;
+  if (bit & 31) {
+    window = read_le32(words + 4 * w) >> (bit & 31);
+    window_bits = 32 - (bit & 31);
+    w++;
+  }
+  for (int i = first; i < n; i++) {
+    if (window_bits < bits) {
+      window |= (uint64_t)read_le32(words + 4 * w) << window_bits;
+      window_bits += 32;
+      w++;
+    }
+    out[i] = base + (uint32_t)(window & mask);
+    window >>= bits;
+    window_bits -= bits;
   }
+}
 
-  // Because header is 3 bytes, with no NULL terminator, need to put it in a 4 byte tmp
-  char* tmp_value_type = calloc(4, 1);
-  memcpy(tmp_value_type, c->header.format, 3);
-  c->value_type = str_to_value_type(tmp_value_type);
-  free(tmp_value_type);
-  if (c->value_type == TypeUnkown)
+// Allocates the in-memory layout of a dictionary coded string chunk: n
+// int32 codes, padding to pointer alignment, count string pointers and
+// string_bytes for the strings. Sets the chunk's dict and dict_count.
+static char* alloc_string_dict(tsf_chunk* c, int n, int count, int64_t string_bytes,
+                               char** strings)
+{
+  int64_t dict_offset = ((int64_t)n * 4 + 7) & ~(int64_t)7;
+  int64_t bytes = dict_offset + sizeof(char*) * count + string_bytes;
+  char* data = tsf_malloc(bytes > 0 ? bytes : 1);
+  c->dict = (const char**)(data + dict_offset);
+  c->dict_count = count;
+  c->chunk_bytes = bytes;
+  *strings = (char*)(c->dict + count);
+  return data;
+}
+
+// Byte planes back to values, block by block. Full blocks take Blosc's
+// SSE2 unshuffle, as chunk buffers are 16-byte aligned.
+static bool decode_shuffle(tsf_chunk* c)
+{
+  int n = c->header.n;
+  int type_size = c->header.type_size;
+  if (n < 0 || (type_size != 4 && type_size != 8) || tsf_value_type_is_array(c->value_type))
+    return (bool)error("Chunk encoding does not apply to its value type");
+  if (c->chunk_bytes != (int64_t)n * type_size)
+    return (bool)error("Encoded chunk is corrupt or uses an unknown encoding");
+  unsigned char* out = tsf_malloc(c->chunk_bytes > 0 ? c->chunk_bytes : 1);
+  unsigned char* in = (unsigned char*)c->chunk_data;
+  for (int64_t pos = 0; pos < c->chunk_bytes; pos += TSF_SHUFFLE_BLOCK) {
+    int64_t size = c->chunk_bytes - pos;
+    unshuffle(type_size, size < TSF_SHUFFLE_BLOCK ? size : TSF_SHUFFLE_BLOCK, in + pos,
+              out + pos);
+  }
+  tsf_free(c->chunk_data);
+  c->chunk_data = (char*)out;
+  return true;
+}
+
+static const double pow10_table[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+static bool decode_decimal(tsf_chunk* c)
+{
+  int n = c->header.n;
+  int type_size = c->header.type_size;
+  const unsigned char* in = (const unsigned char*)c->chunk_data;
+  int64_t in_bytes = c->chunk_bytes;
+  if (n < 0 || !((c->value_type == TypeFloat32 && type_size == 4) ||
+                 (c->value_type == TypeFloat64 && type_size == 8)))
+    return (bool)error("Chunk encoding does not apply to its value type");
+  int exponent = in_bytes >= 12 ? in[4] : 10;
+  int bits = in_bytes >= 12 ? in[5] : 33;
+  int64_t exceptions = in_bytes >= 12 ? read_le32(in + 8) : 0;
+  int64_t packed_end = 12 + 4 * packed_words(n, bits);
+  if (exponent > 9 || bits > 32 || in_bytes != packed_end + exceptions * (4 + type_size))
+    return (bool)error("Encoded chunk is corrupt or uses an unknown encoding");
+
+  // Digits are unpacked into out, converting in place for float32
+  char* out = tsf_malloc((int64_t)n * type_size + 1);
+  uint32_t* digits = type_size == 4 ? (uint32_t*)out : tsf_malloc(sizeof(uint32_t) * n + 1);
+  bit_unpack(in + 12, bits, n, read_le32(in), digits);
+  double scale = pow10_table[exponent];
+  if (type_size == 4) {
+    float* values = (float*)out;
+    for (int i = 0; i < n; i++)
+      values[i] = (float)((int32_t)digits[i] / scale);
+  } else {
+    double* values = (double*)out;
+    for (int i = 0; i < n; i++)
+      values[i] = (int32_t)digits[i] / scale;
+    tsf_free(digits);
+  }
+  const unsigned char* e = in + packed_end;
+  for (int64_t k = 0; k < exceptions; k++, e += 4 + type_size) {
+    uint32_t idx = read_le32(e);
+    if (idx >= (uint32_t)n) {
+      tsf_free(out);
+      return (bool)error("Encoded chunk is corrupt or uses an unknown encoding");
+    }
+    memcpy(out + (int64_t)idx * type_size, e + 4, type_size);
+  }
+  tsf_free(c->chunk_data);
+  c->chunk_data = out;
+  c->chunk_bytes = n * type_size;
+  return true;
+}
+
+static bool decode_string_dict(tsf_chunk* c)
+{
+  int n = c->header.n;
+  const char* in = c->chunk_data;
+  int64_t in_bytes = c->chunk_bytes;
+  if (c->value_type != TypeString || n < 0)
+    return (bool)error("Chunk encoding does not apply to its value type");
+  int64_t count = in_bytes >= 4 ? (int64_t)read_le32((const unsigned char*)in) : -1;
+  int64_t pos = 4;
+  int64_t found = 0;
+  while (found < count && pos < in_bytes) {
+    const char* end = memchr(in + pos, '\0', in_bytes - pos);
+    if (!end)
+      break;
+    pos = end - in + 1;
+    found++;
+  }
+  int bits = found == count && pos + 4 <= in_bytes ? (unsigned char)in[pos] : 33;
+  if (bits > 32 || in_bytes != pos + 4 + 4 * packed_words(n, bits) || (n > 0 && count == 0))
+    return (bool)error("Encoded chunk is corrupt or uses an unknown encoding");
+
+  char* strings;
+  char* data = alloc_string_dict(c, n, count, pos - 4, &strings);
+  memcpy(strings, in + 4, pos - 4);
+  for (int64_t i = 0; i < count; i++) {
+    c->dict[i] = strings;
+    strings += strlen(strings) + 1;
+  }
+  uint32_t* codes = (uint32_t*)data;
+  bit_unpack((const unsigned char*)in + pos + 4, bits, n, 0, codes);
+  for (int i = 0; i < n; i++) {
+    if (codes[i] >= count) {
+      tsf_free(data);
+      c->dict = NULL;
+      c->dict_count = 0;
+      return (bool)error("Encoded chunk is corrupt or uses an unknown encoding");
+    }
+  }
+  tsf_free(c->chunk_data);
+  c->chunk_data = data;
+  return true;
+}
+
+// Dictionary codes a plain string chunk in place, for tsf_iter.string_codes
+static void code_strings(tsf_chunk* c)
+{
+  int n = c->record_count;
+  if (c->value_type != TypeString || c->dict || c->ext.encoding == EncodingConstant ||
+      !c->chunk_data || n <= 0)
+    return;
+  const char** strs = tsf_malloc(sizeof(char*) * n);
+  int* lens = tsf_malloc(sizeof(int) * n);
+  int32_t* codes = tsf_malloc(sizeof(int32_t) * n);
+  int* firsts = tsf_malloc(sizeof(int) * n);  // Record of each code's string
+  int capacity = 8;
+  while (capacity < n * 2)
+    capacity <<= 1;
+  int* slots = tsf_malloc(sizeof(int) * capacity);  // Code, or -1
+  for (int i = 0; i < capacity; i++)
+    slots[i] = -1;
+
+  const char* s = c->chunk_data;
+  const char* end = c->chunk_data + c->chunk_bytes;
+  int count = 0;
+  int64_t string_bytes = 0;
+  for (int i = 0; i < n; i++) {
+    if (c->header.type_size > 0) {
+      strs[i] = c->chunk_data + (int64_t)i * c->header.type_size;
+      lens[i] = strnlen(strs[i], c->header.type_size);
+    } else {
+      strs[i] = s;
+      lens[i] = strnlen(s, end - s);
+      s += lens[i] + 1;
+    }
+    uint32_t h = 2166136261u;  // FNV-1a, as str_hash
+    for (int k = 0; k < lens[i]; k++) {
+      h ^= (unsigned char)strs[i][k];
+      h *= 16777619u;
+    }
+    uint32_t slot = h & (capacity - 1);
+    while (slots[slot] >= 0) {
+      int f = firsts[slots[slot]];
+      if (lens[f] == lens[i] && memcmp(strs[f], strs[i], lens[i]) == 0)
+        break;
+      slot = (slot + 1) & (capacity - 1);
+    }
+    if (slots[slot] < 0) {
+      slots[slot] = count;
+      firsts[count++] = i;
+      string_bytes += lens[i] + 1;
+    }
+    codes[i] = slots[slot];
+  }
+
+  char* strings;
+  char* data = alloc_string_dict(c, n, count, string_bytes, &strings);
+  memcpy(data, codes, sizeof(int32_t) * n);
+  for (int k = 0; k < count; k++) {
+    int f = firsts[k];
+    memcpy(strings, strs[f], lens[f]);
+    strings[lens[f]] = '\0';
+    c->dict[k] = strings;
+    strings += lens[f] + 1;
+  }
+  tsf_free(c->chunk_data);
+  c->chunk_data = data;
+  c->cur_value = (tsf_v)data;
+  c->cur_offset = 0;
+  tsf_free(strs);
+  tsf_free(lens);
+  tsf_free(codes);
+  tsf_free(firsts);
+  tsf_free(slots);
+}
+
+static bool decode_chunk(tsf_chunk* c)
+{
+  int n = c->header.n;
+  const unsigned char* in = (const unsigned char*)c->chunk_data;
+  int64_t in_bytes = c->chunk_bytes;
+  bool is_int = c->value_type == TypeInt32 || c->value_type == TypeEnum;
+  if (n < 0 || c->header.type_size != 4 ||
+      !(is_int || (c->value_type == TypeFloat32 && (c->ext.encoding == EncodingRLE ||
+                                                    c->ext.encoding == EncodingDict))))
+    return (bool)error("Chunk encoding does not apply to its value type");
+
+  uint32_t* out = tsf_malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+  bool ok = true;
+  switch (c->ext.encoding) {
+    case EncodingDelta: {
+      if (in_bytes != (int64_t)n * 4) {
+        ok = false;
+        break;
+      }
+      uint32_t v = 0;
+      for (int i = 0; i < n; i++) {
+        v += read_le32(in + 4 * i);
+        out[i] = v;
+      }
+      break;
+    }
+    case EncodingFOR: {
+      int bits = in_bytes >= 8 ? in[4] : 33;
+      if (bits > 32 || in_bytes != 8 + 4 * packed_words(n, bits)) {
+        ok = false;
+        break;
+      }
+      bit_unpack(in + 8, bits, n, read_le32(in), out);
+      break;
+    }
+    case EncodingRLE: {
+      int64_t runs = in_bytes >= 4 ? (int64_t)read_le32(in) : -1;
+      if (runs < 0 || in_bytes != 4 + 8 * runs) {
+        ok = false;
+        break;
+      }
+      int64_t i = 0;
+      for (int64_t r = 0; r < runs && ok; r++) {
+        uint32_t value = read_le32(in + 4 + 8 * r);
+        uint32_t length = read_le32(in + 8 + 8 * r);
+        if (length > n - i) {
+          ok = false;
+          break;
+        }
+        for (uint32_t j = 0; j < length; j++)
+          out[i++] = value;
+      }
+      ok = ok && i == n;
+      break;
+    }
+    case EncodingDict: {
+      int64_t count = in_bytes >= 4 ? (int64_t)read_le32(in) : -1;
+      int64_t codes = 4 + 4 * count;
+      int bits = count >= 0 && in_bytes >= codes + 4 ? in[codes] : 33;
+      if (bits > 32 || in_bytes != codes + 4 + 4 * packed_words(n, bits)) {
+        ok = false;
+        break;
+      }
+      bit_unpack(in + codes + 4, bits, n, 0, out);
+      for (int i = 0; i < n && ok; i++) {
+        if (out[i] >= count)
+          ok = false;
+        else
+          out[i] = read_le32(in + 4 + 4 * out[i]);
+      }
+      break;
+    }
+    case EncodingDeltaFOR: {
+      // Unpacked to deltas (the first being x[0]), summed below
+      int bits = in_bytes >= 12 ? in[8] : 33;
+      if (bits > 32 || (n > 0 && in_bytes != 12 + 4 * packed_words(n - 1, bits)) ||
+          (n == 0 && in_bytes != 12)) {
+        ok = false;
+        break;
+      }
+      if (n > 0) {
+        out[0] = read_le32(in);
+        bit_unpack(in + 12, bits, n - 1, read_le32(in + 4), out + 1);
+      }
+      break;
+    }
+    default:
+      ok = false;
+      break;
+  }
+  if (!ok) {
+    tsf_free(out);
+    return (bool)error("Encoded chunk is corrupt or uses an unknown encoding");
+  }
+  if (ok && c->ext.encoding == EncodingDeltaFOR) {
+    uint32_t v = 0;
+    for (int i = 0; i < n; i++) {
+      v += out[i];
+      out[i] = v;
+    }
+  }
+  tsf_free(c->chunk_data);
+  c->chunk_data = (char*)out;
+  c->chunk_bytes = n * 4;
+  return true;
+}
+
+int64_t tsf_clock_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void histogram_add(tsf_histogram* h, int64_t ns)
+{
+  int bucket = 0;
+  while (bucket < TSF_HISTOGRAM_BUCKETS - 1 && (ns >> (bucket + 1)) > 0)
+    bucket++;
+  h->buckets[bucket]++;
+  h->count++;
+  h->total_ns += ns;
+  if (ns > h->max_ns)
+    h->max_ns = ns;
+}
+
+static void histogram_merge(tsf_histogram* into, const tsf_histogram* from)
+{
+  for (int i = 0; i < TSF_HISTOGRAM_BUCKETS; i++)
+    into->buckets[i] += from->buckets[i];
+  into->count += from->count;
+  into->total_ns += from->total_ns;
+  if (from->max_ns > into->max_ns)
+    into->max_ns = from->max_ns;
+}
+
+int64_t tsf_histogram_percentile(const tsf_histogram* h, double percentile)
+{
+  if (h->count == 0)
+    return 0;
+  double exact_rank = h->count * percentile / 100.0;
+  int64_t rank = (int64_t)exact_rank;
+  if (rank < exact_rank)
+    rank++;
+  if (rank < 1)
+    rank = 1;
+  int64_t seen = 0;
+  for (int i = 0; i < TSF_HISTOGRAM_BUCKETS; i++) {
+    seen += h->buckets[i];
+    if (seen >= rank) {
+      // Upper bound of the bucket, but never more than what was seen
+      int64_t upper = (2LL << i) - 1;
+      return upper < h->max_ns ? upper : h->max_ns;
+    }
+  }
+  return h->max_ns;
+}
+
+void tsf_stats_reset(tsf_stats* stats)
+{
+  memset(stats, 0, sizeof(tsf_stats));
+}
+
+void tsf_stats_merge(tsf_stats* into, const tsf_stats* from)
+{
+  into->read_chunks += from->read_chunks;
+  into->read_chunk_bytes += from->read_chunk_bytes;
+  into->decompressed_bytes += from->decompressed_bytes;
+  into->read_time_ns += from->read_time_ns;
+  into->decompress_time_ns += from->decompress_time_ns;
+  into->records_in_mem += from->records_in_mem;
+  into->records_total += from->records_total;
+  for (int i = 0; i < TSF_CODEC_COUNT; i++) {
+    into->codecs[i].chunks += from->codecs[i].chunks;
+    into->codecs[i].compressed_bytes += from->codecs[i].compressed_bytes;
+    into->codecs[i].decompressed_bytes += from->codecs[i].decompressed_bytes;
+    into->codecs[i].decompress_time_ns += from->codecs[i].decompress_time_ns;
+  }
+  histogram_merge(&into->chunk_fetch, &from->chunk_fetch);
+  histogram_merge(&into->decompress, &from->decompress);
+  histogram_merge(&into->reconstitution, &from->reconstitution);
+  histogram_merge(&into->value_access, &from->value_access);
+}
+
+void tsf_iter_stats_snapshot(tsf_iter* iter, tsf_stats* stats, tsf_field_stats* field_stats)
+{
+  if (stats)
+    *stats = iter->stats;
+  if (field_stats)
+    memcpy(field_stats, iter->field_stats, sizeof(tsf_field_stats) * iter->field_count);
+}
+
+void tsf_iter_stats_reset(tsf_iter* iter)
+{
+  tsf_stats_reset(&iter->stats);
+  memset(iter->field_stats, 0, sizeof(tsf_field_stats) * iter->field_count);
+}
+
+/*
+ * Span tracing of chunk reads and iterator lifetimes, exported in the
+ * Chrome trace event format (loadable in Perfetto or chrome://tracing).
+ */
+typedef struct trace_span {
+  const char* name;
+  int64_t start_ns;
+  int64_t dur_ns;
+  int tid;
+  int64_t chunk_id;  // -1 if not a chunk span
+  int source_id;
+  int codec;         // -1 if unknown
+  int compressed_bytes;
+  int decompressed_bytes;
+  int64_t records;
+  char table[40];
+  char field[40];
+} trace_span;
+
+struct tsf_trace {
+  pthread_mutex_t mutex;
+  int64_t origin_ns;
+  int thread_count;
+  int span_count;
+  int span_capacity;
+  trace_span* spans;
+};
+
+static __thread int trace_tid = 0;
+static __thread tsf_trace* trace_tid_owner = NULL;
+
+tsf_trace* tsf_trace_create(void)
+{
+  tsf_trace* trace = tsf_calloc(sizeof(tsf_trace), 1);
+  pthread_mutex_init(&trace->mutex, NULL);
+  trace->origin_ns = tsf_clock_ns();
+  return trace;
+}
+
+void tsf_trace_free(tsf_trace* trace)
+{
+  if (!trace)
+    return;
+  pthread_mutex_destroy(&trace->mutex);
+  tsf_free(trace->spans);
+  tsf_free(trace);
+}
+
+void tsf_set_trace(tsf_file* tsf, tsf_trace* trace)
+{
+  tsf->trace = trace;
+}
+
+int tsf_trace_span_count(tsf_trace* trace)
+{
+  pthread_mutex_lock(&trace->mutex);
+  int count = trace->span_count;
+  pthread_mutex_unlock(&trace->mutex);
+  return count;
+}
+
+static trace_span trace_span_init(const char* name, int64_t start_ns, int64_t end_ns)
+{
+  trace_span span;
+  memset(&span, 0, sizeof(trace_span));
+  span.name = name;
+  span.start_ns = start_ns;
+  span.dur_ns = end_ns - start_ns;
+  span.chunk_id = -1;
+  span.codec = -1;
+  return span;
+}
+
+static void trace_add(tsf_trace* trace, const trace_span* span)
+{
+  pthread_mutex_lock(&trace->mutex);
+  if (trace_tid_owner != trace) {
+    // Small stable thread ids per trace read better than pthread_t values
+    trace_tid_owner = trace;
+    trace_tid = ++trace->thread_count;
+  }
+  if (trace->span_count == trace->span_capacity) {
+    trace->span_capacity = trace->span_capacity ? trace->span_capacity * 2 : 256;
+    trace->spans = tsf_realloc(trace->spans, sizeof(trace_span) * trace->span_capacity);
+  }
+  trace_span* s = &trace->spans[trace->span_count++];
+  *s = *span;
+  s->tid = trace_tid;
+  pthread_mutex_unlock(&trace->mutex);
+}
+
+static const char* codec_name(int codec)
+{
+  switch (codec) {
+    case CompressionZstd:
+      return "zstd";
+    case CompressionZlib:
+      return "zlib";
+    case CompressionBlosc:
+      return "blosc";
+    case CompressionLZ4:
+      return "lz4";
+    case CompressionNone:
+      return "none";
+  }
+  return "unknown";
+}
+
+bool tsf_trace_write_json(tsf_trace* trace, const char* path)
+{
+  pthread_mutex_lock(&trace->mutex);
+  json_t* events = json_array();
+  for (int i = 0; i < trace->span_count; i++) {
+    trace_span* span = &trace->spans[i];
+    json_t* args = json_object();
+    if (span->source_id > 0)
+      json_object_set_new(args, "source_id", json_integer(span->source_id));
+    if (span->field[0])
+      json_object_set_new(args, "field", json_string(span->field));
+    if (span->chunk_id >= 0) {
+      json_object_set_new(args, "chunk_id", json_integer(span->chunk_id));
+      json_object_set_new(args, "record_block", json_integer(span->chunk_id >> 32));
+      json_object_set_new(args, "chunk_field", json_integer(span->chunk_id & 0xFFFFFFFF));
+    }
+    if (span->table[0])
+      json_object_set_new(args, "table", json_string(span->table));
+    if (span->codec >= 0)
+      json_object_set_new(args, "codec", json_string(codec_name(span->codec)));
+    if (span->compressed_bytes > 0)
+      json_object_set_new(args, "compressed_bytes", json_integer(span->compressed_bytes));
+    if (span->decompressed_bytes > 0)
+      json_object_set_new(args, "decompressed_bytes", json_integer(span->decompressed_bytes));
+    if (span->records > 0)
+      json_object_set_new(args, "records", json_integer(span->records));
+
+    // Chrome trace timestamps are in (fractional) microseconds
+    json_t* event = json_pack("{s:s, s:s, s:s, s:f, s:f, s:i, s:i, s:o}",
+                              "name", span->name, "cat", "tsf", "ph", "X",
+                              "ts", (span->start_ns - trace->origin_ns) / 1000.0,
+                              "dur", span->dur_ns / 1000.0,
+                              "pid", 1, "tid", span->tid, "args", args);
+    json_array_append_new(events, event);
+  }
+  pthread_mutex_unlock(&trace->mutex);
+
+  json_t* root = json_pack("{s:o, s:s}", "traceEvents", events, "displayTimeUnit", "ns");
+  int res = json_dump_file(root, path, JSON_COMPACT | JSON_PRESERVE_ORDER);
+  json_decref(root);
+  return res == 0;
+}
+
+// Accounts a chunk fetched since cstart to stats and (if not NULL) the
+// stats of the field it belongs to
+static void fetch_done(tsf_file* tsf, int64_t chunk_id, int size, int64_t cstart,
+                       tsf_stats* stats, tsf_field_stats* fstats)
+{
+  int64_t cend = tsf_clock_ns();
+  stats->read_time_ns += cend - cstart;
+  stats->read_chunk_bytes += size;
+  histogram_add(&stats->chunk_fetch, cend - cstart);
+  if (fstats) {
+    fstats->read_time_ns += cend - cstart;
+    fstats->read_chunk_bytes += size;
+  }
+  if (tsf->trace) {
+    trace_span span = trace_span_init("fetch", cstart, cend);
+    span.chunk_id = chunk_id;
+    span.compressed_bytes = size;
+    trace_add(tsf->trace, &span);
+  }
+}
+
+// Fetches the stored blob of a chunk. raw_data is owned by the table's
+// statement and valid until its next fetch.
+static bool fetch_chunk(tsf_file* tsf, tsf_chunk_table* t, int64_t chunk_id,
+                        const char** raw_data, int* size, tsf_stats* stats,
+                        tsf_field_stats* fstats)
+{
+  int64_t cstart = tsf_clock_ns();
+  sqlite3_reset(t->q);
+  sqlite3_bind_int64(t->q, 1, chunk_id);
+  if (sqlite3_step(t->q) != SQLITE_ROW)
+    return (bool)error("Expected chunk was not found in DB");
+  *raw_data = (const char*)sqlite3_column_blob(t->q, 0);
+  *size = sqlite3_column_bytes(t->q, 0);
+  fetch_done(tsf, chunk_id, *size, cstart, stats, fstats);
+  return true;
+}
+
+/*
+ * Range cursors. Chunks wanted in ascending chunk_id order are fetched by
+ * one range query per run of ids at most RANGE_MAX_GAP apart, stepping
+ * over the rows in between, rather than by a B-tree lookup each. Matrix
+ * chunks of one record block are consecutive ids, so a scattered entity
+ * subset reads the table sequentially.
+ */
+#define RANGE_MAX_GAP 16
+
+typedef struct chunk_cursor {
+  tsf_chunk_table* t;
+  const int64_t* ids;  // Ascending
+  int count;
+  int next;     // Of the next id to fetch
+  int run_end;  // Ids before run_end are covered by the current query
+} chunk_cursor;
+
+static void cursor_init(chunk_cursor* cur, tsf_chunk_table* t, const int64_t* ids, int count)
+{
+  cur->t = t;
+  cur->ids = ids;
+  cur->count = count;
+  cur->next = 0;
+  cur->run_end = 0;
+}
+
+// Fetches the blob of the next id, valid until the next call
+static bool cursor_fetch(tsf_file* tsf, chunk_cursor* cur, const char** raw_data, int* size,
+                         tsf_stats* stats, tsf_field_stats* fstats)
+{
+  int64_t cstart = tsf_clock_ns();
+  sqlite3_stmt* q = cur->t->range_q;
+  int64_t chunk_id = cur->ids[cur->next];
+  if (cur->next >= cur->run_end) {
+    int end = cur->next + 1;
+    while (end < cur->count && cur->ids[end] - cur->ids[end - 1] <= RANGE_MAX_GAP)
+      end++;
+    cur->run_end = end;
+    sqlite3_reset(q);
+    sqlite3_bind_int64(q, 1, chunk_id);
+    sqlite3_bind_int64(q, 2, cur->ids[end - 1]);
+  }
+  // A repeated id (the same entity twice) is still the current row
+  if (cur->next == 0 || chunk_id != cur->ids[cur->next - 1]) {
+    int res;
+    while ((res = sqlite3_step(q)) == SQLITE_ROW && sqlite3_column_int64(q, 0) < chunk_id)
+      ;
+    if (res != SQLITE_ROW || sqlite3_column_int64(q, 0) != chunk_id)
+      return (bool)error("Expected chunk was not found in DB");
+  }
+  *raw_data = (const char*)sqlite3_column_blob(q, 1);
+  *size = sqlite3_column_bytes(q, 1);
+  cur->next++;
+  fetch_done(tsf, chunk_id, *size, cstart, stats, fstats);
+  return true;
+}
+
+static void cursor_close(chunk_cursor* cur)
+{
+  sqlite3_reset(cur->t->range_q);
+}
+
+// Decompresses and decodes a fetched chunk blob into c. Safe to call from
+// several threads on different chunks of non-array fields without a zstd
+// dictionary, each with its own stats.
+static bool decode_chunk_blob(tsf_file* tsf, tsf_chunk_table* t, tsf_chunk* c,
+                              int64_t chunk_id, const char* raw_data, int size, tsf_field* f,
+                              tsf_stats* stats, tsf_field_stats* fstats, int64_t trace_start)
+{
+  int64_t cstart = tsf_clock_ns();
+  int64_t cend = 0;
+
+  if (size < HEADER_SIZE) {
+    return (bool)error("Less than 16 bytes expected for header of chunk");
+  }
+  memcpy(&c->header, raw_data, HEADER_SIZE);
+  int header_size = HEADER_SIZE;
+  memset(&c->ext, 0, sizeof(tsf_chunk_header_ext));
+  if (c->header.magic[0] == CHUNK_MAGIC_B0 && c->header.magic[1] == CHUNK_MAGIC_B1_EXT) {
+    if (size < HEADER_SIZE + HEADER_EXT_SIZE)
+      return (bool)error("Less than 20 bytes expected for extended header of chunk");
+    memcpy(&c->ext, raw_data + HEADER_SIZE, HEADER_EXT_SIZE);
+    header_size += HEADER_EXT_SIZE;
+    if (c->ext.codec >= TSF_CODEC_COUNT)
+      return (bool)error("Unkown compression method of chunk");
+  } else if (c->header.magic[0] != CHUNK_MAGIC_B0 || c->header.magic[1] != CHUNK_MAGIC_B1) {
+    return (bool)error(
+        "Chunk did not start with expected magic 2 bytes. Possibly corrupted or created with newer "
+        "software.");
+  } else {
+    c->ext.codec = c->header.compression_method;
+  }
+
+  // Because header is 3 bytes, with no NULL terminator, need to put it in a 4 byte tmp
+  char* tmp_value_type = tsf_calloc(4, 1);
+  memcpy(tmp_value_type, c->header.format, 3);
+  c->value_type = str_to_value_type(tmp_value_type);
+  tsf_free(tmp_value_type);
+  if (c->value_type == TypeUnkown)
     return (bool)error("Unexpected format string in chunk");
 
-  free(c->chunk_data);
+  tsf_free(c->chunk_data);
   c->chunk_data = 0;
   c->chunk_bytes = 0;
   c->chunk_id = chunk_id;
   c->record_count = c->header.n;
   c->cur_offset = 0;
-  if (size < (HEADER_SIZE + 4))
+  c->dict = NULL;
+  c->dict_count = 0;
+  c->packed = false;
+  if (size < (header_size + 4))
     return true;  // empty chunk
 
   // decompress chunk
-  if (c->header.compression_method == CompressionZlib) {
-    const char* data = raw_data + HEADER_SIZE;
+  const char* data = raw_data + header_size;
+  int data_size = size - header_size;
+  if (c->ext.codec == CompressionZlib) {
     c->chunk_bytes = expcted_size((const unsigned char*)data);
-    c->chunk_data = malloc(c->chunk_bytes);
-    if (!zlib_uncompress(c->chunk_data, c->chunk_bytes, data, size - HEADER_SIZE))
+    c->chunk_data = tsf_malloc(c->chunk_bytes);
+    if (!zlib_uncompress(c->chunk_data, c->chunk_bytes, data, data_size))
       return (bool)error("zlib decompression of chunk failed");
-  } else if (c->header.compression_method == CompressionZstd) {
-    const char* data = raw_data + HEADER_SIZE;
+  } else if (c->ext.codec == CompressionZstd) {
     c->chunk_bytes = expcted_size((const unsigned char*)data);
-    c->chunk_data = malloc(c->chunk_bytes);
-    if (!zstd_uncompress(c->chunk_data, c->chunk_bytes, data, size - HEADER_SIZE))
+    c->chunk_data = tsf_malloc(c->chunk_bytes);
+    if (!zstd_uncompress(tsf, &c->header, c->chunk_data, c->chunk_bytes, data, data_size))
       return (bool)error("zstd decompression of chunk failed");
-  } else if (c->header.compression_method == CompressionLZ4) {
-    const char* data = raw_data + HEADER_SIZE;
+  } else if (c->ext.codec == CompressionLZ4) {
     c->chunk_bytes = expcted_size((const unsigned char*)data);
-    c->chunk_data = malloc(c->chunk_bytes);
-    if (!lz4_uncompress(c->chunk_data, c->chunk_bytes, data, size - HEADER_SIZE))
+    c->chunk_data = tsf_malloc(c->chunk_bytes);
+    if (!lz4_uncompress(c->chunk_data, c->chunk_bytes, data, data_size))
       return (bool)error("zstd decompression of chunk failed");
-  } else if (c->header.compression_method == CompressionBlosc) {
+  } else if (c->ext.codec == CompressionBlosc) {
     // BLOSC has slightly larger min size
-    if (size < (HEADER_SIZE + BLOSC_MIN_HEADER_LENGTH))
+    if (size < (header_size + BLOSC_MIN_HEADER_LENGTH))
       return true;  // empty chunk
 
-    const char* data = raw_data + HEADER_SIZE;
     size_t nbytes, cbytes, blocksize;
     blosc_cbuffer_sizes(data, &nbytes, &cbytes, &blocksize);
-    if (cbytes != size - HEADER_SIZE)
+    if (cbytes != (size_t)data_size)
       return (bool)error("BLOSC buffer or header corrupt");
 
     c->chunk_bytes = nbytes;
-    c->chunk_data = malloc(c->chunk_bytes);
-    int err = blosc_decompress(data, c->chunk_data, c->chunk_bytes);
+    c->chunk_data = tsf_malloc(c->chunk_bytes);
+    // Reentrant, so readers on other threads are not serialized on the
+    // global blosc lock. Only very large chunks are split across threads.
+    int threads = (int)(nbytes / BLOSC_BYTES_PER_THREAD);
+    if (threads > BLOSC_MAX_READ_THREADS)
+      threads = BLOSC_MAX_READ_THREADS;
+    int err = blosc_decompress_ctx(data, c->chunk_data, c->chunk_bytes, threads);
     if (err < 0 || err != (int)nbytes)
       return (bool)error("Chunk had BLOSC error while decompressing");
+  } else if (c->ext.codec == CompressionNone) {
+    c->chunk_bytes = expcted_size((const unsigned char*)data);
+    if (c->chunk_bytes != data_size - 4)
+      return (bool)error("Uncompressed chunk size does not match its header");
+    c->chunk_data = tsf_malloc(c->chunk_bytes);
+    memcpy(c->chunk_data, data + 4, c->chunk_bytes);
   } else {
     return (bool)error("Unkown compression method of chunk");
   }
-  if((c->header.compression_method == CompressionZstd ||
-      c->header.compression_method == CompressionLZ4) &&
+  if (c->ext.encoding == EncodingConstant) {
+    // One record in the plain layout, stands in for every record
+    int record_size = c->header.type_size > 0 ? c->header.type_size : 1;
+    if (tsf_value_type_is_array(c->value_type) || c->chunk_bytes < record_size ||
+        (c->value_type == TypeString && c->chunk_data[c->chunk_bytes - 1] != '\0'))
+      return (bool)error("Constant chunk is corrupt");
+  } else if (c->ext.encoding == EncodingStringDict) {
+    if (!decode_string_dict(c))
+      return false;
+  } else if (c->ext.encoding == EncodingShuffle) {
+    if (!decode_shuffle(c))
+      return false;
+  } else if (c->ext.encoding == EncodingDecimal) {
+    if (!decode_decimal(c))
+      return false;
+  } else if (c->ext.encoding != EncodingNone && !decode_chunk(c)) {
+    return false;
+  }
+
+  cend = tsf_clock_ns();
+  tsf_codec_stats* codec = &stats->codecs[c->ext.codec];
+  codec->chunks++;
+  codec->compressed_bytes += size;
+  codec->decompressed_bytes += c->chunk_bytes;
+  codec->decompress_time_ns += cend - cstart;
+  histogram_add(&stats->decompress, cend - cstart);
+  int64_t decompress_ns = cend - cstart;
+  cstart = cend;
+
+  if((c->ext.codec == CompressionZstd ||
+      c->ext.codec == CompressionLZ4 ||
+      c->ext.codec == CompressionNone) &&
     (c->value_type == TypeInt32Array ||
      c->value_type == TypeEnumArray ||
      c->value_type == TypeFloat32Array ||
@@ -813,18 +2225,56 @@ static bool read_chunk(tsf_chunk_table* t, tsf_chunk* c, int64_t chunk_id, tsf_s
       s += size * c->header.type_size;
       d += size * c->header.type_size;
     }
+    cend = tsf_clock_ns();
+    histogram_add(&stats->reconstitution, cend - cstart);
+    decompress_ns += cend - cstart;
   }
 
-  cend = clock();
-  stats->decompress_time += (cend-cstart);
+  stats->decompress_time_ns += decompress_ns;
   stats->decompressed_bytes += c->chunk_bytes;
   stats->read_chunks++;
+  if (fstats) {
+    fstats->decompress_time_ns += decompress_ns;
+    fstats->decompressed_bytes += c->chunk_bytes;
+    fstats->read_chunks++;
+  }
+  if (tsf->trace) {
+    cend = tsf_clock_ns();
+    trace_span span = trace_span_init("decompress", cend - decompress_ns, cend);
+    span.chunk_id = chunk_id;
+    span.codec = c->ext.codec;
+    span.compressed_bytes = size;
+    span.decompressed_bytes = c->chunk_bytes;
+    trace_add(tsf->trace, &span);
+
+    span = trace_span_init("read_chunk", trace_start, cend);
+    span.chunk_id = chunk_id;
+    span.codec = c->ext.codec;
+    span.compressed_bytes = size;
+    span.decompressed_bytes = c->chunk_bytes;
+    span.records = c->record_count;
+    snprintf(span.table, sizeof(span.table), "%s", t->name);
+    if (f)
+      snprintf(span.field, sizeof(span.field), "%s", f->symbol);
+    trace_add(tsf->trace, &span);
+  }
 
   // set up pointer at beginning of chunk
   c->cur_value = (tsf_v)c->chunk_data;
   return true;
 }
 
+static bool read_chunk(tsf_file* tsf, tsf_chunk_table* t, tsf_chunk* c, int64_t chunk_id,
+                       tsf_field* f, tsf_stats* stats, tsf_field_stats* fstats)
+{
+  int64_t trace_start = tsf_clock_ns();
+  const char* raw_data;
+  int size;
+  if (!fetch_chunk(tsf, t, chunk_id, &raw_data, &size, stats, fstats))
+    return false;
+  return decode_chunk_blob(tsf, t, c, chunk_id, raw_data, size, f, stats, fstats, trace_start);
+}
+
 #define READ_FIXED(type_t, v_read, v_missing)       \
   c->cur_offset = offset;                           \
   c->cur_value = &((type_t*)c->chunk_data)[offset]; \
@@ -837,6 +2287,17 @@ static void chunk_value(tsf_chunk* c, int offset, tsf_v* value, bool* is_null)
   // appropriate place in chunk->chunk_data and is_null appropriately.
 
   bool pad_size = false;  // Used by typed arrays
+  if (c->packed) {
+    int code = (((const unsigned char*)c->chunk_data)[offset >> 2] >> ((offset & 3) * 2)) & 3;
+    c->packed_value = code == TSF_PACKED_NULL ? INT_MISSING : code;
+    c->cur_offset = offset;
+    c->cur_value = &c->packed_value;
+    *value = c->cur_value;
+    *is_null = code == TSF_PACKED_NULL;
+    return;
+  }
+  if (c->ext.encoding == EncodingConstant)
+    offset = 0;  // The one stored record
   switch (c->value_type) {
     // Random access types
     case TypeInt32:
@@ -861,8 +2322,14 @@ static void chunk_value(tsf_chunk* c, int offset, tsf_v* value, bool* is_null)
     // Variable length types
     case TypeString: {
       // String chunks may be uniformly sized strings of size
-      // header.type_size or a NULL delimited list.
-      if (c->header.type_size == 0) {
+      // header.type_size or a NULL delimited list, unless dictionary coded
+      if (c->dict) {
+        c->cur_offset = offset;
+        const char* s = c->dict[((const int32_t*)c->chunk_data)[offset]];
+        c->cur_value = (tsf_v)s;
+        *value = c->cur_value;
+        *is_null = s[0] == '\0' || (s[0] == '?' && s[1] == '\0');
+      } else if (c->header.type_size == 0) {
         // NULL delimited string list
 
         // Most times, we are iterating through chunks and we expect offset to
@@ -899,6 +2366,7 @@ static void chunk_value(tsf_chunk* c, int offset, tsf_v* value, bool* is_null)
     case TypeEnumArray:     // fallthrough (data is int-array)
     case TypeFloat32Array:  // fallthrough
       pad_size = true;      // These 4-byte arrays are kept padded to 4-byte boundries
+      // fallthrough
     case TypeFloat64Array:  // fallthrough
     case TypeBoolArray:     // fallthrough
     {
@@ -917,7 +2385,7 @@ static void chunk_value(tsf_chunk* c, int offset, tsf_v* value, bool* is_null)
         assert(s < end);
         uint16_t size = va_size(s);
         // Move past size, which is sometimes padded to type_size
-        s += (pad_size ? c->header.type_size : sizeof(uint16_t));
+        s += (pad_size ? (size_t)c->header.type_size : sizeof(uint16_t));
         s += size * c->header.type_size;
         c->cur_offset++;
       }
@@ -959,19 +2427,166 @@ static void chunk_value(tsf_chunk* c, int offset, tsf_v* value, bool* is_null)
   }
 }
 
-static bool read_chunk_with_idxmap(tsf_file* tsf, tsf_chunk* c, tsf_field* f, int record_id, int field_idx, tsf_stats* stats)
+/*
+ * Collated idx map chunks. Chr, Start and Stop of sources stored out of
+ * genomic order are collated per chunk from the backend chunks their
+ * idx map chunk points into. As every genomic query reads them, collated
+ * chunks are cached per file keyed by table and chunk_id (field and
+ * record block), releasing the least recently used past
+ * IDXMAP_CACHE_BYTES. Like the zstd dictionaries, this assumes a file is
+ * read by one thread at a time.
+ */
+#define IDXMAP_CACHE_BYTES (16 << 20)
+#define IDXMAP_CACHE_BUCKETS 256
+
+typedef struct idxmap_entry {
+  int table_idx;
+  int64_t chunk_id;
+  tsf_chunk_header header;
+  int bytes;
+  char* data;
+  struct idxmap_entry* bucket_next;
+  struct idxmap_entry* prev;  // Most recently used first
+  struct idxmap_entry* next;
+} idxmap_entry;
+
+struct tsf_idxmap_cache {
+  idxmap_entry* buckets[IDXMAP_CACHE_BUCKETS];
+  idxmap_entry* head;
+  idxmap_entry* tail;
+  int64_t bytes;
+};
+
+static idxmap_entry** idxmap_bucket(struct tsf_idxmap_cache* cache, int table_idx,
+                                    int64_t chunk_id)
+{
+  uint64_t h = ((uint64_t)chunk_id ^ ((uint64_t)table_idx << 24)) * 0x9E3779B97F4A7C15ULL;
+  return &cache->buckets[(h >> 32) % IDXMAP_CACHE_BUCKETS];
+}
+
+static void idxmap_unlink(struct tsf_idxmap_cache* cache, idxmap_entry* e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    cache->head = e->next;
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    cache->tail = e->prev;
+  e->prev = e->next = NULL;
+}
+
+static void idxmap_push(struct tsf_idxmap_cache* cache, idxmap_entry* e)
+{
+  e->next = cache->head;
+  if (cache->head)
+    cache->head->prev = e;
+  cache->head = e;
+  if (!cache->tail)
+    cache->tail = e;
+}
+
+static void idxmap_evict(struct tsf_idxmap_cache* cache, idxmap_entry* e)
+{
+  idxmap_entry** link = idxmap_bucket(cache, e->table_idx, e->chunk_id);
+  while (*link != e)
+    link = &(*link)->bucket_next;
+  *link = e->bucket_next;
+  idxmap_unlink(cache, e);
+  cache->bytes -= e->bytes;
+  tsf_free(e->data);
+  tsf_free(e);
+}
+
+// The cached collated chunk, made most recently used, or NULL
+static idxmap_entry* idxmap_get(tsf_file* tsf, int table_idx, int64_t chunk_id)
+{
+  struct tsf_idxmap_cache* cache = tsf->idxmaps;
+  if (!cache)
+    return NULL;
+  idxmap_entry* e = *idxmap_bucket(cache, table_idx, chunk_id);
+  while (e && (e->table_idx != table_idx || e->chunk_id != chunk_id))
+    e = e->bucket_next;
+  if (e && e != cache->head) {
+    idxmap_unlink(cache, e);
+    idxmap_push(cache, e);
+  }
+  return e;
+}
+
+static void idxmap_put(tsf_file* tsf, int table_idx, const tsf_chunk* c)
+{
+  if (c->chunk_bytes > IDXMAP_CACHE_BYTES)
+    return;
+  if (!tsf->idxmaps)
+    tsf->idxmaps = tsf_calloc(1, sizeof(struct tsf_idxmap_cache));
+  struct tsf_idxmap_cache* cache = tsf->idxmaps;
+  while (cache->tail && cache->bytes + c->chunk_bytes > IDXMAP_CACHE_BYTES)
+    idxmap_evict(cache, cache->tail);
+
+  idxmap_entry* e = tsf_calloc(1, sizeof(idxmap_entry));
+  e->table_idx = table_idx;
+  e->chunk_id = c->chunk_id;
+  e->header = c->header;
+  e->bytes = c->chunk_bytes;
+  e->data = tsf_malloc(e->bytes > 0 ? e->bytes : 1);
+  memcpy(e->data, c->chunk_data, e->bytes);
+  idxmap_entry** bucket = idxmap_bucket(cache, table_idx, c->chunk_id);
+  e->bucket_next = *bucket;
+  *bucket = e;
+  idxmap_push(cache, e);
+  cache->bytes += e->bytes;
+}
+
+static void idxmap_cache_free(struct tsf_idxmap_cache* cache)
+{
+  if (!cache)
+    return;
+  while (cache->tail)
+    idxmap_evict(cache, cache->tail);
+  tsf_free(cache);
+}
+
+// Sets up c as a collated Int32 chunk of header's record count
+static void collated_chunk_init(tsf_chunk* c, const tsf_chunk_header* header, int64_t chunk_id)
+{
+  tsf_free(c->chunk_data);
+  c->header = *header;
+  memset(&c->ext, 0, sizeof(tsf_chunk_header_ext));
+  c->dict = NULL;
+  c->dict_count = 0;
+  c->packed = false;
+  c->record_count = c->header.n;
+  c->value_type = TypeInt32;
+  c->chunk_id = chunk_id;  // One compared against in the iter_next
+  c->cur_offset = 0;
+  c->chunk_bytes = c->header.type_size * c->record_count;
+  c->chunk_data = tsf_malloc(c->chunk_bytes > 0 ? c->chunk_bytes : 1);
+  c->cur_value = (tsf_v)c->chunk_data;
+}
+
+static bool read_chunk_with_idxmap(tsf_file* tsf, tsf_chunk* c, tsf_field* f, int record_id,
+                                   int field_idx, tsf_stats* stats, tsf_field_stats* fstats)
 {
   // If we have no idx_map for locus dimention, do a strait read_chunk
   tsf_chunk_table* t = &tsf->chunk_tables[f->table_idx];
   int64_t chunk_id = ((int64_t)(record_id >> t->chunk_bits) << 32) | field_idx;
   if (f->locus_idx_map_table < 0) {
-    return read_chunk(t, c, chunk_id, stats);
+    return read_chunk(tsf, t, c, chunk_id, f, stats, fstats);
   }
 
   // Only Chr, Start, Stop genomic fields uses the field_idx_map in TSF1
   if (f->value_type != TypeInt32 && f->value_type != TypeEnum)
     return (bool)error("Currently only Int/Enum fields support locux_idx_map being set");
 
+  idxmap_entry* cached = idxmap_get(tsf, f->table_idx, chunk_id);
+  if (cached) {
+    collated_chunk_init(c, &cached->header, chunk_id);
+    memcpy(c->chunk_data, cached->data, c->chunk_bytes);
+    return true;
+  }
+
   // Otherwise, handle cases where there is a index mapping between the ID space we
   // are reading and the final records.
   // First, we read the idx chunk, which should be a integer chunk
@@ -980,70 +2595,298 @@ static bool read_chunk_with_idxmap(tsf_file* tsf, tsf_chunk* c, tsf_field* f, in
   tsf_chunk_table* idx_chunk_table = &tsf->chunk_tables[f->locus_idx_map_table];
   int64_t idx_chunk_id =
       ((int64_t)(record_id >> idx_chunk_table->chunk_bits) << 32) | f->locus_idx_map_field;
-  if (!read_chunk(idx_chunk_table, &idx_chunk, idx_chunk_id, stats))
+  if (!read_chunk(tsf, idx_chunk_table, &idx_chunk, idx_chunk_id, f, stats, fstats)) {
+    tsf_free(idx_chunk.chunk_data);
     return false;
+  }
 
   // Set up our passed in chunk with values filled in from the indexed
   // backend chunks.
-  free(c->chunk_data);
-  c->header = idx_chunk.header;
-  c->record_count = c->header.n;
-  c->value_type = TypeInt32;
-  c->chunk_id = chunk_id;  // One compared against in the iter_next
-  c->cur_offset = 0;
-  c->chunk_bytes = c->header.type_size * c->record_count;
-  c->chunk_data = malloc(c->chunk_bytes);
-  c->cur_value = (tsf_v)c->chunk_data;
+  collated_chunk_init(c, &idx_chunk.header, chunk_id);
+
+  // Time spent collating, excluding the backend chunk reads themselves
+  int64_t cstart = tsf_clock_ns();
+  int64_t nested_ns = stats->read_time_ns + stats->decompress_time_ns;
 
-  // Worst case is we have one chunk per record in our idx chunk
+  // Worst case is we have one chunk per record in our idx chunk. Backend
+  // chunks are found by record block in an open addressing table of at
+  // least twice that many slots.
   int backend_chunks_count = 0;
-  tsf_chunk* backend_chunks = calloc(sizeof(tsf_chunk), idx_chunk.record_count);
+  tsf_chunk* backend_chunks = tsf_calloc(sizeof(tsf_chunk), idx_chunk.record_count + 1);
+  int slot_bits = 1;
+  while ((1 << slot_bits) < 2 * idx_chunk.record_count)
+    slot_bits++;
+  int slot_mask = (1 << slot_bits) - 1;
+  int* slots = tsf_malloc(sizeof(int) << slot_bits);
+  memset(slots, -1, sizeof(int) << slot_bits);
   tsf_v value;
   bool is_null;
-  for (int i = 0; i < idx_chunk.record_count; i++) {
+  bool ok = true;
+  for (int i = 0; ok && i < idx_chunk.record_count; i++) {
     chunk_value(&idx_chunk, i, &value, &is_null);
     int idx = v_int32(value);
-    int64_t chunk_id = ((int64_t)(idx >> t->chunk_bits) << 32) | field_idx;
+    int block = idx >> t->chunk_bits;
     int offset = idx % t->chunk_size;
 
-    // Linearly scan for this chunk_id in our existing backend_chunks
-    int j;
-    for (j = 0; j < backend_chunks_count; j++) {
-      if (backend_chunks[j].chunk_id == chunk_id) {
+    int slot = (int)(((uint32_t)block * 2654435761u) >> (32 - slot_bits));
+    while (slots[slot] >= 0 && (int)(backend_chunks[slots[slot]].chunk_id >> 32) != block)
+      slot = (slot + 1) & slot_mask;
+
+    // Not found, fetch this chunk
+    if (slots[slot] < 0) {
+      int64_t backend_id = ((int64_t)block << 32) | field_idx;
+      slots[slot] = backend_chunks_count++;
+      ok = read_chunk(tsf, t, &backend_chunks[slots[slot]], backend_id, f, stats, fstats);
+      if (!ok)
         break;
-      }
-    }
-    int chunk_idx = j;  // Either found or set to backend_chunks_count
-
-    // Not found, fetch this chunk
-    if (chunk_idx >= backend_chunks_count) {
-      backend_chunks_count++;
-      if(!read_chunk(t, &backend_chunks[chunk_idx], chunk_id, stats))
-	return false;
     }
 
     // Read backend chunk value into our collated chunk data
-    chunk_value(&backend_chunks[chunk_idx], offset, &value, &is_null);
+    chunk_value(&backend_chunks[slots[slot]], offset, &value, &is_null);
     ((int*)c->chunk_data)[i] = v_int32(value);
   }
-  free(idx_chunk.chunk_data);
+  nested_ns = stats->read_time_ns + stats->decompress_time_ns - nested_ns;
+  int64_t cend = tsf_clock_ns();
+  histogram_add(&stats->reconstitution, cend - cstart - nested_ns);
+  if (ok && tsf->trace) {
+    trace_span span = trace_span_init("read_chunk_with_idxmap", cstart, cend);
+    span.chunk_id = chunk_id;
+    span.records = c->record_count;
+    span.decompressed_bytes = c->chunk_bytes;
+    snprintf(span.table, sizeof(span.table), "%s", t->name);
+    snprintf(span.field, sizeof(span.field), "%s", f->symbol);
+    trace_add(tsf->trace, &span);
+  }
+
+  tsf_free(idx_chunk.chunk_data);
   for (int i = 0; i < backend_chunks_count; i++)
-    free(backend_chunks[i].chunk_data);
-  free(backend_chunks);
+    tsf_free(backend_chunks[i].chunk_data);
+  tsf_free(backend_chunks);
+  tsf_free(slots);
+  if (!ok) {
+    c->chunk_id = -1;
+    return false;
+  }
+  idxmap_put(tsf, f->table_idx, c);
+  return true;
+}
+
+/*
+ * Matrix chunk slots. A record-major matrix iterator reads a chunk per
+ * field and entity, so slots are only allocated as first read and, with
+ * a matrix_budget, released least recently used first.
+ */
+struct tsf_matrix_slot {
+  tsf_chunk chunk;
+  int idx;        // Into matrix_slots
+  int64_t bytes;  // Of chunk counted in matrix_resident_bytes
+  tsf_matrix_slot* prev;
+  tsf_matrix_slot* next;
+};
+
+static void lru_unlink(tsf_iter* iter, tsf_matrix_slot* slot)
+{
+  if (slot->prev)
+    slot->prev->next = slot->next;
+  else
+    iter->lru_head = slot->next;
+  if (slot->next)
+    slot->next->prev = slot->prev;
+  else
+    iter->lru_tail = slot->prev;
+  slot->prev = slot->next = NULL;
+}
+
+static void lru_push(tsf_iter* iter, tsf_matrix_slot* slot)
+{
+  slot->next = iter->lru_head;
+  if (iter->lru_head)
+    iter->lru_head->prev = slot;
+  iter->lru_head = slot;
+  if (!iter->lru_tail)
+    iter->lru_tail = slot;
+}
+
+static void matrix_slot_free(tsf_iter* iter, tsf_matrix_slot* slot)
+{
+  lru_unlink(iter, slot);
+  iter->matrix_slots[slot->idx] = NULL;
+  iter->matrix_resident_bytes -= slot->bytes;
+  tsf_free(slot->chunk.chunk_data);
+  tsf_free(slot);
+}
+
+// The slot of field i for the current entity, made most recently used
+static tsf_matrix_slot* matrix_slot(tsf_iter* iter, int i, int entity_idx)
+{
+  int idx = (i * iter->entity_count) + entity_idx;
+  tsf_matrix_slot* slot = iter->matrix_slots[idx];
+  if (!slot) {
+    slot = tsf_calloc(sizeof(tsf_matrix_slot), 1);
+    slot->chunk.chunk_id = -1;
+    slot->idx = idx;
+  } else if (slot == iter->lru_head) {
+    return slot;
+  } else {
+    lru_unlink(iter, slot);
+  }
+  iter->matrix_slots[idx] = slot;
+  lru_push(iter, slot);
+  return slot;
+}
+
+// Counts a newly read slot chunk
+static void matrix_slot_loaded(tsf_iter* iter, tsf_matrix_slot* slot)
+{
+  iter->matrix_resident_bytes += slot->chunk.chunk_bytes - slot->bytes;
+  slot->bytes = slot->chunk.chunk_bytes;
+}
+
+// Releases the least recently used slots while over budget, keeping the
+// keep most recently used ones, such as those of every field of the
+// current cell that cur_values point into
+static void matrix_slot_evict(tsf_iter* iter, int keep)
+{
+  if (iter->matrix_budget <= 0)
+    return;
+  tsf_matrix_slot* last_kept = iter->lru_head;
+  for (int k = 1; last_kept && k < keep; k++)
+    last_kept = last_kept->next;
+  while (last_kept && iter->lru_tail != last_kept &&
+         iter->matrix_resident_bytes > iter->matrix_budget)
+    matrix_slot_free(iter, iter->lru_tail);
+}
+
+/*
+ * Packed genotypes. Chunks of enum fields with at most 3 values can be
+ * held 2 bits per record (TSF_PACKED_NULL for nulls), 4 records per byte
+ * LSB first, padded with zeros to whole 64-bit words so the kernels can
+ * work a word (32 records) at a time.
+ */
+#define PACKED_LO 0x5555555555555555ULL  // Low bit of every 2-bit code
+
+static int64_t packed_bytes(int n)
+{
+  return ((int64_t)n + 31) / 32 * 8;
+}
+
+// Repacks the decoded int32 values of an enum chunk, leaving it as is if
+// the field has too many values or a value is out of range
+static void pack_chunk(tsf_chunk* c, tsf_field* f)
+{
+  if (c->packed || !c->chunk_data || f->value_type != TypeEnum || f->enum_count > 3 ||
+      c->value_type != TypeEnum || c->record_count <= 0)
+    return;
+  int n = c->record_count;
+  bool constant = c->ext.encoding == EncodingConstant;
+  if (!constant && (int64_t)c->chunk_bytes < (int64_t)n * 4)
+    return;
+  const int32_t* values = (const int32_t*)c->chunk_data;
+  unsigned char* bits = tsf_calloc(packed_bytes(n), 1);
+  for (int j = 0; j < n; j++) {
+    int32_t v = values[constant ? 0 : j];
+    int code = v == INT_MISSING ? TSF_PACKED_NULL : v;
+    if (code < 0 || code > TSF_PACKED_NULL || (code == TSF_PACKED_NULL && v != INT_MISSING)) {
+      tsf_free(bits);
+      return;
+    }
+    bits[j >> 2] |= code << ((j & 3) * 2);
+  }
+  tsf_free(c->chunk_data);
+  c->chunk_data = (char*)bits;
+  c->chunk_bytes = (int)packed_bytes(n);
+  c->packed = true;
+}
+
+static uint64_t packed_word(const uint8_t* bits, int64_t w)
+{
+  uint64_t word;
+  memcpy(&word, bits + w * 8, 8);
+  return word;
+}
+
+void tsf_packed_count(const uint8_t* bits, int n, int counts[4])
+{
+  int64_t ones = 0, twos = 0, nulls = 0;
+  for (int64_t w = 0; w < packed_bytes(n) / 8; w++) {
+    uint64_t word = packed_word(bits, w);
+    uint64_t lo = word & PACKED_LO;
+    uint64_t hi = (word >> 1) & PACKED_LO;
+    ones += __builtin_popcountll(lo & ~hi);
+    twos += __builtin_popcountll(hi & ~lo);
+    nulls += __builtin_popcountll(lo & hi);
+  }
+  // Padding codes are 0
+  counts[0] = (int)(n - ones - twos - nulls);
+  counts[1] = (int)ones;
+  counts[2] = (int)twos;
+  counts[3] = (int)nulls;
+}
+
+int64_t tsf_packed_dot(const uint8_t* a, const uint8_t* b, int n, int* both_non_null)
+{
+  // With a = 2 * ah + al (and b alike) for non-null codes,
+  // a * b = 4 * ah * bh + 2 * (ah * bl + al * bh) + al * bl
+  int64_t dot = 0, pairs = 0, padding = packed_bytes(n) * 4 - n;
+  for (int64_t w = 0; w < packed_bytes(n) / 8; w++) {
+    uint64_t x = packed_word(a, w), y = packed_word(b, w);
+    uint64_t al = x & PACKED_LO, ah = (x >> 1) & PACKED_LO;
+    uint64_t bl = y & PACKED_LO, bh = (y >> 1) & PACKED_LO;
+    uint64_t valid = ~(al & ah) & ~(bl & bh) & PACKED_LO;
+    dot += 4 * __builtin_popcountll(ah & bh & valid) +
+           2 * __builtin_popcountll(((ah & bl) | (al & bh)) & valid) +
+           __builtin_popcountll(al & bl & valid);
+    pairs += __builtin_popcountll(valid);
+  }
+  if (both_non_null)
+    *both_non_null = (int)(pairs - padding);
+  return dot;
+}
+
+bool tsf_iter_read_packed(tsf_iter* iter, int i, int record_id, int entity_idx,
+                          tsf_packed* out)
+{
+  memset(out, 0, sizeof(tsf_packed));
+  if (!iter->is_matrix_iter || !iter->pack_enums || i < 0 || i >= iter->field_count ||
+      entity_idx < 0 || entity_idx >= iter->entity_count || record_id < 0 ||
+      record_id >= iter->max_record_id)
+    return false;
+  tsf_field* f = iter->fields[i];
+  tsf_chunk_table* t = &iter->tsf->chunk_tables[f->table_idx];
+  tsf_matrix_slot* slot = matrix_slot(iter, i, entity_idx);
+  tsf_chunk* c = &slot->chunk;
+  int field_idx = iter->entity_ids[entity_idx];
+  int64_t chunk_id = ((int64_t)(record_id >> t->chunk_bits) << 32) | field_idx;
+  if (c->chunk_id != chunk_id) {
+    if (!read_chunk_with_idxmap(iter->tsf, c, f, record_id, field_idx, &iter->stats,
+                                &iter->field_stats[i]))
+      return false;
+    pack_chunk(c, f);
+    matrix_slot_loaded(iter, slot);
+    matrix_slot_evict(iter, 1);
+  }
+  if (!c->packed)
+    return (bool)error("Only enum fields of at most 3 values can be read packed");
+  out->first_record_id = (int)(chunk_id >> 32) * t->chunk_size;
+  out->count = c->record_count;
+  out->bits = (const uint8_t*)c->chunk_data;
   return true;
 }
 
+static bool matrix_prefetch(tsf_iter* iter, int i, int block);
+
 static bool tsf_iter_read_current(tsf_iter* iter)
 {
   // Copy appropriate values into cur_values
   for (int i = 0; i < iter->field_count; i++) {
     tsf_field* f = iter->fields[i];
     tsf_chunk_table* t = &iter->tsf->chunk_tables[f->table_idx];
-    tsf_chunk* c;
-    if (iter->is_matrix_iter)
-      c = &iter->chunks[(i * iter->entity_count) + iter->cur_entity_idx];
-    else
-      c = &iter->chunks[i];
+    tsf_matrix_slot* slot = NULL;
+    tsf_chunk* c = &iter->chunks[i];
+    if (iter->is_matrix_iter && !iter->entity_major) {
+      slot = matrix_slot(iter, i, iter->cur_entity_idx);
+      c = &slot->chunk;
+    }
 
     // For matrix fields, the chunk ID field_idx is the entity offset
     int field_idx = iter->is_matrix_iter ? iter->entity_ids[iter->cur_entity_idx] : f->table_field_idx;
@@ -1051,17 +2894,42 @@ static bool tsf_iter_read_current(tsf_iter* iter)
     int64_t chunk_id = ((int64_t)(iter->cur_record_id >> t->chunk_bits) << 32) | field_idx;
     int offset = iter->cur_record_id % t->chunk_size;
 
-    if (c->chunk_id != chunk_id) {
-      if (!read_chunk_with_idxmap(iter->tsf, c, f, iter->cur_record_id, field_idx, &iter->stats))
+    // Without a budget every entity's chunk of the block stays resident,
+    // so a scan reads them all when the first entity of a record misses
+    if (c->chunk_id != chunk_id && slot && iter->scanning && iter->cur_entity_idx == 0 &&
+        iter->matrix_budget <= 0 && iter->entity_count > 1 && f->locus_idx_map_table < 0) {
+      if (!matrix_prefetch(iter, i, (int)(chunk_id >> 32)))
+        return false;
+      slot = matrix_slot(iter, i, iter->cur_entity_idx);
+      c = &slot->chunk;
+    } else if (c->chunk_id != chunk_id) {
+      if (!read_chunk_with_idxmap(iter->tsf, c, f, iter->cur_record_id, field_idx, &iter->stats,
+                                  &iter->field_stats[i]))
         return false;
+      if (iter->string_codes)
+        code_strings(c);
+      if (iter->pack_enums && iter->is_matrix_iter)
+        pack_chunk(c, f);
+      if (slot)
+        matrix_slot_loaded(iter, slot);
     } else {
       iter->stats.records_in_mem++;
     }
     iter->stats.records_total++;
 
     // Need to set cur_values and cur_nulls to appropriate values
-    chunk_value(c, offset, &iter->cur_values[i], &iter->cur_nulls[i]);
+    if (iter->time_value_access) {
+      int64_t cstart = tsf_clock_ns();
+      chunk_value(c, offset, &iter->cur_values[i], &iter->cur_nulls[i]);
+      histogram_add(&iter->stats.value_access, tsf_clock_ns() - cstart);
+    } else {
+      chunk_value(c, offset, &iter->cur_values[i], &iter->cur_nulls[i]);
+    }
   }
+
+  // Only once every field's value is set, as they all point into chunks
+  if (iter->is_matrix_iter && !iter->entity_major)
+    matrix_slot_evict(iter, iter->field_count);
   return true;
 }
 
@@ -1070,6 +2938,17 @@ bool tsf_iter_next(tsf_iter* iter)
   if (!iter->is_matrix_iter) {
     // No entity dimention. Each iter_next increements cur_record_id
     iter->cur_record_id++;
+  } else if (iter->entity_major) {
+    // Every record of an entity, then on to the next entity
+    if (iter->cur_entity_idx < 0)
+      iter->cur_entity_idx = 0;
+    iter->cur_record_id++;
+    if (iter->cur_record_id >= iter->max_record_id) {
+      iter->cur_entity_idx++;
+      iter->cur_record_id = 0;
+    }
+    if (iter->cur_entity_idx >= iter->entity_count)
+      return false;
   } else {
     iter->cur_entity_idx++;
 
@@ -1086,7 +2965,10 @@ bool tsf_iter_next(tsf_iter* iter)
   if (iter->cur_record_id >= iter->max_record_id)
     return false;
 
-  return tsf_iter_read_current(iter);
+  iter->scanning = true;
+  bool ok = tsf_iter_read_current(iter);
+  iter->scanning = false;
+  return ok;
 }
 
 bool tsf_iter_id(tsf_iter* iter, int id)
@@ -1124,18 +3006,1217 @@ bool tsf_iter_id_matrix(tsf_iter* iter, int id, int entity_idx)
   return tsf_iter_read_current(iter);
 }
 
+bool tsf_iter_read_batch(tsf_iter* iter, int i, int record_id, int max_count,
+                         tsf_batch* batch)
+{
+  memset(batch, 0, sizeof(tsf_batch));
+  if (iter->is_matrix_iter || i < 0 || i >= iter->field_count || record_id < 0 ||
+      record_id >= iter->max_record_id || max_count <= 0)
+    return false;
+  tsf_field* f = iter->fields[i];
+  tsf_chunk_table* t = &iter->tsf->chunk_tables[f->table_idx];
+  tsf_chunk* c = &iter->chunks[i];
+  int64_t chunk_id = ((int64_t)(record_id >> t->chunk_bits) << 32) | f->table_field_idx;
+  if (c->chunk_id != chunk_id) {
+    if (!read_chunk_with_idxmap(iter->tsf, c, f, record_id, f->table_field_idx, &iter->stats,
+                                &iter->field_stats[i]))
+      return false;
+    if (iter->string_codes)
+      code_strings(c);
+  }
+
+  int offset = record_id % t->chunk_size;
+  int count = c->record_count - offset;
+  if (count > max_count)
+    count = max_count;
+  if (count > iter->max_record_id - record_id)
+    count = iter->max_record_id - record_id;
+  if (count <= 0 || !c->chunk_data)
+    return (bool)error("Chunk has fewer records than expected");
+  if (count > iter->batch_capacity) {
+    iter->batch_capacity = count;
+    iter->batch_values = tsf_realloc(iter->batch_values, sizeof(tsf_v) * count);
+    iter->batch_nulls = tsf_realloc(iter->batch_nulls, sizeof(bool) * count);
+  }
+  batch->first_record_id = record_id;
+  batch->count = count;
+  batch->values = iter->batch_values;
+  batch->nulls = iter->batch_nulls;
+  iter->stats.records_total += count;
+
+  if (c->ext.encoding == EncodingConstant) {
+    chunk_value(c, 0, &batch->values[0], &batch->nulls[0]);
+    batch->is_constant = true;
+    batch->all_null = batch->nulls[0];
+    return true;
+  }
+  if (c->dict) {
+    batch->codes = (const int32_t*)c->chunk_data + offset;
+    batch->dict_count = c->dict_count;
+    batch->dict = c->dict;
+  }
+  batch->all_null = true;
+  for (int j = 0; j < count; j++) {
+    chunk_value(c, offset + j, &batch->values[j], &batch->nulls[j]);
+    batch->all_null = batch->all_null && batch->nulls[j];
+  }
+  return true;
+}
+
+// Elements of an array value of a fixed size array chunk, whose size is
+// padded to the element size for 4-byte types
+static const char* array_elements(const tsf_chunk* c, tsf_v value)
+{
+  bool padded = c->value_type == TypeInt32Array || c->value_type == TypeEnumArray ||
+                c->value_type == TypeFloat32Array;
+  return (const char*)value + (padded ? (size_t)c->header.type_size : sizeof(uint16_t));
+}
+
+bool tsf_iter_read_sparse(tsf_iter* iter, int i, int record_id, int max_count,
+                          tsf_sparse_batch* batch)
+{
+  memset(batch, 0, sizeof(tsf_sparse_batch));
+  if (i < 0 || i >= iter->field_count || iter->fields[i]->field_type != FieldSparseArray ||
+      record_id < 0 || record_id >= iter->max_record_id || max_count <= 0)
+    return false;
+  tsf_field* f = iter->fields[i];
+  tsf_chunk_table* t = &iter->tsf->chunk_tables[f->table_idx];
+  if (!iter->sparse_idx_chunks) {
+    iter->sparse_idx_chunks = tsf_calloc(sizeof(tsf_chunk), iter->field_count);
+    for (int j = 0; j < iter->field_count; j++)
+      iter->sparse_idx_chunks[j].chunk_id = -1;
+  }
+  tsf_chunk* c = &iter->chunks[i];
+  tsf_chunk* idx = &iter->sparse_idx_chunks[i];
+  int64_t chunk_id = ((int64_t)(record_id >> t->chunk_bits) << 32) | f->table_field_idx;
+  if (c->chunk_id != chunk_id &&
+      !read_chunk(iter->tsf, t, c, chunk_id, f, &iter->stats, &iter->field_stats[i]))
+    return false;
+  if (idx->chunk_id != chunk_id + 1 &&
+      !read_chunk(iter->tsf, t, idx, chunk_id + 1, f, &iter->stats, &iter->field_stats[i]))
+    return false;
+  if (!tsf_value_type_is_array(c->value_type) || c->value_type == TypeStringArray ||
+      idx->value_type != TypeInt32Array)
+    return (bool)error("Sparse array chunks must be a fixed size array and an Int32Array");
+
+  int offset = record_id % t->chunk_size;
+  int count = c->record_count - offset;
+  if (count > max_count)
+    count = max_count;
+  if (count > iter->max_record_id - record_id)
+    count = iter->max_record_id - record_id;
+  if (count <= 0 || !c->chunk_data || idx->record_count != c->record_count)
+    return (bool)error("Chunk has fewer records than expected");
+  if (count + 1 > iter->sparse_row_capacity) {
+    iter->sparse_row_capacity = count + 1;
+    iter->sparse_row_offsets =
+        tsf_realloc(iter->sparse_row_offsets, sizeof(int) * iter->sparse_row_capacity);
+  }
+
+  // Cells are copied out of the array values back to back
+  int value_size = c->header.type_size;
+  int nnz = 0;
+  for (int j = 0; j < count; j++) {
+    tsf_v values, idxs;
+    bool is_null;
+    chunk_value(c, offset + j, &values, &is_null);
+    chunk_value(idx, offset + j, &idxs, &is_null);
+    int size = va_size(values);
+    if (va_size(idxs) != size)
+      return (bool)error("Sparse array values and entity indices differ in size");
+    if (nnz + size > iter->sparse_cell_capacity) {
+      int capacity = iter->sparse_cell_capacity ? iter->sparse_cell_capacity : 256;
+      while (capacity < nnz + size)
+        capacity *= 2;
+      iter->sparse_cell_capacity = capacity;
+      iter->sparse_entity_idxs =
+          tsf_realloc(iter->sparse_entity_idxs, sizeof(int) * capacity);
+      iter->sparse_values = tsf_realloc(iter->sparse_values, (size_t)value_size * capacity);
+    }
+    iter->sparse_row_offsets[j] = nnz;
+    if (size == 0)
+      continue;
+    memcpy(iter->sparse_entity_idxs + nnz, array_elements(idx, idxs), sizeof(int) * size);
+    memcpy(iter->sparse_values + (size_t)nnz * value_size, array_elements(c, values),
+           (size_t)value_size * size);
+    nnz += size;
+  }
+  iter->sparse_row_offsets[count] = nnz;
+  iter->stats.records_total += count;
+
+  batch->first_record_id = record_id;
+  batch->count = count;
+  batch->nnz = nnz;
+  batch->row_offsets = iter->sparse_row_offsets;
+  batch->entity_idxs = iter->sparse_entity_idxs;
+  batch->values = iter->sparse_values;
+  return true;
+}
+
+/*
+ * Dense matrix blocks. The chunks covering a record range for every
+ * entity of the iterator are fetched in chunk_id order (record block,
+ * then entity), then decompressed by threads started for the call, each
+ * taking the next undecoded chunk.
+ */
+typedef struct block_job {
+  int64_t chunk_id;
+  int entity_idx;  // Into iter->entity_ids
+  char* raw;       // Fetched blob, NULL once decoded
+  int size;
+  tsf_chunk chunk;
+} block_job;
+
+typedef struct block_decoder {
+  tsf_file* tsf;
+  tsf_field* f;
+  tsf_chunk_table* t;
+  block_job* jobs;
+  int job_count;
+  int next_job;
+  bool failed;
+} block_decoder;
+
+typedef struct block_worker {
+  block_decoder* d;
+  pthread_t thread;
+  tsf_stats stats;
+  tsf_field_stats fstats;
+} block_worker;
+
+static void* block_decode(void* arg)
+{
+  block_worker* w = arg;
+  block_decoder* d = w->d;
+  int j;
+  while (!d->failed && (j = __sync_fetch_and_add(&d->next_job, 1)) < d->job_count) {
+    block_job* job = &d->jobs[j];
+    if (!job->raw)
+      continue;  // Decoded while fetching
+    if (!decode_chunk_blob(d->tsf, d->t, &job->chunk, job->chunk_id, job->raw, job->size, d->f,
+                           &w->stats, &w->fstats, tsf_clock_ns()))
+      d->failed = true;
+    tsf_free(job->raw);
+    job->raw = NULL;
+  }
+  return NULL;
+}
+
+static int cmp_block_job(const void* a, const void* b)
+{
+  int64_t x = ((const block_job*)a)->chunk_id;
+  int64_t y = ((const block_job*)b)->chunk_id;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Bytes of a fixed size matrix value, 0 for other types
+static int fixed_value_size(tsf_value_type type)
+{
+  switch (type) {
+    case TypeInt32:
+    case TypeFloat32:
+    case TypeEnum:
+      return 4;
+    case TypeInt64:
+    case TypeFloat64:
+      return 8;
+    case TypeBool:
+      return 1;
+    default:
+      return 0;
+  }
+}
+
+// Sets up the jobs of blocks [first_block, last_block] for entities
+// [first_entity, first_entity + entity_count) of the iterator, sorted by
+// chunk_id
+static void block_jobs_init(tsf_iter* iter, int i, block_decoder* d, int first_block,
+                            int last_block, int first_entity, int entity_count)
+{
+  memset(d, 0, sizeof(block_decoder));
+  d->tsf = iter->tsf;
+  d->f = iter->fields[i];
+  d->t = &iter->tsf->chunk_tables[d->f->table_idx];
+  d->job_count = (last_block - first_block + 1) * entity_count;
+  d->jobs = tsf_calloc(sizeof(block_job), d->job_count);
+  for (int b = first_block, j = 0; b <= last_block; b++) {
+    for (int e = first_entity; e < first_entity + entity_count; e++, j++) {
+      d->jobs[j].chunk_id = ((int64_t)b << 32) | iter->entity_ids[e];
+      d->jobs[j].entity_idx = e;
+      d->jobs[j].chunk.chunk_id = -1;
+    }
+  }
+  qsort(d->jobs, d->job_count, sizeof(block_job), cmp_block_job);
+}
+
+static void block_jobs_free(block_decoder* d)
+{
+  for (int j = 0; j < d->job_count; j++) {
+    tsf_free(d->jobs[j].raw);
+    tsf_free(d->jobs[j].chunk.chunk_data);
+  }
+  tsf_free(d->jobs);
+  d->jobs = NULL;
+  d->job_count = 0;
+}
+
+// Fetches the chunks of the jobs in storage order, then decompresses
+// them with threads (0 for one per CPU). Stats go to field i of iter.
+static bool block_jobs_read(tsf_iter* iter, int i, block_decoder* d, int threads)
+{
+  // Chunks compressed with a zstd dictionary share its decompression
+  // context, so are decoded right away
+  int64_t* ids = tsf_malloc(sizeof(int64_t) * (d->job_count > 0 ? d->job_count : 1));
+  for (int j = 0; j < d->job_count; j++)
+    ids[j] = d->jobs[j].chunk_id;
+  chunk_cursor cur;
+  cursor_init(&cur, d->t, ids, d->job_count);
+  bool ok = true;
+  for (int j = 0; ok && j < d->job_count; j++) {
+    block_job* job = &d->jobs[j];
+    int64_t trace_start = tsf_clock_ns();
+    const char* raw_data;
+    ok = cursor_fetch(iter->tsf, &cur, &raw_data, &job->size, &iter->stats,
+                      &iter->field_stats[i]);
+    if (ok && job->size >= HEADER_SIZE && ((const tsf_chunk_header*)raw_data)->zstd_dict) {
+      ok = decode_chunk_blob(iter->tsf, d->t, &job->chunk, job->chunk_id, raw_data, job->size,
+                             d->f, &iter->stats, &iter->field_stats[i], trace_start);
+    } else if (ok) {
+      job->raw = tsf_malloc(job->size > 0 ? job->size : 1);
+      memcpy(job->raw, raw_data, job->size);
+    }
+  }
+  cursor_close(&cur);
+  tsf_free(ids);
+  if (!ok)
+    return false;
+
+  if (threads <= 0)
+    threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (threads > d->job_count)
+    threads = d->job_count;
+  if (threads < 1)
+    threads = 1;
+  block_worker* workers = tsf_calloc(sizeof(block_worker), threads);
+  int started = 1;  // Worker 0 is the calling thread
+  for (; started < threads; started++) {
+    workers[started].d = d;
+    if (pthread_create(&workers[started].thread, NULL, block_decode, &workers[started]) != 0)
+      break;
+  }
+  workers[0].d = d;
+  block_decode(&workers[0]);
+  for (int w = 0; w < threads; w++) {
+    if (w > 0 && w < started)
+      pthread_join(workers[w].thread, NULL);
+    tsf_stats_merge(&iter->stats, &workers[w].stats);
+    tsf_field_stats* fs = &iter->field_stats[i];
+    fs->read_chunks += workers[w].fstats.read_chunks;
+    fs->decompressed_bytes += workers[w].fstats.decompressed_bytes;
+    fs->decompress_time_ns += workers[w].fstats.decompress_time_ns;
+  }
+  tsf_free(workers);
+  return !d->failed;
+}
+
+// Records [*start, *stop) of job's chunk within [first_record_id,
+// first_record_id + record_count), false if the chunk is short
+static bool block_job_range(block_decoder* d, block_job* job, int first_record_id,
+                            int record_count, int* start, int* stop)
+{
+  int chunk_size = d->t->chunk_size;
+  int block_start = (int)(job->chunk_id >> 32) * chunk_size;
+  *start = first_record_id > block_start ? first_record_id : block_start;
+  *stop = first_record_id + record_count;
+  if (*stop > block_start + chunk_size)
+    *stop = block_start + chunk_size;
+  if (!job->chunk.chunk_data || *stop - block_start > job->chunk.record_count)
+    return (bool)error("Chunk has fewer records than expected");
+  return true;
+}
+
+// Reads the chunks of a record block of field i for every entity whose
+// slot does not hold it yet, in storage order rather than the caller's
+// entity order, ahead of a record-major iterator visiting them
+static bool matrix_prefetch(tsf_iter* iter, int i, int block)
+{
+  block_decoder d;
+  block_jobs_init(iter, i, &d, block, block, 0, iter->entity_count);
+  int kept = 0;
+  for (int j = 0; j < d.job_count; j++) {
+    tsf_matrix_slot* slot = iter->matrix_slots[i * iter->entity_count + d.jobs[j].entity_idx];
+    if (!slot || slot->chunk.chunk_id != d.jobs[j].chunk_id)
+      d.jobs[kept++] = d.jobs[j];
+  }
+  d.job_count = kept;
+  bool ok = block_jobs_read(iter, i, &d, 1);
+  for (int j = 0; ok && j < d.job_count; j++) {
+    block_job* job = &d.jobs[j];
+    tsf_matrix_slot* slot = matrix_slot(iter, i, job->entity_idx);
+    tsf_free(slot->chunk.chunk_data);
+    slot->chunk = job->chunk;
+    memset(&job->chunk, 0, sizeof(tsf_chunk));
+    if (iter->string_codes)
+      code_strings(&slot->chunk);
+    if (iter->pack_enums)
+      pack_chunk(&slot->chunk, iter->fields[i]);
+    matrix_slot_loaded(iter, slot);
+  }
+  block_jobs_free(&d);
+  return ok;
+}
+
+bool tsf_iter_read_matrix_block(tsf_iter* iter, int i, int first_record_id, int record_count,
+                                int threads, void* values, bool* nulls)
+{
+  if (!iter->is_matrix_iter || i < 0 || i >= iter->field_count || first_record_id < 0 ||
+      record_count <= 0 || first_record_id + record_count > iter->max_record_id)
+    return false;
+  tsf_field* f = iter->fields[i];
+  int value_size = fixed_value_size(f->value_type);
+  if (value_size == 0)
+    return (bool)error("Matrix blocks can only be read from fixed size value fields");
+
+  block_decoder d;
+  int chunk_bits = iter->tsf->chunk_tables[f->table_idx].chunk_bits;
+  block_jobs_init(iter, i, &d, first_record_id >> chunk_bits,
+                  (first_record_id + record_count - 1) >> chunk_bits, 0, iter->entity_count);
+  bool ok = block_jobs_read(iter, i, &d, threads);
+
+  // Scatter into the records x entities arrays
+  for (int j = 0; j < d.job_count && ok; j++) {
+    block_job* job = &d.jobs[j];
+    int start, stop;
+    ok = block_job_range(&d, job, first_record_id, record_count, &start, &stop);
+    int block_start = (int)(job->chunk_id >> 32) * d.t->chunk_size;
+    for (int r = start; ok && r < stop; r++) {
+      int64_t cell = (int64_t)(r - first_record_id) * iter->entity_count + job->entity_idx;
+      tsf_v v;
+      chunk_value(&job->chunk, r - block_start, &v, &nulls[cell]);
+      memcpy((char*)values + cell * value_size, v, value_size);
+    }
+  }
+  iter->stats.records_total += (int64_t)record_count * iter->entity_count;
+  block_jobs_free(&d);
+  return ok;
+}
+
+/*
+ * Matrix reductions. Every chunk holds consecutive records of one entity,
+ * so an entity's values are folded into the per record accumulators a
+ * chunk at a time, four records per AVX2 step where the CPU has it.
+ */
+#define REDUCE_ENTITY_GROUP 1024  // Entity chunks decoded at once
+
+#define REDUCE_KERNEL(name, type_t, missing)                                           \
+  static void name(const type_t* v, int n, int* counts, double* sums, double* mins,    \
+                   double* maxs)                                                       \
+  {                                                                                    \
+    for (int j = 0; j < n; j++) {                                                      \
+      if (v[j] == (missing))                                                           \
+        continue;                                                                      \
+      double x = (double)v[j];                                                         \
+      counts[j]++;                                                                     \
+      sums[j] += x;                                                                    \
+      if (x < mins[j])                                                                 \
+        mins[j] = x;                                                                   \
+      if (x > maxs[j])                                                                 \
+        maxs[j] = x;                                                                   \
+    }                                                                                  \
+  }
+
+REDUCE_KERNEL(reduce_int32, int32_t, INT_MISSING)
+REDUCE_KERNEL(reduce_int64, int64_t, INT64_MISSING)
+REDUCE_KERNEL(reduce_float32, float, FLOAT_MISSING)
+REDUCE_KERNEL(reduce_float64, double, DOUBLE_MISSING)
+REDUCE_KERNEL(reduce_bool, char, BOOL_MISSING)
+
+#ifdef TSF_HAVE_AVX2_UNPACK
+// Folds four values x into the accumulators at j, where ok is all ones
+// (in each 32-bit lane) for the non-null ones
+__attribute__((target("avx2")))
+static inline void reduce4_avx2(__m256d x, __m128i ok, int* counts, double* sums,
+                                double* mins, double* maxs)
+{
+  __m256d okd = _mm256_castsi256_pd(_mm256_cvtepi32_epi64(ok));
+  __m128i c = _mm_loadu_si128((const __m128i*)counts);
+  _mm_storeu_si128((__m128i*)counts, _mm_sub_epi32(c, ok));
+  _mm256_storeu_pd(sums, _mm256_add_pd(_mm256_loadu_pd(sums), _mm256_and_pd(x, okd)));
+  // Nulls fold as +/-INFINITY, and like the scalar compare a NaN leaves
+  // the bound as it was
+  __m256d lo = _mm256_blendv_pd(_mm256_set1_pd(INFINITY), x, okd);
+  __m256d hi = _mm256_blendv_pd(_mm256_set1_pd(-INFINITY), x, okd);
+  _mm256_storeu_pd(mins, _mm256_min_pd(lo, _mm256_loadu_pd(mins)));
+  _mm256_storeu_pd(maxs, _mm256_max_pd(hi, _mm256_loadu_pd(maxs)));
+}
+
+// Each returns the number of values folded, a multiple of four
+__attribute__((target("avx2")))
+static int reduce_int32_avx2(const int32_t* v, int n, int* counts, double* sums,
+                             double* mins, double* maxs)
+{
+  __m128i missing = _mm_set1_epi32(INT_MISSING);
+  __m128i ones = _mm_set1_epi32(-1);
+  int j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m128i x = _mm_loadu_si128((const __m128i*)(v + j));
+    __m128i ok = _mm_xor_si128(_mm_cmpeq_epi32(x, missing), ones);
+    reduce4_avx2(_mm256_cvtepi32_pd(x), ok, counts + j, sums + j, mins + j, maxs + j);
+  }
+  return j;
+}
+
+__attribute__((target("avx2")))
+static int reduce_float32_avx2(const float* v, int n, int* counts, double* sums,
+                               double* mins, double* maxs)
+{
+  __m128 missing = _mm_set1_ps(FLOAT_MISSING);
+  int j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m128 x = _mm_loadu_ps(v + j);
+    __m128i ok = _mm_castps_si128(_mm_cmpneq_ps(x, missing));
+    reduce4_avx2(_mm256_cvtps_pd(x), ok, counts + j, sums + j, mins + j, maxs + j);
+  }
+  return j;
+}
+
+__attribute__((target("avx2")))
+static int reduce_float64_avx2(const double* v, int n, int* counts, double* sums,
+                               double* mins, double* maxs)
+{
+  __m256d missing = _mm256_set1_pd(DOUBLE_MISSING);
+  __m256i low_halves = _mm256_setr_epi32(0, 2, 4, 6, 0, 2, 4, 6);
+  int j = 0;
+  for (; j + 4 <= n; j += 4) {
+    __m256d x = _mm256_loadu_pd(v + j);
+    __m256i okd = _mm256_castpd_si256(_mm256_cmp_pd(x, missing, _CMP_NEQ_UQ));
+    __m128i ok = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(okd, low_halves));
+    reduce4_avx2(x, ok, counts + j, sums + j, mins + j, maxs + j);
+  }
+  return j;
+}
+#endif
+
+// Folds n values of type from v into the accumulators
+static void reduce_values(tsf_value_type type, const void* v, int n, int* counts,
+                          double* sums, double* mins, double* maxs)
+{
+  int j = 0;
+#ifdef TSF_HAVE_AVX2_UNPACK
+  if (have_avx2() && n >= 4) {
+    if (type == TypeInt32 || type == TypeEnum)
+      j = reduce_int32_avx2(v, n, counts, sums, mins, maxs);
+    else if (type == TypeFloat32)
+      j = reduce_float32_avx2(v, n, counts, sums, mins, maxs);
+    else if (type == TypeFloat64)
+      j = reduce_float64_avx2(v, n, counts, sums, mins, maxs);
+  }
+#endif
+  n -= j;
+  counts += j;
+  sums += j;
+  mins += j;
+  maxs += j;
+  switch (type) {
+    case TypeInt32:
+    case TypeEnum:
+      reduce_int32((const int32_t*)v + j, n, counts, sums, mins, maxs);
+      break;
+    case TypeInt64:
+      reduce_int64((const int64_t*)v + j, n, counts, sums, mins, maxs);
+      break;
+    case TypeFloat32:
+      reduce_float32((const float*)v + j, n, counts, sums, mins, maxs);
+      break;
+    case TypeFloat64:
+      reduce_float64((const double*)v + j, n, counts, sums, mins, maxs);
+      break;
+    case TypeBool:
+      reduce_bool((const char*)v + j, n, counts, sums, mins, maxs);
+      break;
+    default:
+      break;
+  }
+}
+
+// Folds n records of chunk c from offset into the accumulators of the
+// same records
+static void reduce_chunk(tsf_chunk* c, int offset, int n, int value_size, int enum_count,
+                         int* counts, double* sums, double* mins, double* maxs, int* histogram)
+{
+  if (c->ext.encoding == EncodingConstant) {
+    // The one stored value, folded n times
+    tsf_v v;
+    bool is_null;
+    chunk_value(c, 0, &v, &is_null);
+    if (is_null)
+      return;
+    for (int j = 0; j < n; j++)
+      reduce_values(c->value_type, v, 1, &counts[j], &sums[j], &mins[j], &maxs[j]);
+    if (histogram) {
+      int e = v_int32(v);
+      for (int j = 0; e >= 0 && e < enum_count && j < n; j++)
+        histogram[(int64_t)j * enum_count + e]++;
+    }
+    return;
+  }
+  const char* v = c->chunk_data + (int64_t)offset * value_size;
+  reduce_values(c->value_type, v, n, counts, sums, mins, maxs);
+  if (histogram) {
+    const int32_t* codes = (const int32_t*)v;
+    for (int j = 0; j < n; j++) {
+      int e = codes[j];
+      if (e >= 0 && e < enum_count)
+        histogram[(int64_t)j * enum_count + e]++;
+    }
+  }
+}
+
+bool tsf_iter_reduce_matrix(tsf_iter* iter, int i, int first_record_id, int record_count,
+                            int threads, tsf_matrix_reduction* out)
+{
+  if (!iter->is_matrix_iter || i < 0 || i >= iter->field_count || first_record_id < 0 ||
+      record_count <= 0 || first_record_id + record_count > iter->max_record_id)
+    return false;
+  tsf_field* f = iter->fields[i];
+  int value_size = fixed_value_size(f->value_type);
+  if (value_size == 0)
+    return (bool)error("Matrix reductions need a fixed size value field");
+  int enum_count = f->value_type == TypeEnum ? f->enum_count : 0;
+  int* histogram = enum_count > 0 ? out->histogram : NULL;
+  if (histogram)
+    memset(histogram, 0, sizeof(int) * (size_t)record_count * enum_count);
+
+  int* counts = tsf_calloc(sizeof(int), record_count);
+  double* sums = tsf_calloc(sizeof(double), record_count);
+  double* mins = tsf_malloc(sizeof(double) * record_count);
+  double* maxs = tsf_malloc(sizeof(double) * record_count);
+  for (int r = 0; r < record_count; r++) {
+    mins[r] = INFINITY;
+    maxs[r] = -INFINITY;
+  }
+
+  // A record block at a time, its entity chunks a group at a time
+  tsf_chunk_table* t = &iter->tsf->chunk_tables[f->table_idx];
+  int last_block = (first_record_id + record_count - 1) >> t->chunk_bits;
+  bool ok = true;
+  for (int b = first_record_id >> t->chunk_bits; ok && b <= last_block; b++) {
+    for (int e = 0; ok && e < iter->entity_count; e += REDUCE_ENTITY_GROUP) {
+      int group = iter->entity_count - e < REDUCE_ENTITY_GROUP ? iter->entity_count - e
+                                                               : REDUCE_ENTITY_GROUP;
+      block_decoder d;
+      block_jobs_init(iter, i, &d, b, b, e, group);
+      ok = block_jobs_read(iter, i, &d, threads);
+      for (int j = 0; ok && j < d.job_count; j++) {
+        int start, stop;
+        ok = block_job_range(&d, &d.jobs[j], first_record_id, record_count, &start, &stop);
+        if (!ok)
+          break;
+        int r = start - first_record_id;
+        reduce_chunk(&d.jobs[j].chunk, start - b * t->chunk_size, stop - start, value_size,
+                     enum_count, &counts[r], &sums[r], &mins[r], &maxs[r],
+                     histogram ? &histogram[(int64_t)r * enum_count] : NULL);
+      }
+      block_jobs_free(&d);
+    }
+  }
+  iter->stats.records_total += (int64_t)record_count * iter->entity_count;
+
+  for (int r = 0; r < record_count; r++) {
+    if (counts[r] == 0)
+      mins[r] = maxs[r] = NAN;
+  }
+  if (out->counts)
+    memcpy(out->counts, counts, sizeof(int) * record_count);
+  if (out->sums)
+    memcpy(out->sums, sums, sizeof(double) * record_count);
+  if (out->mins)
+    memcpy(out->mins, mins, sizeof(double) * record_count);
+  if (out->maxs)
+    memcpy(out->maxs, maxs, sizeof(double) * record_count);
+  tsf_free(counts);
+  tsf_free(sums);
+  tsf_free(mins);
+  tsf_free(maxs);
+  return ok;
+}
+
+// Releases everything held by iter but iter itself
+static void iter_release(tsf_iter* iter)
+{
+  if (iter->tsf && iter->tsf->trace) {
+    trace_span span = trace_span_init("iter", iter->trace_start_ns, tsf_clock_ns());
+    span.source_id = iter->source_id;
+    span.records = iter->stats.records_total;
+    span.compressed_bytes = iter->stats.read_chunk_bytes;
+    span.decompressed_bytes = iter->stats.decompressed_bytes;
+    trace_add(iter->tsf->trace, &span);
+  }
+  if (iter->tsf)
+    tsf_file_release(iter->tsf);
+  tsf_free(iter->fields);
+  tsf_free(iter->entity_ids);
+  tsf_free(iter->cur_values);
+  tsf_free(iter->cur_nulls);
+  tsf_free(iter->field_stats);
+  tsf_free(iter->batch_values);
+  tsf_free(iter->batch_nulls);
+  for (int i = 0; i < iter->field_count; i++)
+    tsf_free(iter->chunks[i].chunk_data);
+  tsf_free(iter->chunks);
+  for (int i = 0; iter->sparse_idx_chunks && i < iter->field_count; i++)
+    tsf_free(iter->sparse_idx_chunks[i].chunk_data);
+  tsf_free(iter->sparse_idx_chunks);
+  tsf_free(iter->sparse_row_offsets);
+  tsf_free(iter->sparse_entity_idxs);
+  tsf_free(iter->sparse_values);
+  while (iter->lru_head)
+    matrix_slot_free(iter, iter->lru_head);
+  tsf_free(iter->matrix_slots);
+}
+
 void tsf_iter_close(tsf_iter* iter)
 {
   if(!iter)
     return;
-  free(iter->fields);
-  free(iter->entity_ids);
-  free(iter->cur_values);
-  free(iter->cur_nulls);
-  int chunk_count =
-      iter->is_matrix_iter ? iter->field_count * iter->entity_count : iter->field_count;
-  for (int i = 0; i < chunk_count; i++)
-    free(iter->chunks[i].chunk_data);
-  free(iter->chunks);
-  free(iter);
+  iter_release(iter);
+  tsf_free(iter);
+}
+
+/*
+ * Genomic index queries. The gidx query table has a row per bin of
+ * records in genomic order: id is chr_enum_idx << 16 | bin, and
+ * [field_offset, field_offset + n) the genomic index positions of its
+ * records. A genomic index position is the record id if the source is in
+ * genomic order, otherwise the Start/Stop fields are idx-mapped into the
+ * gidx data table, and the field following them maps positions back to
+ * record ids.
+ */
+
+// Reads a chunk value of a table field at record id (or gidx position)
+static bool gidx_value(tsf_file* tsf, tsf_chunk* c, int table_idx, int field_idx, int id,
+                       tsf_stats* stats, tsf_v* value, bool* is_null)
+{
+  tsf_chunk_table* t = &tsf->chunk_tables[table_idx];
+  int64_t chunk_id = ((int64_t)(id >> t->chunk_bits) << 32) | field_idx;
+  if (c->chunk_id != chunk_id && !read_chunk(tsf, t, c, chunk_id, NULL, stats, NULL))
+    return false;
+  chunk_value(c, id % t->chunk_size, value, is_null);
+  return true;
+}
+
+// Record ids by genomic index position of a source not in genomic order.
+// Its Chr, Start and Stop fields are stored in genomic index order in the
+// gidx data table and read by record id through a locus_idx_map column
+// of that table, which is inverted here.
+static const int* gidx_record_ids(tsf_file* tsf, tsf_source* s, tsf_field** fields,
+                                  tsf_stats* stats)
+{
+  if (s->gidx_record_ids)
+    return s->gidx_record_ids;
+  int data_table = s->gidx_data_table ? atoi(s->gidx_data_table) - 1 : -1;
+  for (int i = 0; i < 3; i++) {
+    if (fields[i]->table_idx != data_table || fields[i]->locus_idx_map_table != data_table ||
+        fields[i]->locus_idx_map_field != fields[0]->locus_idx_map_field)
+      return error("Genomic index fields do not map record ids into the gidx data table");
+  }
+
+  int n = s->locus_count;
+  int* ids = arena_alloc(tsf->arena, sizeof(int) * (n > 0 ? n : 1));
+  memset(ids, 0xff, sizeof(int) * n);  // -1 until mapped
+  tsf_chunk c;
+  memset(&c, 0, sizeof(tsf_chunk));
+  c.chunk_id = -1;
+  bool ok = true;
+  for (int r = 0; r < n && ok; r++) {
+    tsf_v value;
+    bool is_null;
+    ok = gidx_value(tsf, &c, data_table, fields[0]->locus_idx_map_field, r, stats, &value,
+                    &is_null);
+    if (!ok)
+      break;
+    int pos = v_int32(value);
+    if (is_null || pos < 0 || pos >= n || ids[pos] >= 0) {
+      error("Genomic index record id map is not a permutation of the records");
+      ok = false;
+    } else {
+      ids[pos] = r;
+    }
+  }
+  tsf_free(c.chunk_data);
+  if (!ok)
+    return NULL;
+  s->gidx_record_ids = ids;
+  return ids;
+}
+
+tsf_gidx_iter* tsf_query_genomic_index(tsf_file* tsf, int source_id, char* chr, int start,
+                                       int stop, int field_count, int* field_idxs,
+                                       int entity_count, int* entity_ids)
+{
+  if (!tsf)
+    return NULL;
+  tsf_source* s = &tsf->sources[source_id - 1];
+  if (!s->gidx_query_table)
+    return NULL;
+  tsf_field* chr_field = tsf_field_by_symbol(s, "Chr");
+  tsf_field* start_field = tsf_field_by_symbol(s, "Start");
+  tsf_field* stop_field = tsf_field_by_symbol(s, "Stop");
+  if (!chr_field || !start_field || !stop_field)
+    return error("Genomic index source is missing Chr, Start or Stop fields");
+
+  tsf_iter* iter = tsf_query_table(tsf, source_id, field_count, field_idxs, entity_count,
+                                   entity_ids, field_count < 0 ? FieldLocusAttribute
+                                                               : FieldTypeInvalid);
+  if (!iter)
+    return NULL;
+
+  tsf_gidx_iter* g = tsf_calloc(sizeof(tsf_gidx_iter), 1);
+  g->iter = *iter;
+  tsf_free(iter);
+  g->chr = tsf_malloc(strlen(chr) + 1);
+  strcpy(g->chr, chr);
+  g->start = start;
+  g->stop = stop;
+  g->cur_range = 0;
+  g->cur_pos = -1;
+  g->start_field = start_field;
+  g->stop_field = stop_field;
+  g->start_chunk.chunk_id = -1;
+  g->stop_chunk.chunk_id = -1;
+  if (!s->records_in_genomic_order) {
+    tsf_field* fields[3] = {chr_field, start_field, stop_field};
+    g->record_ids = gidx_record_ids(tsf, s, fields, &g->iter.stats);
+    if (!g->record_ids) {
+      tsf_gidx_iter_close(g);
+      return NULL;
+    }
+  }
+
+  int chr_idx = tsf_enum_value_by_name(chr_field, chr);
+  if (chr_idx < 0)
+    return g;  // No records on an unknown chromosome
+
+  char buf[256];
+  snprintf(buf, sizeof(buf),
+           "SELECT field_offset, n FROM %s "
+           "WHERE id >= ? AND id <= ? AND min_start < ? AND max_stop > ? ORDER BY field_offset",
+           s->gidx_query_table);
+  sqlite3_stmt* q;
+  int res = PREP(buf, q);
+  if (res != SQLITE_OK) {
+    tsf_gidx_iter_close(g);
+    return error("Unable to prepare genomic index query");
+  }
+  sqlite3_bind_int64(q, 1, (int64_t)chr_idx << 16);
+  sqlite3_bind_int64(q, 2, ((int64_t)chr_idx << 16) | 0xFFFF);
+  sqlite3_bind_int(q, 3, stop);
+  sqlite3_bind_int(q, 4, start);
+  int capacity = 0;
+  while (sqlite3_step(q) == SQLITE_ROW) {
+    int offset = sqlite3_column_int(q, 0);
+    int n = sqlite3_column_int(q, 1);
+    if (n <= 0)
+      continue;
+    // Merge adjacent bins into one range
+    if (g->range_count > 0 && g->range_stops[g->range_count - 1] >= offset) {
+      if (offset + n > g->range_stops[g->range_count - 1])
+        g->range_stops[g->range_count - 1] = offset + n;
+      continue;
+    }
+    if (g->range_count == capacity) {
+      capacity = capacity ? capacity * 2 : 16;
+      g->range_starts = tsf_realloc(g->range_starts, sizeof(int) * capacity);
+      g->range_stops = tsf_realloc(g->range_stops, sizeof(int) * capacity);
+    }
+    g->range_starts[g->range_count] = offset;
+    g->range_stops[g->range_count] = offset + n;
+    g->range_count++;
+  }
+  sqlite3_finalize(q);
+  return g;
+}
+
+bool tsf_gidx_iter_next(tsf_gidx_iter* g)
+{
+  tsf_file* tsf = g->iter.tsf;
+  while (g->cur_range < g->range_count) {
+    if (g->cur_pos < g->range_starts[g->cur_range])
+      g->cur_pos = g->range_starts[g->cur_range];
+    else
+      g->cur_pos++;
+    if (g->cur_pos >= g->range_stops[g->cur_range]) {
+      g->cur_range++;
+      continue;
+    }
+
+    // Bins are coarse, check the record itself overlaps
+    tsf_v value;
+    bool is_null;
+    if (!gidx_value(tsf, &g->start_chunk, g->start_field->table_idx,
+                    g->start_field->table_field_idx, g->cur_pos, &g->iter.stats, &value,
+                    &is_null))
+      return false;
+    int record_start = v_int32(value);
+    if (is_null)
+      continue;
+    if (record_start >= g->stop) {
+      // The writer enforces sorted Starts in genomic order sources, so no
+      // later record of the range overlaps. Nothing orders the gidx of
+      // other sources, whose ranges are filtered to the end.
+      if (!g->record_ids)
+        g->cur_range++;
+      continue;
+    }
+    if (!gidx_value(tsf, &g->stop_chunk, g->stop_field->table_idx,
+                    g->stop_field->table_field_idx, g->cur_pos, &g->iter.stats, &value,
+                    &is_null))
+      return false;
+    if (is_null || v_int32(value) <= g->start)
+      continue;
+
+    return tsf_iter_id(&g->iter, g->record_ids ? g->record_ids[g->cur_pos] : g->cur_pos);
+  }
+  return false;
+}
+
+void tsf_gidx_iter_close(tsf_gidx_iter* g)
+{
+  if (!g)
+    return;
+  iter_release(&g->iter);
+  tsf_free(g->start_chunk.chunk_data);
+  tsf_free(g->stop_chunk.chunk_data);
+  tsf_free(g->range_starts);
+  tsf_free(g->range_stops);
+  tsf_free(g->chr);
+  tsf_free(g);
+}
+
+/*
+ * Query explain. Estimates are computed from the chunk tables' row
+ * layout and blob lengths (SQLite stores these in the record header, so
+ * no chunk data is read or decompressed) and the genomic index bins.
+ */
+
+// A chunk field id (low 32 bits of chunk_id) a field of the explain
+// needs over a range of record blocks.
+typedef struct explain_target {
+  int field;  // Index into tsf_explain.fields
+  int first_block;
+  int last_block;
+  int next;   // Next target with the same table and chunk field id, or -1
+} explain_target;
+
+typedef struct explain_table {
+  int heads_len;
+  int* heads;  // chunk field id -> first target, or -1
+  int first_block;
+  int last_block;
+} explain_table;
+
+typedef struct explain_plan {
+  tsf_file* tsf;
+  tsf_explain* e;
+  explain_table* tables;  // chunk_table_count long
+  int target_count;
+  int target_capacity;
+  explain_target* targets;
+  int resident_count;
+  int64_t* resident;  // Sorted (table_idx << 48 | chunk_id) keys of the iterator chunks
+} explain_plan;
+
+static void explain_add_target(explain_plan* plan, int table_idx, int chunk_field, int field,
+                               int first_block, int last_block)
+{
+  if (last_block < first_block || chunk_field < 0)
+    return;
+  explain_table* et = &plan->tables[table_idx];
+  if (chunk_field >= et->heads_len) {
+    int len = et->heads_len ? et->heads_len : 16;
+    while (len <= chunk_field)
+      len *= 2;
+    et->heads = tsf_realloc(et->heads, sizeof(int) * len);
+    for (int i = et->heads_len; i < len; i++)
+      et->heads[i] = -1;
+    et->heads_len = len;
+  }
+  if (plan->target_count == plan->target_capacity) {
+    plan->target_capacity = plan->target_capacity ? plan->target_capacity * 2 : 64;
+    plan->targets = tsf_realloc(plan->targets, sizeof(explain_target) * plan->target_capacity);
+  }
+  explain_target* target = &plan->targets[plan->target_count];
+  target->field = field;
+  target->first_block = first_block;
+  target->last_block = last_block;
+  target->next = et->heads[chunk_field];
+  et->heads[chunk_field] = plan->target_count++;
+
+  if (et->first_block < 0 || first_block < et->first_block)
+    et->first_block = first_block;
+  if (last_block > et->last_block)
+    et->last_block = last_block;
+}
+
+static int cmp_int64(const void* a, const void* b)
+{
+  int64_t x = *(const int64_t*)a;
+  int64_t y = *(const int64_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+#define RESIDENT_KEY(table_idx, chunk_id) (((int64_t)(table_idx) << 48) | (chunk_id))
+
+static bool explain_scan_table(explain_plan* plan, int table_idx)
+{
+  tsf_file* tsf = plan->tsf;
+  tsf_chunk_table* t = &tsf->chunk_tables[table_idx];
+  explain_table* et = &plan->tables[table_idx];
+
+  char buf[128 + 64];
+  snprintf(buf, sizeof(buf),
+           "SELECT chunk_id, length(chunk) FROM %s WHERE chunk_id >= ? AND chunk_id <= ?", t->name);
+  sqlite3_stmt* q;
+  int res = PREP(buf, q);
+  if (res != SQLITE_OK)
+    return (bool)error("Unable to prepare explain query");
+  sqlite3_bind_int64(q, 1, (int64_t)et->first_block << 32);
+  sqlite3_bind_int64(q, 2, ((int64_t)et->last_block << 32) | 0xFFFFFFFF);
+
+  while (sqlite3_step(q) == SQLITE_ROW) {
+    int64_t chunk_id = sqlite3_column_int64(q, 0);
+    int bytes = sqlite3_column_int(q, 1);
+    int block = (int)(chunk_id >> 32);
+    int chunk_field = (int)(chunk_id & 0xFFFFFFFF);
+    if (chunk_field >= et->heads_len)
+      continue;
+    for (int i = et->heads[chunk_field]; i >= 0; i = plan->targets[i].next) {
+      explain_target* target = &plan->targets[i];
+      if (block < target->first_block || block > target->last_block)
+        continue;
+      tsf_explain_field* ef = &plan->e->fields[target->field];
+      ef->chunk_count++;
+      ef->compressed_bytes += bytes;
+      int64_t key = RESIDENT_KEY(table_idx, chunk_id);
+      if (plan->resident_count > 0 &&
+          bsearch(&key, plan->resident, plan->resident_count, sizeof(int64_t), cmp_int64))
+        ef->resident_chunks++;
+      else
+        ef->bytes_to_read += bytes;
+    }
+  }
+  sqlite3_finalize(q);
+  return true;
+}
+
+// Plans reading records [start_id, stop_id) of iter's fields. If
+// gidx_first >= 0, locus_idx_map fields are read directly from the
+// genomic index positions [gidx_first, gidx_stop) of their table.
+static tsf_explain* explain_iter(tsf_iter* iter, int start_id, int stop_id, int gidx_first,
+                                 int gidx_stop)
+{
+  tsf_file* tsf = iter->tsf;
+  tsf_source* s = &tsf->sources[iter->source_id - 1];
+  if (stop_id < 0 || stop_id > iter->max_record_id)
+    stop_id = iter->max_record_id;
+  if (start_id < 0)
+    start_id = 0;
+
+  tsf_explain* e = tsf_calloc(sizeof(tsf_explain), 1);
+  e->start_id = start_id;
+  e->stop_id = stop_id;
+  e->estimated_records = stop_id > start_id ? stop_id - start_id : 0;
+  e->field_count = iter->field_count;
+  e->fields = tsf_calloc(sizeof(tsf_explain_field), iter->field_count);
+  if (e->estimated_records == 0) {
+    for (int i = 0; i < iter->field_count; i++)
+      e->fields[i].field = iter->fields[i];
+    return e;
+  }
+
+  explain_plan plan;
+  memset(&plan, 0, sizeof(explain_plan));
+  plan.tsf = tsf;
+  plan.e = e;
+  plan.tables = tsf_calloc(sizeof(explain_table), tsf->chunk_table_count);
+  for (int i = 0; i < tsf->chunk_table_count; i++) {
+    plan.tables[i].first_block = -1;
+    plan.tables[i].last_block = -1;
+  }
+
+  // Chunks already decompressed in the iterator
+  int slot_count = 0;
+  for (tsf_matrix_slot* slot = iter->lru_head; slot; slot = slot->next)
+    slot_count++;
+  plan.resident = tsf_malloc(sizeof(int64_t) * (iter->field_count + slot_count + 1));
+  for (int i = 0; i < iter->field_count; i++) {
+    tsf_chunk* c = &iter->chunks[i];
+    if (c->chunk_id < 0)
+      continue;
+    tsf_field* f = iter->fields[i];
+    if (f->locus_idx_map_table >= 0)
+      continue;  // Holds collated values, not a stored chunk
+    plan.resident[plan.resident_count++] = RESIDENT_KEY(f->table_idx, c->chunk_id);
+  }
+  for (tsf_matrix_slot* slot = iter->lru_head; slot; slot = slot->next) {
+    if (slot->chunk.chunk_id < 0)
+      continue;
+    tsf_field* f = iter->fields[slot->idx / iter->entity_count];
+    plan.resident[plan.resident_count++] = RESIDENT_KEY(f->table_idx, slot->chunk.chunk_id);
+  }
+  qsort(plan.resident, plan.resident_count, sizeof(int64_t), cmp_int64);
+
+  for (int i = 0; i < iter->field_count; i++) {
+    tsf_field* f = iter->fields[i];
+    tsf_explain_field* ef = &e->fields[i];
+    ef->field = f;
+    tsf_chunk_table* t = &tsf->chunk_tables[f->table_idx];
+    int first_block = start_id >> t->chunk_bits;
+    int last_block = (stop_id - 1) >> t->chunk_bits;
+
+    if (iter->is_matrix_iter) {
+      for (int j = 0; j < iter->entity_count; j++)
+        explain_add_target(&plan, f->table_idx, iter->entity_ids[j], i, first_block, last_block);
+    } else if (f->locus_idx_map_table < 0) {
+      explain_add_target(&plan, f->table_idx, f->table_field_idx, i, first_block, last_block);
+    } else if (gidx_first >= 0) {
+      // Genomic index positions are the backend record ids
+      explain_add_target(&plan, f->table_idx, f->table_field_idx, i,
+                         gidx_first >> t->chunk_bits, (gidx_stop - 1) >> t->chunk_bits);
+    } else {
+      // The idx map chunks for the record range, plus the backend chunks
+      // they point into. Those are only known to be in the same range if
+      // the source is in genomic order, otherwise assume all of them.
+      tsf_chunk_table* idx_t = &tsf->chunk_tables[f->locus_idx_map_table];
+      explain_add_target(&plan, f->locus_idx_map_table, f->locus_idx_map_field, i,
+                         start_id >> idx_t->chunk_bits, (stop_id - 1) >> idx_t->chunk_bits);
+      if (s->records_in_genomic_order) {
+        explain_add_target(&plan, f->table_idx, f->table_field_idx, i, first_block, last_block);
+      } else {
+        explain_add_target(&plan, f->table_idx, f->table_field_idx, i, 0,
+                           (s->locus_count - 1) >> t->chunk_bits);
+        ef->estimate_is_upper_bound = true;
+      }
+    }
+  }
+
+  bool ok = true;
+  for (int i = 0; i < tsf->chunk_table_count && ok; i++)
+    if (plan.tables[i].heads_len > 0)
+      ok = explain_scan_table(&plan, i);
+
+  for (int i = 0; i < e->field_count; i++) {
+    e->chunk_count += e->fields[i].chunk_count;
+    e->compressed_bytes += e->fields[i].compressed_bytes;
+    e->bytes_to_read += e->fields[i].bytes_to_read;
+    e->resident_chunks += e->fields[i].resident_chunks;
+  }
+
+  for (int i = 0; i < tsf->chunk_table_count; i++)
+    tsf_free(plan.tables[i].heads);
+  tsf_free(plan.tables);
+  tsf_free(plan.targets);
+  tsf_free(plan.resident);
+  if (!ok) {
+    tsf_explain_free(e);
+    return NULL;
+  }
+  return e;
+}
+
+tsf_explain* tsf_explain_iter(tsf_iter* iter, int start_id, int stop_id)
+{
+  return explain_iter(iter, start_id, stop_id, -1, -1);
+}
+
+tsf_explain* tsf_explain_table(tsf_file* tsf, int source_id, int field_count, int* field_idxs,
+                               int entity_count, int* entity_ids, tsf_field_type field_type,
+                               int start_id, int stop_id)
+{
+  tsf_iter* iter = tsf_query_table(tsf, source_id, field_count, field_idxs, entity_count,
+                                   entity_ids, field_type);
+  if (!iter)
+    return NULL;
+  tsf_explain* e = tsf_explain_iter(iter, start_id, stop_id);
+  tsf_iter_close(iter);
+  return e;
+}
+
+tsf_explain* tsf_explain_genomic_iter(tsf_iter* iter, const char* chr, int start, int stop)
+{
+  tsf_file* tsf = iter->tsf;
+  tsf_source* s = &tsf->sources[iter->source_id - 1];
+  if (!s->gidx_query_table)
+    return error("Source does not have a genomic index");
+
+  // Chromosomes are numbered by the enum values of the Chr field
+  tsf_field* chr_field = tsf_field_by_symbol(s, "Chr");
+  int chr_idx = chr_field ? tsf_enum_value_by_name(chr_field, chr) : -1;
+  int64_t bins = 0, records = 0;
+  int gidx_first = 0, gidx_stop = 0;
+  if (chr_idx >= 0) {
+    // Genomic index rows are keyed by chr_idx << 16 | bin
+    char buf[256];
+    snprintf(buf, sizeof(buf),
+             "SELECT COUNT(*), SUM(n), MIN(field_offset), MAX(field_offset + n) FROM %s "
+             "WHERE id >= ? AND id <= ? AND min_start < ? AND max_stop > ?",
+             s->gidx_query_table);
+    sqlite3_stmt* q;
+    int res = PREP(buf, q);
+    if (res != SQLITE_OK)
+      return error("Unable to prepare genomic index explain query");
+    sqlite3_bind_int64(q, 1, (int64_t)chr_idx << 16);
+    sqlite3_bind_int64(q, 2, ((int64_t)chr_idx << 16) | 0xFFFF);
+    sqlite3_bind_int(q, 3, stop);
+    sqlite3_bind_int(q, 4, start);
+    if (sqlite3_step(q) == SQLITE_ROW) {
+      bins = sqlite3_column_int64(q, 0);
+      records = sqlite3_column_int64(q, 1);
+      gidx_first = sqlite3_column_int(q, 2);
+      gidx_stop = sqlite3_column_int(q, 3);
+    }
+    sqlite3_finalize(q);
+  }
+
+  tsf_explain* e;
+  if (records == 0) {
+    e = explain_iter(iter, 0, 0, -1, -1);
+  } else if (s->records_in_genomic_order) {
+    e = explain_iter(iter, gidx_first, gidx_stop, gidx_first, gidx_stop);
+  } else {
+    // Matching records may be anywhere in the table
+    e = explain_iter(iter, 0, -1, gidx_first, gidx_stop);
+    if (e) {
+      for (int i = 0; i < e->field_count; i++)
+        if (e->fields[i].field->locus_idx_map_table < 0)
+          e->fields[i].estimate_is_upper_bound = true;
+    }
+  }
+  if (e) {
+    e->gidx_bins = bins;
+    e->estimated_records = records;
+  }
+  return e;
+}
+
+tsf_explain* tsf_explain_genomic(tsf_file* tsf, int source_id, const char* chr, int start,
+                                 int stop, int field_count, int* field_idxs, int entity_count,
+                                 int* entity_ids)
+{
+  tsf_iter* iter = tsf_query_table(tsf, source_id, field_count, field_idxs, entity_count,
+                                   entity_ids, field_count < 0 ? FieldLocusAttribute
+                                                               : FieldTypeInvalid);
+  if (!iter)
+    return NULL;
+  tsf_explain* e = tsf_explain_genomic_iter(iter, chr, start, stop);
+  tsf_iter_close(iter);
+  return e;
+}
+
+void tsf_explain_free(tsf_explain* e)
+{
+  if (!e)
+    return;
+  tsf_free(e->fields);
+  tsf_free(e);
 }
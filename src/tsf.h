@@ -124,6 +124,24 @@ typedef enum {
   FieldSparseArray
 } tsf_field_type;
 
+// Opaque string hash index used for name lookups
+struct tsf_str_index;
+
+// Opaque bump allocator owning per-file meta-data
+struct tsf_arena;
+
+// Opaque file pool, see tsf_pool_create
+struct tsf_pool;
+
+// Opaque span recorder, see tsf_trace_create
+struct tsf_trace;
+
+// Opaque cache of zstd dictionaries and the context decompressing with them
+struct tsf_dict_cache;
+
+// Opaque cache of chunks collated through a locus_idx_map
+struct tsf_idxmap_cache;
+
 typedef struct tsf_field {
   tsf_value_type value_type;
   tsf_field_type field_type;
@@ -151,6 +169,7 @@ typedef struct tsf_field {
   int locus_idx_map_field;
   const char* entity_idx_map;
   int table_field_idx;
+  struct tsf_str_index* enum_index;  // enum_names -> enum value
 } tsf_field;
 
 typedef struct tsf_source {
@@ -162,6 +181,10 @@ typedef struct tsf_source {
   int field_count;
   tsf_field* fields;
 
+  // Hashed field lookups, see tsf_field_by_symbol
+  struct tsf_str_index* symbol_index;
+  struct tsf_str_index* name_index;
+
   int entity_count;
   int locus_count;
 
@@ -182,8 +205,16 @@ typedef struct tsf_source {
   const char* gidx_data_table;
   bool records_in_genomic_order;
 
+  // Record id at each genomic index position when records are not in
+  // genomic order: the inverse of the locus_idx_map of Chr, Start and
+  // Stop. Loaded by the first genomic index query, NULL until then.
+  const int* gidx_record_ids;
+
   // Supporting source: computed off a primary
   const char* primary_source_uuid;
+
+  // Loaded by tsf_source_entities, NULL until then
+  struct tsf_entity_table* entities;
 } tsf_source;
 
 // Forward declare sqlite3
@@ -205,6 +236,7 @@ typedef struct tsf_chunk_table {
   int record_count;
 
   struct sqlite3_stmt* q;
+  struct sqlite3_stmt* range_q;  // chunk_id, chunk in [?, ?] ascending
 
   int* scratch_array_sizes; // chunk_size array
 } tsf_chunk_table;
@@ -215,13 +247,29 @@ typedef struct tsf_chunk_table {
 typedef struct tsf_file {
   int source_count;  // Number of sources
   tsf_source* sources;
+  struct tsf_str_index* uuid_index;
 
   int chunk_table_count; // Internal chunk table meta
   tsf_chunk_table* chunk_tables;
 
   char* errmsg; // Description of what went wrong
 
-  struct sqlite3* db;
+  struct sqlite3* db;      // NULL while a pooled file is disconnected
+  struct tsf_arena* arena; // Owns all source/field meta-data strings
+  const char* file_name;
+
+  // Pooling state. pin_count is the number of live iterators, pool_refs
+  // the tsf_pool_open calls not yet matched by tsf_close_file.
+  struct tsf_pool* pool;
+  int pin_count;
+  int pool_refs;
+  struct tsf_file* lru_prev;
+  struct tsf_file* lru_next;
+
+  struct tsf_trace* trace; // If set, chunk reads and iterators record spans
+
+  struct tsf_dict_cache* dicts; // Zstd dictionaries, loaded by the first chunk using each
+  struct tsf_idxmap_cache* idxmaps; // Collated locus_idx_map chunks, see read_chunk_with_idxmap
 } tsf_file;
 
 typedef enum {
@@ -229,15 +277,50 @@ typedef enum {
   CompressionZlib   = 0x1,
   CompressionBlosc  = 0x2,
   CompressionLZ4    = 0x3,
+
+  // Only in extended headers (tsf_chunk_header_ext.codec)
+  CompressionNone   = 0x4,
 } compression_mehtod;
 
+// Lightweight encodings of 4-byte scalar chunks (Int32, Enum and, for RLE
+// and Dict only, Float32), applied before compression, and of constant
+// chunks. Layouts of the decompressed data, all little-endian:
+typedef enum {
+  EncodingNone  = 0x0,
+  EncodingDelta = 0x1,  // uint32 x[0], then x[i] - x[i-1] (mod 2^32) per record
+  EncodingFOR   = 0x2,  // Frame of reference: int32 min, uint8 bits, 3 pad bytes,
+                        // then x - min bit-packed in uint32 words, LSB first
+  EncodingRLE   = 0x3,  // uint32 run count, then (uint32 value, uint32 length) runs
+  EncodingDict  = 0x4,  // uint32 count, count distinct uint32 values, uint8 bits,
+                        // 3 pad bytes, then the value indexes bit-packed as FOR
+  EncodingDeltaFOR = 0x5, // uint32 x[0], int32 min delta, uint8 bits, 3 pad bytes, then
+                          // x[i] - x[i-1] - min for i >= 1 bit-packed as FOR. Suits
+                          // sorted positions such as Start and Stop.
+  EncodingConstant = 0x6, // Every record has the same value (often missing), stored
+                          // once in the plain layout. Non-array types only.
+  EncodingStringDict = 0x7, // String chunks: uint32 count, count distinct NULL
+                            // terminated strings, uint32 bits, then the string
+                            // indexes bit-packed as FOR
+  EncodingShuffle = 0x8,  // 4 and 8-byte scalars, mainly Float32/64 scores: blocks of
+                          // TSF_SHUFFLE_BLOCK bytes (the last may be shorter) each
+                          // stored as type_size byte planes, as Blosc's shuffle
+  EncodingDecimal = 0x9,  // Float32/64 of few decimal places: int32 min, uint8 exponent
+                          // e, uint8 bits, 2 pad bytes, uint32 exception count, then
+                          // round(x * 10^e) - min bit-packed as FOR, then (uint32
+                          // index, type_size value) for values that do not round trip
+                          // as digits / 10^e, such as missing values
+} tsf_chunk_encoding;
+
+#define TSF_SHUFFLE_BLOCK 8192  // Power of two for the SSE2 (un)shuffle
+
 typedef struct tsf_chunk_header {
   //[0-1] two byte magic 0xFA01 (can also be used to indicate version in second byte in the future)
   unsigned char magic[2];
 
   //[2-2] One byte of flags, 2 bites used for the compression algorithm currently
   unsigned char compression_method:2;
-  unsigned char dummy_padding:6;
+  unsigned char zstd_dict:1;  // future4 is the id of the zstd_dict the chunk is compressed with
+  unsigned char dummy_padding:5;
 
   //[3-5] 3 bytes for type serialization. Null padded if len(format) < 3
   char format[3];
@@ -254,11 +337,28 @@ typedef struct tsf_chunk_header {
 
 #define CHUNK_MAGIC_B0 0xFA
 #define CHUNK_MAGIC_B1 0x01
+#define CHUNK_MAGIC_B1_EXT 0x02  // Header is followed by a tsf_chunk_header_ext
 
 #define HEADER_SIZE 16 //sizeof(tsf_chunk_header)
 
+// Extends the header of chunks using codecs or encodings that do not fit
+// in it. Readers that predate it reject these chunks by their magic.
+typedef struct tsf_chunk_header_ext {
+  //[16-16] compression_mehtod, superseding header.compression_method
+  uint8_t codec;
+
+  //[17-17] tsf_chunk_encoding of the decompressed data
+  uint8_t encoding;
+
+  //[18-19] Reserved, zero
+  uint16_t reserved;
+} tsf_chunk_header_ext;
+
+#define HEADER_EXT_SIZE 4 //sizeof(tsf_chunk_header_ext)
+
 typedef struct tsf_chunk {
   tsf_chunk_header header;
+  tsf_chunk_header_ext ext;  // Filled in from header for chunks without one
 
   int record_count;
   int64_t chunk_id;
@@ -268,22 +368,69 @@ typedef struct tsf_chunk {
 
   int cur_offset;
   tsf_v cur_value;
+
+  // Dictionary coded string chunks (stored so or coded as read): chunk_data
+  // starts with int32 codes per record into the dict_count strings of dict
+  int dict_count;
+  const char** dict;
+
+  // Enum chunks packed as read (see tsf_iter.pack_enums): chunk_data holds
+  // 2 bits per record, and values are unpacked into packed_value
+  bool packed;
+  int32_t packed_value;
 } tsf_chunk;
 
+// Latency histogram of log2 nanosecond buckets: bucket i counts
+// samples in [2^i, 2^(i+1)) ns (bucket 0 also holds 0ns)
+#define TSF_HISTOGRAM_BUCKETS 40
+
+typedef struct tsf_histogram {
+  int64_t count;
+  int64_t total_ns;
+  int64_t max_ns;
+  int64_t buckets[TSF_HISTOGRAM_BUCKETS];
+} tsf_histogram;
+
+#define TSF_CODEC_COUNT 5  // Number of compression_mehtod values
+
+typedef struct tsf_codec_stats {
+  int64_t chunks;
+  int64_t compressed_bytes;
+  int64_t decompressed_bytes;
+  int64_t decompress_time_ns;
+} tsf_codec_stats;
+
+typedef struct tsf_field_stats {
+  int64_t read_chunks;
+  int64_t read_chunk_bytes;
+  int64_t decompressed_bytes;
+  int64_t read_time_ns;
+  int64_t decompress_time_ns;
+} tsf_field_stats;
+
+// All times are monotonic wall-clock nanoseconds (see tsf_clock_ns)
 typedef struct tsf_stats {
   int64_t read_chunks;
   int64_t read_chunk_bytes;
   int64_t decompressed_bytes;
-  clock_t read_time;
-  clock_t decompress_time;
+  int64_t read_time_ns;        // Fetching chunk blobs from SQLite
+  int64_t decompress_time_ns;  // Decompressing and reconstituting chunks
   int64_t records_in_mem;
   int64_t records_total;
-} tsf_stats;
 
+  tsf_codec_stats codecs[TSF_CODEC_COUNT]; // Indexed by compression_mehtod
+
+  tsf_histogram chunk_fetch;
+  tsf_histogram decompress;
+  tsf_histogram reconstitution;  // Array re-layout and locus_idx_map collation
+  tsf_histogram value_access;    // Only if tsf_iter.time_value_access is set
+} tsf_stats;
 
 /**
  * An iterator may only grab fields of a uniform FIELD_TYPE
  */
+typedef struct tsf_matrix_slot tsf_matrix_slot;
+
 typedef struct tsf_iter {
   int cur_record_id;
   int max_record_id;  // The locus or entity count for the source
@@ -302,14 +449,78 @@ typedef struct tsf_iter {
   int entity_count;
   int* entity_ids;
 
-  tsf_chunk* chunks;  // len <- is_matrix_iter ? field_count * entity_count :
-                      // field_count
+  tsf_chunk* chunks;  // field_count in length. Matrix iterators only use
+                      // these if entity_major, otherwise matrix_slots
   int source_id;
   tsf_file* tsf;
 
   tsf_stats stats; //Iterator stats
+  tsf_field_stats* field_stats; // field_count in length
+  bool time_value_access; // Time every value read into stats.value_access
+  int64_t trace_start_ns;
+
+  // Dictionary code string chunks not stored so as they are read, so
+  // batches have codes. Set before reading.
+  bool string_codes;
+
+  // Matrix iterators only: tsf_iter_next visits every record of one
+  // entity before moving to the next, keeping a single chunk per field
+  // decompressed. Set before reading.
+  bool entity_major;
+
+  // Matrix iterators only: chunks of enum fields with at most 3 values
+  // are kept packed 2 bits per record as read (see tsf_iter_read_packed).
+  // Set before reading.
+  bool pack_enums;
+
+  // Matrix iterators: a chunk slot per field and entity, field major,
+  // allocated as first read
+  tsf_matrix_slot** matrix_slots;
+
+  // Decompressed bytes of matrix_slots chunks kept before the least
+  // recently used ones are released, 0 for no limit (default). Set
+  // before reading.
+  int64_t matrix_budget;
+  int64_t matrix_resident_bytes;
+  tsf_matrix_slot* lru_head;  // Most recently used
+  tsf_matrix_slot* lru_tail;
+
+  // Set while tsf_iter_next reads, when the remaining entities of a
+  // record block are read ahead rather than only the cell looked up
+  bool scanning;
+
+  // Buffers of tsf_iter_read_batch
+  int batch_capacity;
+  tsf_v* batch_values;
+  bool* batch_nulls;
+
+  // Entity index chunks and buffers of tsf_iter_read_sparse
+  tsf_chunk* sparse_idx_chunks;
+  int sparse_row_capacity;
+  int* sparse_row_offsets;
+  int sparse_cell_capacity;
+  int* sparse_entity_idxs;
+  char* sparse_values;
 } tsf_iter;
 
+// Consecutive values of one field read by tsf_iter_read_batch. values and
+// nulls are owned by the iterator and valid until its next batch read.
+typedef struct tsf_batch {
+  int first_record_id;
+  int count;
+  bool all_null;     // Every value is null
+  bool is_constant;  // Every value is values[0] (stored once in the chunk),
+                     // only values[0] and nulls[0] are set
+  tsf_v* values;
+  bool* nulls;
+
+  // Set for dictionary coded string chunks: count codes into the chunk's
+  // dict_count distinct strings, owned by the iterator like values
+  const int32_t* codes;
+  int dict_count;
+  const char** dict;
+} tsf_batch;
+
 typedef struct tsf_gidx_iter {
   // Iter context, cur_record_id may not increase monotonically if source
   // is not natively in genomic order.
@@ -320,13 +531,117 @@ typedef struct tsf_gidx_iter {
   int start;
   int stop;
 
-  // TODO: Some other sqlite held state for the current genomic index
+  // Genomic index positions of the overlapping bins, as sorted
+  // [range_starts, range_stops) ranges
+  int range_count;
+  int* range_starts;
+  int* range_stops;
+  int cur_range;
+  int cur_pos;  // Genomic index position of cur_record_id
+
+  // Start/Stop at cur_pos
+  tsf_field* start_field;
+  tsf_field* stop_field;
+  tsf_chunk start_chunk;
+  tsf_chunk stop_chunk;
+  const int* record_ids;  // By position, NULL if records are in genomic order
 } tsf_gidx_iter;
 
+// Allocator used for all library allocations. Must be set before any
+// file is opened. Pass all three functions, or all NULL to restore the
+// libc ones; mixing NULL and non-NULL returns false and changes nothing.
+//
+// The allocator is also handed to jansson with json_set_alloc_funcs,
+// which is process-wide: any other jansson user in the process allocates
+// through it too.
+typedef void* (*tsf_malloc_t)(size_t);
+typedef void* (*tsf_realloc_t)(void*, size_t);
+typedef void (*tsf_free_t)(void*);
+
+bool tsf_set_allocator(tsf_malloc_t malloc_fn, tsf_realloc_t realloc_fn, tsf_free_t free_fn);
+
+// Allocate through the allocator set by tsf_set_allocator, which the
+// reader and writer both use
+void* tsf_malloc(size_t size);
+void* tsf_calloc(size_t count, size_t size);
+void* tsf_realloc(void* p, size_t size);
+void tsf_free(void* p);
+
 tsf_file* tsf_open_file(const char* fileName);
 
 void tsf_close_file(tsf_file* tsf);
 
+// A pool of TSF files that caps the number of open SQLite connections
+// (and their file descriptors and prepared statements).
+//
+// Files opened through the pool keep their parsed meta-data resident.
+// When a file is not used by any iterator, its connection may be closed
+// to stay under max_connections (least recently used first), and is
+// transparently re-opened when a new iterator is created on it. If all
+// connections are pinned by live iterators the cap is exceeded rather
+// than failing.
+//
+// tsf_pool_open returns the already opened file when called again with
+// the same path, counting a reference. Each call is matched by a
+// tsf_close_file, and the last one removes the file from the pool and
+// frees it. Files that fail to open (errmsg set) are not pooled and must
+// be closed by the caller with tsf_close_file.
+//
+// The pool itself may be used from several threads, but like any
+// tsf_file, a pooled file (shared by every caller opening its path) must
+// only be read by one thread at a time: its statements and chunk caches
+// are not locked. Threads reading the same file concurrently each open
+// their own with tsf_open_file.
+typedef struct tsf_pool tsf_pool;
+
+tsf_pool* tsf_pool_create(int max_connections);
+
+tsf_file* tsf_pool_open(tsf_pool* pool, const char* fileName);
+
+int tsf_pool_connection_count(tsf_pool* pool);
+
+// Closes all the files in the pool, whatever references remain
+void tsf_pool_close(tsf_pool* pool);
+
+// Pin a file's connection (re-opening it if pooled and disconnected).
+// tsf_query_table does this for the lifetime of its iterator, so only
+// needed when reading the file's SQLite connection directly.
+bool tsf_file_acquire(tsf_file* tsf);
+
+void tsf_file_release(tsf_file* tsf);
+
+// Hashed lookups built when the file is opened. These return NULL (or
+// -1 for enum values) when nothing matches.
+tsf_source* tsf_source_by_uuid(tsf_file* tsf, const char* uuid);
+
+tsf_field* tsf_field_by_symbol(tsf_source* s, const char* symbol);
+
+tsf_field* tsf_field_by_name(tsf_source* s, const char* name);
+
+// Returns the enum value (index into f->enum_names) for name
+int tsf_enum_value_by_name(tsf_field* f, const char* name);
+
+// Every entity attribute field of a source, loaded once into columns of
+// entity_count values. Columns are arrays of the field's C type as in
+// tsf_writer_append (const char* for strings, NULL if missing); array
+// fields are not loaded and their columns are NULL. Owned by the file.
+typedef struct tsf_entity_table {
+  int entity_count;
+  int field_count;
+  tsf_field** fields;
+  void** columns;
+  bool** nulls;
+  int name_field;  // The first string field, whose values name entities, or -1
+  struct tsf_str_index* name_index;
+} tsf_entity_table;
+
+// Loads the entity attributes of a source on first use, NULL on error
+const tsf_entity_table* tsf_source_entities(tsf_file* tsf, int source_id);
+
+// Entity index (as in tsf_query_table entity_ids) of the first entity
+// with name, or -1
+int tsf_entity_by_name(tsf_file* tsf, int source_id, const char* name);
+
 // Query the table in its natural order. Set start_id to 0 to read the
 // whole table.
 //
@@ -362,10 +677,189 @@ bool tsf_iter_id(tsf_iter* iter, int id);
 
 bool tsf_iter_id_matrix(tsf_iter* iter, int id, int entity_idx);
 
+// Reads field i (an index into iter->fields) from record_id to the end of
+// its chunk, at most max_count records. Constant and all-null chunks are
+// reported without touching each value. Shares the field's chunk with the
+// iterator, so read cur_values first. Returns false past the last record,
+// on error or for matrix iterators.
+bool tsf_iter_read_batch(tsf_iter* iter, int i, int record_id, int max_count,
+                         tsf_batch* batch);
+
+// Records of a sparse array field in compressed sparse row form. A sparse
+// array field (FieldSparseArray) holds the non-missing cells of a matrix
+// per locus record: the record's values as the field's array value type
+// (what tsf_iter_next reads) and, in the next chunk field of its table,
+// their ascending entity indices as an Int32Array.
+//
+// Record first_record_id + r has the cells [row_offsets[r],
+// row_offsets[r + 1]) of entity_idxs and values, which are arrays of nnz
+// of the element C type (int, float, double, char for bools, int for
+// enums). Owned by the iterator and valid until its next sparse read.
+typedef struct tsf_sparse_batch {
+  int first_record_id;
+  int count;
+  int nnz;
+  const int* row_offsets;  // count + 1 long
+  const int* entity_idxs;
+  const void* values;
+} tsf_sparse_batch;
+
+// Reads sparse array field i (an index into iter->fields) from record_id
+// to the end of its chunk, at most max_count records, without expanding
+// records to a value per entity. Shares the field's chunk with the
+// iterator like tsf_iter_read_batch. Returns false past the last record,
+// on error or for other fields.
+bool tsf_iter_read_sparse(tsf_iter* iter, int i, int record_id, int max_count,
+                          tsf_sparse_batch* batch);
+
+// Reads field i of a matrix iterator for record_count records from
+// first_record_id and every entity of the iterator into values and nulls,
+// record_count * entity_count long with each record's entities together
+// (values[r * entity_count + entity_idx]). Only fixed size value types
+// can be read: values is an array of int, int64_t, float, double, char
+// for bools or int for enums, holding the *_MISSING sentinels for nulls.
+// The chunks are fetched in storage order and decompressed by threads
+// started for the call, 0 for one per CPU.
+bool tsf_iter_read_matrix_block(tsf_iter* iter, int i, int first_record_id, int record_count,
+                                int threads, void* values, bool* nulls);
+
+// Per record summaries of a matrix field over the iterator's entities,
+// each array record_count long. NULL arrays are skipped.
+typedef struct tsf_matrix_reduction {
+  int* counts;     // Non-null values
+  double* sums;
+  double* mins;    // NAN for records without values
+  double* maxs;
+  int* histogram;  // Enum fields only: record_count * enum_count counts of
+                   // each enum value (histogram[r * enum_count + e])
+} tsf_matrix_reduction;
+
+// Reduces field i of a matrix iterator (a fixed size value type) for
+// record_count records from first_record_id. Chunks are decompressed by
+// threads as in tsf_iter_read_matrix_block.
+bool tsf_iter_reduce_matrix(tsf_iter* iter, int i, int first_record_id, int record_count,
+                            int threads, tsf_matrix_reduction* out);
+
+// 2 bits per record genotypes of one entity's chunk: 4 records per byte,
+// LSB first, the enum value or TSF_PACKED_NULL, and zero padded to whole
+// 64-bit words
+#define TSF_PACKED_NULL 3
+
+typedef struct tsf_packed {
+  int first_record_id;  // Of the chunk
+  int count;
+  const uint8_t* bits;
+} tsf_packed;
+
+// Reads the packed chunk of field i holding record_id for entity_idx (an
+// index into iter->entity_ids) of a matrix iterator with pack_enums set.
+// bits are owned by the iterator and valid until its next read (or later
+// without a matrix_budget).
+bool tsf_iter_read_packed(tsf_iter* iter, int i, int record_id, int entity_idx,
+                          tsf_packed* out);
+
+// Counts of each code (0, 1, 2 and TSF_PACKED_NULL) of n packed records
+void tsf_packed_count(const uint8_t* bits, int n, int counts[4]);
+
+// Sum of a * b over the n records non-null in both, and the number of
+// those if both_non_null is not NULL
+int64_t tsf_packed_dot(const uint8_t* a, const uint8_t* b, int n, int* both_non_null);
+
 void tsf_iter_close(tsf_iter* iter);
 
+// Monotonic clock used for all stats timings
+int64_t tsf_clock_ns(void);
+
+// Copy the current stats of an iterator. field_stats can be NULL, or must
+// be iter->field_count long.
+void tsf_iter_stats_snapshot(tsf_iter* iter, tsf_stats* stats, tsf_field_stats* field_stats);
+
+void tsf_iter_stats_reset(tsf_iter* iter);
+
+void tsf_stats_reset(tsf_stats* stats);
+
+// Accumulate stats (such as from iterators on different threads)
+void tsf_stats_merge(tsf_stats* into, const tsf_stats* from);
+
+// Approximate latency (upper bound of its bucket) at percentile [0-100]
+int64_t tsf_histogram_percentile(const tsf_histogram* h, double percentile);
+
+// Query tracing. While a trace is set on a file, every chunk fetch,
+// decompression, idx map collation and iterator lifetime is recorded as
+// a span with its chunk id, table, codec and compressed/decompressed
+// bytes. A trace may be shared by several files and threads.
+//
+// tsf_trace_write_json writes the spans as Chrome trace event JSON,
+// which can be loaded directly into Perfetto (ui.perfetto.dev).
+typedef struct tsf_trace tsf_trace;
+
+tsf_trace* tsf_trace_create(void);
+
+void tsf_trace_free(tsf_trace* trace);
+
+// Pass NULL to stop tracing the file
+void tsf_set_trace(tsf_file* tsf, tsf_trace* trace);
+
+int tsf_trace_span_count(tsf_trace* trace);
+
+bool tsf_trace_write_json(tsf_trace* trace, const char* path);
+
+// Query explain. Plans a query without reading or decompressing any
+// chunk, reporting the chunks and compressed bytes each field would
+// fetch. Chunks already decompressed in the iterator are counted as
+// resident and excluded from bytes_to_read.
+typedef struct tsf_explain_field {
+  tsf_field* field;
+  int chunk_count;          // Includes locus_idx_map and backend chunks
+  int64_t compressed_bytes;
+  int64_t bytes_to_read;    // compressed_bytes less resident chunks
+  int resident_chunks;
+  bool estimate_is_upper_bound; // Record order unknown, all backend chunks counted
+} tsf_explain_field;
+
+typedef struct tsf_explain {
+  int64_t estimated_records;
+  int start_id;  // Record id range scanned
+  int stop_id;
+  int64_t gidx_bins;  // Genomic index bins overlapping a genomic query
+
+  int chunk_count;
+  int64_t compressed_bytes;
+  int64_t bytes_to_read;
+  int resident_chunks;
+
+  int field_count;
+  tsf_explain_field* fields; // field_count in length, in iter->fields order
+} tsf_explain;
+
+// Explain reading records [start_id, stop_id) of iter. Pass -1 as stop_id
+// for the whole table.
+tsf_explain* tsf_explain_iter(tsf_iter* iter, int start_id, int stop_id);
+
+// As tsf_query_table, followed by tsf_explain_iter
+tsf_explain* tsf_explain_table(tsf_file* tsf, int source_id,
+                               int field_count, int* field_idxs,
+                               int entity_count, int* entity_ids,
+                               tsf_field_type field_type,
+                               int start_id, int stop_id);
+
+// Explain a genomic index overlap query of chr: (start, stop]
+tsf_explain* tsf_explain_genomic_iter(tsf_iter* iter, const char* chr, int start, int stop);
+
+tsf_explain* tsf_explain_genomic(tsf_file* tsf, int source_id,
+                                 const char* chr, int start, int stop,
+                                 int field_count, int* field_idxs,
+                                 int entity_count, int* entity_ids);
+
+void tsf_explain_free(tsf_explain* e);
+
 // Query the genomic index (gidx) of a source.
-// Returns NULL if query is source does not have a gidx
+// Returns NULL if query is source does not have a gidx, or if its records
+// are not in genomic order and the gidx does not map them to record ids.
+// Such sources are only supported when their Chr, Start and Stop fields
+// are stored in the gidx data table and share a locus_idx_map column of
+// that same table (as TSF1 writers lay them out); the error says so
+// otherwise.
 // This performs an overlap query of 0-based interval chr: (start, stop]
 tsf_gidx_iter* tsf_query_genomic_index(tsf_file* tsf, int source_id,
                                        char* chr, int start, int stop,
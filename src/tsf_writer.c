@@ -0,0 +1,1688 @@
+#include "tsf_writer.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include <zlib.h>
+
+// Third party libraries
+#include "sqlite3/sqlite3.h"
+#include "jansson/jansson.h"
+#include "blosc/blosc.h"
+#include "blosc/shuffle.h"
+#include "zstd/lib/zstd.h"
+#include "zstd/lib/dictBuilder/zdict.h"
+#include "lz4/lib/lz4.h"
+
+// Chunks compressed but not yet written, per worker
+#define JOBS_PER_THREAD 4
+
+// Genomic index rows hold at least this many records
+#define GIDX_GROUP_SIZE 1024
+
+// Chunks of a field are held back to train its zstd dictionary until
+// this many times the dictionary size is sampled, as zdict recommends
+#define DICT_SAMPLE_RATIO 100
+
+typedef struct wbuf {
+  char* data;
+  size_t len;
+  size_t cap;
+} wbuf;
+
+static void wbuf_reserve(wbuf* b, size_t extra)
+{
+  if (b->len + extra <= b->cap)
+    return;
+  while (b->len + extra > b->cap)
+    b->cap = b->cap ? b->cap * 2 : 4096;
+  b->data = tsf_realloc(b->data, b->cap);
+}
+
+static void wbuf_put(wbuf* b, const void* p, size_t n)
+{
+  wbuf_reserve(b, n);
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+// A chunk handed to the compression workers
+typedef struct chunk_job {
+  int table;
+  int64_t chunk_id;
+  tsf_chunk_header header;
+  int codec;
+  int level;
+  int encoding;       // tsf_chunk_encoding applied to raw before compression
+  bool detect_constant;
+  ZSTD_CDict* cdict;  // Borrowed from the field, if set
+  wbuf raw;
+  wbuf encoded;
+  wbuf out;
+  bool ok;
+  struct chunk_job* next;
+} chunk_job;
+
+// Records of a field (or one entity of a matrix field) not yet in a chunk
+typedef struct w_stream {
+  wbuf values;
+  wbuf sizes;  // int per record, array types only
+  int rows;
+  int64_t total;
+} w_stream;
+
+typedef struct w_table {
+  char name[32];
+  char uuid[40];
+  int field_count;
+  int64_t record_count;
+  sqlite3_stmt* insert;
+} w_table;
+
+typedef struct w_field {
+  tsf_writer_field def;  // Strings owned
+  char format[4];
+  int type_size;  // Element size, 0 for strings
+  int table;
+  int table_field_idx;
+  int codec;
+  int level;
+  int encoding;
+  int stream_count;  // entity_count for matrix fields, 2 for sparse arrays, else 1
+  w_stream* streams;
+
+  // Zstd dictionary, trained on the first chunks, which are held until
+  // it is ready
+  int dict_size;  // 0 if the field has no dictionary
+  bool dict_trained;
+  uint32_t dict_id;
+  ZSTD_CDict* cdict;
+  chunk_job* held_head;
+  chunk_job* held_tail;
+  int held_count;
+  size_t held_bytes;
+
+  bool has_extents;
+  double extents_min;
+  double extents_max;
+} w_field;
+
+typedef struct gidx_row {
+  int chr;
+  int group;
+  int min_start;
+  int max_stop;
+  int offset;
+  int n;
+} gidx_row;
+
+typedef struct w_source {
+  tsf_writer_source def;  // Strings owned
+  int field_count;
+  w_field* fields;
+  int locus_table;   // -1 until a locus attribute field is added
+  int entity_table;  // -1 until an entity attribute field is added
+  bool appending;
+
+  // Genomic index, built as Chr/Start/Stop are appended
+  int chr_field;  // -1 if the source has no genomic index
+  int start_field;
+  int stop_field;
+  wbuf gidx_pending[3];  // Chr, Start, Stop ints not yet indexed
+  int64_t gidx_records;  // Records indexed
+  bool* chr_seen;
+  int cur_chr;
+  int cur_start;
+  int group_size;
+  int chr_first_row;
+  int row_count;
+  int row_capacity;
+  gidx_row* rows;
+} w_source;
+
+struct tsf_writer {
+  sqlite3* db;
+  tsf_writer_opts opts;
+  char* errmsg;
+  uint64_t rng;
+
+  int source_count;
+  w_source* sources;
+  int table_count;
+  w_table* tables;
+
+  // Compression workers
+  int thread_count;  // 0 when compressing inline
+  pthread_t* threads;
+  pthread_mutex_t mutex;
+  pthread_cond_t job_ready;
+  pthread_cond_t job_done;
+  chunk_job* pending_head;
+  chunk_job* pending_tail;
+  chunk_job* done;
+  chunk_job* free_jobs;
+  int in_flight;
+  bool stopping;
+  ZSTD_CCtx* cctx;  // Compressing with dictionaries inline
+
+  sqlite3_stmt* dict_insert;
+};
+
+static bool fail(tsf_writer* w, const char* msg)
+{
+  if (!w->errmsg) {
+    const char* db_msg = w->db ? sqlite3_errmsg(w->db) : "";
+    w->errmsg = tsf_malloc(strlen(msg) + strlen(db_msg) + 4);
+    if (w->db && sqlite3_errcode(w->db) != SQLITE_OK)
+      sprintf(w->errmsg, "%s: %s", msg, db_msg);
+    else
+      strcpy(w->errmsg, msg);
+  }
+  return false;
+}
+
+static char* str_copy(const char* str)
+{
+  if (!str)
+    return NULL;
+  char* dup = tsf_malloc(strlen(str) + 1);
+  strcpy(dup, str);
+  return dup;
+}
+
+static bool exec(tsf_writer* w, const char* sql)
+{
+  if (sqlite3_exec(w->db, sql, NULL, NULL, NULL) != SQLITE_OK)
+    return fail(w, "SQL error");
+  return true;
+}
+
+static uint64_t rng_next(tsf_writer* w)
+{
+  uint64_t x = w->rng;
+  x ^= x >> 12;
+  x ^= x << 25;
+  x ^= x >> 27;
+  w->rng = x;
+  return x * 2685821657736338717ULL;
+}
+
+static void make_uuid(tsf_writer* w, char* out)
+{
+  uint64_t a = rng_next(w), b = rng_next(w);
+  sprintf(out, "{%08x-%04x-4%03x-%04x-%012llx}", (unsigned)(a >> 32),
+          (unsigned)(a >> 16) & 0xFFFF, (unsigned)a & 0xFFF,
+          (unsigned)(0x8000 | ((b >> 48) & 0x3FFF)),
+          (unsigned long long)(b & 0xFFFFFFFFFFFFULL));
+}
+
+static const char* value_type_format(tsf_value_type type, int* type_size)
+{
+  switch (type) {
+    case TypeInt32: *type_size = 4; return "i";
+    case TypeInt64: *type_size = 8; return "i8";
+    case TypeFloat32: *type_size = 4; return "f4";
+    case TypeFloat64: *type_size = 8; return "f8";
+    case TypeBool: *type_size = 1; return "?";
+    case TypeString: *type_size = 0; return "s";
+    case TypeEnum: *type_size = 4; return "e";
+    case TypeInt32Array: *type_size = 4; return "@i";
+    case TypeFloat32Array: *type_size = 4; return "@f4";
+    case TypeFloat64Array: *type_size = 8; return "@f8";
+    case TypeBoolArray: *type_size = 1; return "@?";
+    case TypeStringArray: *type_size = 0; return "@s";
+    case TypeEnumArray: *type_size = 4; return "@e";
+    case TypeUnkown: break;
+  }
+  return NULL;
+}
+
+static int default_level(int codec)
+{
+  switch (codec) {
+    case CompressionZstd: return 3;
+    case CompressionZlib: return 6;
+    case CompressionBlosc: return 5;
+  }
+  return 0;  // LZ4 and None have no levels
+}
+
+/*
+ * Lightweight encodings of 4-byte scalar chunks, see tsf_chunk_encoding
+ */
+static void put_le32(wbuf* b, uint32_t v)
+{
+  unsigned char le[4] = {v, v >> 8, v >> 16, v >> 24};
+  wbuf_put(b, le, 4);
+}
+
+static int bit_width(uint32_t v)
+{
+  int bits = 0;
+  while (bits < 32 && (v >> bits) != 0)
+    bits++;
+  return bits;
+}
+
+// Packs n values of bits each, LSB first, into uint32 words
+static void bit_pack(wbuf* b, const uint32_t* values, int n, int bits)
+{
+  if (bits == 0)
+    return;
+  uint64_t window = 0;
+  int window_bits = 0;
+  for (int i = 0; i < n; i++) {
+    window |= (uint64_t)values[i] << window_bits;
+    window_bits += bits;
+    if (window_bits >= 32) {
+      put_le32(b, (uint32_t)window);
+      window >>= 32;
+      window_bits -= 32;
+    }
+  }
+  if (window_bits > 0)
+    put_le32(b, (uint32_t)window);
+}
+
+static int cmp_uint32(const void* a, const void* b)
+{
+  uint32_t x = *(const uint32_t*)a;
+  uint32_t y = *(const uint32_t*)b;
+  return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+// Whether a field encoding applies to a value type. EncodingConstant is
+// chosen per chunk by the writer rather than set on fields.
+static bool encoding_applies(int encoding, tsf_value_type type)
+{
+  switch (encoding) {
+    case EncodingNone:
+      return true;
+    case EncodingDelta:
+    case EncodingFOR:
+    case EncodingDeltaFOR:
+      return type == TypeInt32 || type == TypeEnum;
+    case EncodingRLE:
+    case EncodingDict:
+      return type == TypeInt32 || type == TypeEnum || type == TypeFloat32;
+    case EncodingStringDict:
+      return type == TypeString;
+    case EncodingShuffle:
+      return type == TypeInt32 || type == TypeEnum || type == TypeInt64 ||
+             type == TypeFloat32 || type == TypeFloat64;
+    case EncodingDecimal:
+      return type == TypeFloat32 || type == TypeFloat64;
+  }
+  return false;
+}
+
+// Distinct strings of a NULL delimited list in order of first appearance,
+// then their indexes bit-packed
+static void encode_string_dict(const wbuf* raw, int n, wbuf* out)
+{
+  int capacity = 8;
+  while (capacity < n * 2)
+    capacity <<= 1;
+  int* slots = tsf_malloc(sizeof(int) * capacity);  // Index of first record, or -1
+  for (int i = 0; i < capacity; i++)
+    slots[i] = -1;
+  const char** strs = tsf_malloc(sizeof(char*) * (n > 0 ? n : 1));
+  uint32_t* codes = tsf_malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+  uint32_t* slot_codes = tsf_malloc(sizeof(uint32_t) * capacity);
+  uint32_t count = 0;
+  put_le32(out, 0);
+  const char* s = raw->data;
+  for (int i = 0; i < n; i++) {
+    strs[i] = s;
+    s += strlen(s) + 1;
+    uint32_t h = 2166136261u;  // FNV-1a
+    for (const char* p = strs[i]; *p; p++) {
+      h ^= (unsigned char)*p;
+      h *= 16777619u;
+    }
+    uint32_t slot = h & (capacity - 1);
+    while (slots[slot] >= 0 && strcmp(strs[slots[slot]], strs[i]) != 0)
+      slot = (slot + 1) & (capacity - 1);
+    if (slots[slot] < 0) {
+      slots[slot] = i;
+      slot_codes[slot] = count++;
+      wbuf_put(out, strs[i], s - strs[i]);
+    }
+    codes[i] = slot_codes[slot];
+  }
+  memcpy(out->data, &count, 4);
+  int bits = bit_width(count > 0 ? count - 1 : 0);
+  put_le32(out, bits);
+  bit_pack(out, codes, n, bits);
+  tsf_free(slots);
+  tsf_free(strs);
+  tsf_free(codes);
+  tsf_free(slot_codes);
+}
+
+static const double pow10_table[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9};
+
+// Digits of value (a float or double) at exponent, if they fit an int32
+// and convert back to the same bits exactly as the reader does
+static bool decimal_digits(const char* value, int type_size, int exponent, int32_t* digits)
+{
+  double v;
+  if (type_size == 4) {
+    float f;
+    memcpy(&f, value, 4);
+    v = f;
+  } else {
+    memcpy(&v, value, 8);
+  }
+  double scaled = v * pow10_table[exponent];
+  if (!(scaled > -2147483647.0 && scaled < 2147483647.0))
+    return false;  // Also NaN
+  int32_t d = (int32_t)(scaled < 0 ? scaled - 0.5 : scaled + 0.5);
+  if (type_size == 4) {
+    float back = (float)(d / pow10_table[exponent]);
+    if (memcmp(&back, value, 4) != 0)
+      return false;
+  } else {
+    double back = d / pow10_table[exponent];
+    if (memcmp(&back, value, 8) != 0)
+      return false;
+  }
+  *digits = d;
+  return true;
+}
+
+static void encode_decimal(const wbuf* raw, int n, int type_size, wbuf* out)
+{
+  // The exponent with the fewest exceptions, smallest first
+  int best = 0;
+  int best_count = -1;
+  int32_t d;
+  for (int e = 0; e <= (type_size == 4 ? 7 : 9) && best_count < n; e++) {
+    int count = 0;
+    for (int i = 0; i < n; i++)
+      count += decimal_digits(raw->data + (size_t)i * type_size, type_size, e, &d);
+    if (count > best_count) {
+      best = e;
+      best_count = count;
+    }
+  }
+  uint32_t* digits = tsf_malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+  bool* exception = tsf_malloc(n > 0 ? n : 1);
+  int32_t min = 0;
+  bool first = true;
+  for (int i = 0; i < n; i++) {
+    exception[i] = !decimal_digits(raw->data + (size_t)i * type_size, type_size, best, &d);
+    digits[i] = exception[i] ? 0 : (uint32_t)d;
+    if (!exception[i] && (first || d < min)) {
+      min = d;
+      first = false;
+    }
+  }
+  uint32_t max = 0;
+  for (int i = 0; i < n; i++) {
+    digits[i] = exception[i] ? 0 : digits[i] - (uint32_t)min;
+    if (digits[i] > max)
+      max = digits[i];
+  }
+  int bits = bit_width(max);
+  put_le32(out, (uint32_t)min);
+  unsigned char params[4] = {best, bits, 0, 0};
+  wbuf_put(out, params, 4);
+  put_le32(out, n - best_count);
+  bit_pack(out, digits, n, bits);
+  for (int i = 0; i < n; i++) {
+    if (exception[i]) {
+      put_le32(out, i);
+      wbuf_put(out, raw->data + (size_t)i * type_size, type_size);
+    }
+  }
+  tsf_free(digits);
+  tsf_free(exception);
+}
+
+static void encode_chunk(int encoding, const wbuf* raw, int n, int type_size, wbuf* out)
+{
+  const uint32_t* v = (const uint32_t*)raw->data;
+  out->len = 0;
+  switch (encoding) {
+    case EncodingDelta: {
+      uint32_t prev = 0;
+      for (int i = 0; i < n; i++) {
+        put_le32(out, v[i] - prev);
+        prev = v[i];
+      }
+      break;
+    }
+    case EncodingFOR: {
+      int32_t min = n > 0 ? (int32_t)v[0] : 0;
+      for (int i = 1; i < n; i++)
+        if ((int32_t)v[i] < min)
+          min = (int32_t)v[i];
+      uint32_t* offsets = tsf_malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+      uint32_t max = 0;
+      for (int i = 0; i < n; i++) {
+        offsets[i] = v[i] - (uint32_t)min;
+        if (offsets[i] > max)
+          max = offsets[i];
+      }
+      int bits = bit_width(max);
+      put_le32(out, (uint32_t)min);
+      put_le32(out, bits);
+      bit_pack(out, offsets, n, bits);
+      tsf_free(offsets);
+      break;
+    }
+    case EncodingStringDict:
+      encode_string_dict(raw, n, out);
+      return;
+    case EncodingDecimal:
+      encode_decimal(raw, n, type_size, out);
+      return;
+    case EncodingShuffle:
+      wbuf_reserve(out, raw->len);
+      for (size_t pos = 0; pos < raw->len; pos += TSF_SHUFFLE_BLOCK) {
+        size_t size = raw->len - pos;
+        shuffle(type_size, size < TSF_SHUFFLE_BLOCK ? size : TSF_SHUFFLE_BLOCK,
+                (unsigned char*)raw->data + pos, (unsigned char*)out->data + pos);
+      }
+      out->len = raw->len;
+      return;
+    case EncodingDeltaFOR: {
+      uint32_t* deltas = tsf_malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+      int32_t min = 0;
+      for (int i = 1; i < n; i++) {
+        deltas[i] = v[i] - v[i - 1];
+        if (i == 1 || (int32_t)deltas[i] < min)
+          min = (int32_t)deltas[i];
+      }
+      uint32_t max = 0;
+      for (int i = 1; i < n; i++) {
+        deltas[i] -= (uint32_t)min;
+        if (deltas[i] > max)
+          max = deltas[i];
+      }
+      int bits = bit_width(max);
+      put_le32(out, n > 0 ? v[0] : 0);
+      put_le32(out, (uint32_t)min);
+      put_le32(out, bits);
+      if (n > 1)
+        bit_pack(out, deltas + 1, n - 1, bits);
+      tsf_free(deltas);
+      break;
+    }
+    case EncodingRLE: {
+      put_le32(out, 0);
+      uint32_t runs = 0;
+      for (int i = 0; i < n;) {
+        int j = i + 1;
+        while (j < n && v[j] == v[i])
+          j++;
+        put_le32(out, v[i]);
+        put_le32(out, j - i);
+        runs++;
+        i = j;
+      }
+      memcpy(out->data, &runs, 4);
+      break;
+    }
+    case EncodingDict: {
+      uint32_t* dict = tsf_malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+      memcpy(dict, v, sizeof(uint32_t) * n);
+      qsort(dict, n, sizeof(uint32_t), cmp_uint32);
+      int count = 0;
+      for (int i = 0; i < n; i++)
+        if (count == 0 || dict[count - 1] != dict[i])
+          dict[count++] = dict[i];
+      uint32_t* codes = tsf_malloc(sizeof(uint32_t) * (n > 0 ? n : 1));
+      for (int i = 0; i < n; i++)
+        codes[i] = (uint32_t*)bsearch(&v[i], dict, count, sizeof(uint32_t), cmp_uint32) - dict;
+      int bits = bit_width(count > 0 ? count - 1 : 0);
+      put_le32(out, count);
+      for (int i = 0; i < count; i++)
+        put_le32(out, dict[i]);
+      put_le32(out, bits);
+      bit_pack(out, codes, n, bits);
+      tsf_free(codes);
+      tsf_free(dict);
+      break;
+    }
+  }
+}
+
+/*
+ * Chunk compression. Payloads are a 4-byte big-endian decompressed size
+ * followed by the compressed data, except Blosc which has its own header.
+ */
+static void put_be32(wbuf* b, uint32_t v)
+{
+  unsigned char be[4] = {v >> 24, v >> 16, v >> 8, v};
+  wbuf_put(b, be, 4);
+}
+
+// Size of the first record if every record of a non-array chunk is the
+// same, else 0. Strings are NULL terminated, other types type_size bytes.
+static size_t constant_record_size(const chunk_job* job)
+{
+  const wbuf* raw = &job->raw;
+  int n = job->header.n;
+  if (n <= 0 || raw->len == 0)
+    return 0;
+  size_t size = job->header.type_size > 0 ? (size_t)job->header.type_size
+                                          : strnlen(raw->data, raw->len) + 1;
+  if (raw->len != size * n)
+    return 0;
+  for (int i = 1; i < n; i++)
+    if (memcmp(raw->data, raw->data + size * i, size) != 0)
+      return 0;
+  return size;
+}
+
+static bool compress_job(chunk_job* job, ZSTD_CCtx** cctx)
+{
+  wbuf* raw = &job->raw;
+  wbuf* out = &job->out;
+  size_t record_size = job->detect_constant ? constant_record_size(job) : 0;
+  if (record_size > 0) {
+    // Stored once, uncompressed
+    raw->len = record_size;
+    job->codec = CompressionNone;
+    job->encoding = EncodingConstant;
+    job->header.compression_method = 0;
+    job->header.zstd_dict = 0;
+    job->header.future4 = 0;
+    job->header.magic[1] = CHUNK_MAGIC_B1_EXT;
+  }
+  out->len = 0;
+  wbuf_put(out, &job->header, HEADER_SIZE);
+  tsf_chunk_header_ext ext = {job->codec, job->encoding, 0};
+  if (job->header.magic[1] == CHUNK_MAGIC_B1_EXT)
+    wbuf_put(out, &ext, HEADER_EXT_SIZE);
+  if (job->encoding != EncodingNone && job->encoding != EncodingConstant) {
+    encode_chunk(job->encoding, raw, job->header.n, job->header.type_size, &job->encoded);
+    raw = &job->encoded;
+  }
+  switch (job->codec) {
+    case CompressionZlib: {
+      uLongf bound = compressBound(raw->len);
+      put_be32(out, raw->len);
+      wbuf_reserve(out, bound);
+      if (compress2((Bytef*)out->data + out->len, &bound, (Bytef*)raw->data, raw->len,
+                    job->level) != Z_OK)
+        return false;
+      out->len += bound;
+      return true;
+    }
+    case CompressionZstd: {
+      size_t bound = ZSTD_compressBound(raw->len);
+      put_be32(out, raw->len);
+      wbuf_reserve(out, bound);
+      size_t size;
+      if (job->cdict) {
+        if (!*cctx)
+          *cctx = ZSTD_createCCtx();
+        size = ZSTD_compress_usingCDict(*cctx, out->data + out->len, bound, raw->data, raw->len,
+                                        job->cdict);
+      } else {
+        size = ZSTD_compress(out->data + out->len, bound, raw->data, raw->len, job->level);
+      }
+      if (ZSTD_isError(size))
+        return false;
+      out->len += size;
+      return true;
+    }
+    case CompressionLZ4: {
+      int bound = LZ4_compressBound(raw->len);
+      put_be32(out, raw->len);
+      wbuf_reserve(out, bound);
+      int size = LZ4_compress_default(raw->data, out->data + out->len, raw->len, bound);
+      if (size <= 0)
+        return false;
+      out->len += size;
+      return true;
+    }
+    case CompressionBlosc: {
+      size_t bound = raw->len + BLOSC_MAX_OVERHEAD;
+      int typesize = job->header.type_size > 0 ? job->header.type_size : 1;
+      wbuf_reserve(out, bound);
+      int size = blosc_compress_ctx(job->level, 1, typesize, raw->len, raw->data,
+                                    out->data + out->len, bound);
+      if (size <= 0)
+        return false;
+      out->len += size;
+      return true;
+    }
+    case CompressionNone:
+      put_be32(out, raw->len);
+      wbuf_put(out, raw->data, raw->len);
+      return true;
+  }
+  return false;
+}
+
+static void* compress_worker(void* arg)
+{
+  tsf_writer* w = arg;
+  ZSTD_CCtx* cctx = NULL;
+  pthread_mutex_lock(&w->mutex);
+  while (true) {
+    while (!w->pending_head && !w->stopping)
+      pthread_cond_wait(&w->job_ready, &w->mutex);
+    if (!w->pending_head)
+      break;  // Stopping with nothing left to do
+    chunk_job* job = w->pending_head;
+    w->pending_head = job->next;
+    if (!w->pending_head)
+      w->pending_tail = NULL;
+    pthread_mutex_unlock(&w->mutex);
+
+    job->ok = compress_job(job, &cctx);
+
+    pthread_mutex_lock(&w->mutex);
+    job->next = w->done;
+    w->done = job;
+    pthread_cond_signal(&w->job_done);
+  }
+  pthread_mutex_unlock(&w->mutex);
+  if (cctx)
+    ZSTD_freeCCtx(cctx);
+  return NULL;
+}
+
+static bool write_job(tsf_writer* w, chunk_job* job)
+{
+  if (!job->ok)
+    return fail(w, "Chunk compression failed");
+  sqlite3_stmt* q = w->tables[job->table].insert;
+  sqlite3_reset(q);
+  sqlite3_bind_int64(q, 1, job->chunk_id);
+  sqlite3_bind_blob(q, 2, job->out.data, job->out.len, SQLITE_STATIC);
+  if (sqlite3_step(q) != SQLITE_DONE)
+    return fail(w, "Unable to write chunk");
+  return true;
+}
+
+// Writes compressed chunks. If wait, blocks until at least one is done.
+static bool drain_done(tsf_writer* w, bool wait)
+{
+  pthread_mutex_lock(&w->mutex);
+  while (wait && !w->done && w->in_flight > 0)
+    pthread_cond_wait(&w->job_done, &w->mutex);
+  chunk_job* done = w->done;
+  w->done = NULL;
+  pthread_mutex_unlock(&w->mutex);
+
+  bool ok = true;
+  while (done) {
+    chunk_job* job = done;
+    done = job->next;
+    ok = write_job(w, job) && ok;
+    job->next = w->free_jobs;
+    w->free_jobs = job;
+    w->in_flight--;
+  }
+  return ok;
+}
+
+static chunk_job* job_alloc(tsf_writer* w)
+{
+  chunk_job* job = w->free_jobs;
+  if (job) {
+    w->free_jobs = job->next;
+  } else {
+    job = tsf_calloc(1, sizeof(chunk_job));
+  }
+  job->raw.len = 0;
+  job->out.len = 0;
+  job->cdict = NULL;
+  job->next = NULL;
+  return job;
+}
+
+static bool submit_job(tsf_writer* w, chunk_job* job)
+{
+  if (w->thread_count == 0) {
+    job->ok = compress_job(job, &w->cctx);
+    bool ok = write_job(w, job);
+    job->next = w->free_jobs;
+    w->free_jobs = job;
+    return ok;
+  }
+
+  pthread_mutex_lock(&w->mutex);
+  if (w->pending_tail)
+    w->pending_tail->next = job;
+  else
+    w->pending_head = job;
+  w->pending_tail = job;
+  w->in_flight++;
+  pthread_cond_signal(&w->job_ready);
+  pthread_mutex_unlock(&w->mutex);
+
+  // Bound the memory held by chunks in flight
+  bool ok = drain_done(w, false);
+  while (ok && w->in_flight >= w->thread_count * JOBS_PER_THREAD)
+    ok = drain_done(w, true);
+  return ok;
+}
+
+/*
+ * Zstd dictionaries of string fields. The held chunks are the training
+ * samples, as they are what the dictionary compresses, and are then
+ * submitted compressed with it (or without one if training fails, such
+ * as with too few samples).
+ */
+static bool submit_held(tsf_writer* w, w_field* f)
+{
+  bool ok = true;
+  while (f->held_head) {
+    chunk_job* job = f->held_head;
+    f->held_head = job->next;
+    job->next = NULL;
+    if (f->cdict) {
+      job->cdict = f->cdict;
+      job->header.zstd_dict = 1;
+      job->header.future4 = f->dict_id;
+    }
+    if (ok) {
+      ok = submit_job(w, job);
+    } else {
+      job->next = w->free_jobs;
+      w->free_jobs = job;
+    }
+  }
+  f->held_tail = NULL;
+  f->held_count = 0;
+  f->held_bytes = 0;
+  return ok;
+}
+
+static bool train_dict(tsf_writer* w, w_field* f)
+{
+  f->dict_trained = true;
+  wbuf samples = {0};
+  wbuf sizes = {0};
+  for (chunk_job* job = f->held_head; job; job = job->next) {
+    wbuf_put(&samples, job->raw.data, job->raw.len);
+    wbuf_put(&sizes, &job->raw.len, sizeof(size_t));
+  }
+
+  void* dict = tsf_malloc(f->dict_size);
+  size_t dict_size = ZDICT_trainFromBuffer(dict, f->dict_size, samples.data,
+                                           (const size_t*)sizes.data,
+                                           (unsigned)(sizes.len / sizeof(size_t)));
+  tsf_free(samples.data);
+  tsf_free(sizes.data);
+  bool ok = true;
+  if (!ZDICT_isError(dict_size)) {
+    if (!w->dict_insert &&
+        (!exec(w, "CREATE TABLE IF NOT EXISTS zstd_dict (id INTEGER PRIMARY KEY, dict BLOB)") ||
+         sqlite3_prepare_v2(w->db, "INSERT INTO zstd_dict (dict) VALUES (?)", -1,
+                            &w->dict_insert, 0) != SQLITE_OK)) {
+      ok = fail(w, "Unable to create zstd_dict table");
+    } else {
+      sqlite3_reset(w->dict_insert);
+      sqlite3_bind_blob(w->dict_insert, 1, dict, dict_size, SQLITE_STATIC);
+      if (sqlite3_step(w->dict_insert) != SQLITE_DONE)
+        ok = fail(w, "Unable to write zstd dictionary");
+      f->dict_id = (uint32_t)sqlite3_last_insert_rowid(w->db);
+      f->cdict = ZSTD_createCDict(dict, dict_size, f->level);
+    }
+  }
+  tsf_free(dict);
+  return submit_held(w, f) && ok;
+}
+
+// Submits a chunk of a field, or holds it while the field's dictionary
+// is not trained yet
+static bool submit_field_job(tsf_writer* w, w_field* f, chunk_job* job)
+{
+  if (f->dict_size <= 0 || f->dict_trained) {
+    if (f->cdict) {
+      job->cdict = f->cdict;
+      job->header.zstd_dict = 1;
+      job->header.future4 = f->dict_id;
+    }
+    return submit_job(w, job);
+  }
+  if (f->held_tail)
+    f->held_tail->next = job;
+  else
+    f->held_head = job;
+  f->held_tail = job;
+  f->held_count++;
+  f->held_bytes += job->raw.len;
+  if (f->held_bytes >= (size_t)f->dict_size * DICT_SAMPLE_RATIO)
+    return train_dict(w, f);
+  return true;
+}
+
+// Lays out the pending records of a stream in the reader's in-memory
+// format and submits them as the next chunk.
+static bool flush_stream(tsf_writer* w, w_field* f, int stream_idx)
+{
+  w_stream* st = &f->streams[stream_idx];
+  if (st->rows == 0)
+    return true;
+
+  // The entity indices of a sparse array field are an Int32Array
+  bool sparse_idxs = f->def.field_type == FieldSparseArray && stream_idx == 1;
+  const char* format = sparse_idxs ? "@i" : f->format;
+  int type_size = sparse_idxs ? 4 : f->type_size;
+
+  chunk_job* job = job_alloc(w);
+  job->table = f->table;
+  int64_t block = (st->total - st->rows) >> w->opts.chunk_bits;
+  int chunk_field = f->def.field_type == FieldMatrix ? stream_idx
+                                                     : f->table_field_idx + stream_idx;
+  job->chunk_id = (block << 32) | chunk_field;
+  job->level = f->level;
+  memset(&job->header, 0, sizeof(tsf_chunk_header));
+  job->header.magic[0] = CHUNK_MAGIC_B0;
+  job->header.magic[1] = CHUNK_MAGIC_B1;
+  job->codec = f->codec;
+  job->encoding = f->encoding;
+  job->header.compression_method = f->codec & 0x3;
+  if (f->codec == CompressionNone || f->encoding != EncodingNone)
+    job->header.magic[1] = CHUNK_MAGIC_B1_EXT;
+  memcpy(job->header.format, format, strlen(format));
+  job->header.type_size = type_size;
+  job->header.n = st->rows;
+
+  tsf_value_type type = f->def.value_type;
+  job->detect_constant = w->opts.constant_chunks && !tsf_value_type_is_array(type);
+  if (!tsf_value_type_is_array(type)) {
+    wbuf_put(&job->raw, st->values.data, st->values.len);
+  } else if (type == TypeStringArray) {
+    // [uint16 size][size NULL terminated strings] per record
+    const int* sizes = (const int*)st->sizes.data;
+    const char* s = st->values.data;
+    for (int i = 0; i < st->rows; i++) {
+      uint16_t size = sizes[i];
+      wbuf_put(&job->raw, &size, sizeof(uint16_t));
+      const char* start = s;
+      for (int j = 0; j < sizes[i]; j++)
+        s += strlen(s) + 1;
+      wbuf_put(&job->raw, start, s - start);
+    }
+  } else if (f->codec == CompressionZstd || f->codec == CompressionLZ4 ||
+             f->codec == CompressionNone) {
+    // All sizes up front, followed by the values
+    wbuf_put(&job->raw, st->sizes.data, st->sizes.len);
+    wbuf_put(&job->raw, st->values.data, st->values.len);
+  } else {
+    // [size][values] per record, sizes of 4-byte types padded to 4 bytes
+    const int* sizes = (const int*)st->sizes.data;
+    const char* v = st->values.data;
+    for (int i = 0; i < st->rows; i++) {
+      if (type_size == 4) {
+        wbuf_put(&job->raw, &sizes[i], 4);
+      } else {
+        uint16_t size = sizes[i];
+        wbuf_put(&job->raw, &size, sizeof(uint16_t));
+      }
+      wbuf_put(&job->raw, v, (size_t)sizes[i] * type_size);
+      v += (size_t)sizes[i] * type_size;
+    }
+  }
+
+  st->values.len = 0;
+  st->sizes.len = 0;
+  st->rows = 0;
+  return submit_field_job(w, f, job);
+}
+
+void tsf_writer_opts_init(tsf_writer_opts* opts)
+{
+  opts->chunk_bits = 12;
+  opts->codec = CompressionZstd;
+  opts->level = -1;
+  opts->threads = 0;
+  opts->zstd_dict_size = 0;
+  opts->constant_chunks = false;
+}
+
+tsf_writer* tsf_writer_open(const char* path, const tsf_writer_opts* opts)
+{
+  tsf_writer* w = tsf_calloc(1, sizeof(tsf_writer));
+  if (opts)
+    w->opts = *opts;
+  else
+    tsf_writer_opts_init(&w->opts);
+  if (w->opts.chunk_bits < 1 || w->opts.chunk_bits > 24 || w->opts.codec < 0 ||
+      w->opts.codec > CompressionNone) {
+    fprintf(stderr, "Invalid TSF writer options\n");
+    tsf_free(w);
+    return NULL;
+  }
+  if (w->opts.level < 0)
+    w->opts.level = default_level(w->opts.codec);
+
+  // Seeds uuid generation
+  w->rng = (uint64_t)tsf_clock_ns() ^ ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)w;
+  if (w->rng == 0)
+    w->rng = 1;
+
+  unlink(path);
+  if (sqlite3_open(path, &w->db) != SQLITE_OK) {
+    fprintf(stderr, "Unable to create '%s': %s\n", path, sqlite3_errmsg(w->db));
+    sqlite3_close(w->db);
+    tsf_free(w);
+    return NULL;
+  }
+  bool ok =
+      exec(w, "PRAGMA journal_mode = OFF; PRAGMA synchronous = OFF; BEGIN") &&
+      exec(w,
+           "CREATE TABLE meta_data (id INTEGER PRIMARY KEY AUTOINCREMENT, table_name TEXT, "
+           "name TEXT, value TEXT, aux BLOB);"
+           "CREATE TABLE tbl (id INTEGER PRIMARY KEY AUTOINCREMENT, uuid TEXT, table_uri TEXT, "
+           "table_format TEXT, table_meta TEXT);"
+           "CREATE TABLE source (id INTEGER PRIMARY KEY AUTOINCREMENT, name TEXT, entity_dim "
+           "INTEGER, locus_dim INTEGER, uuid TEXT, curated TEXT, docs TEXT, source_meta TEXT);"
+           "CREATE TABLE field (source_id INT, field_id INT, table_id INT, locus_idx_map TEXT, "
+           "entity_idx_map TEXT, field_table_idx TEXT, field_type TEXT, field_meta TEXT);"
+           "CREATE TABLE idx (source_id INT, field_id TEXT, idx_type TEXT, query_table_name "
+           "TEXT, data_table_id INT, idx_meta TEXT);"
+           "INSERT INTO meta_data (table_name, name, value) VALUES ('TSF', 'provider', "
+           "'tsf_writer'), ('TSF', 'version', '1'), ('TSF', 'minor_version', '0');");
+  if (!ok) {
+    fprintf(stderr, "Unable to create '%s': %s\n", path, w->errmsg);
+    sqlite3_close(w->db);
+    tsf_free(w->errmsg);
+    tsf_free(w);
+    return NULL;
+  }
+
+  w->thread_count = w->opts.threads;
+  if (w->thread_count <= 0)
+    w->thread_count = (int)sysconf(_SC_NPROCESSORS_ONLN);
+  if (w->thread_count <= 1)
+    w->thread_count = 0;
+  pthread_mutex_init(&w->mutex, NULL);
+  pthread_cond_init(&w->job_ready, NULL);
+  pthread_cond_init(&w->job_done, NULL);
+  if (w->thread_count > 0) {
+    w->threads = tsf_malloc(sizeof(pthread_t) * w->thread_count);
+    for (int i = 0; i < w->thread_count; i++)
+      pthread_create(&w->threads[i], NULL, compress_worker, w);
+  }
+  return w;
+}
+
+const char* tsf_writer_errmsg(tsf_writer* w)
+{
+  return w->errmsg;
+}
+
+static w_source* get_source(tsf_writer* w, int source_id)
+{
+  if (source_id < 1 || source_id > w->source_count) {
+    fail(w, "Invalid source_id");
+    return NULL;
+  }
+  return &w->sources[source_id - 1];
+}
+
+static int add_table(tsf_writer* w, int64_t record_count)
+{
+  w->tables = tsf_realloc(w->tables, sizeof(w_table) * (w->table_count + 1));
+  w_table* t = &w->tables[w->table_count];
+  memset(t, 0, sizeof(w_table));
+  snprintf(t->name, sizeof(t->name), "t%d", w->table_count + 1);
+  make_uuid(w, t->uuid);
+  t->record_count = record_count;
+
+  char sql[128];
+  snprintf(sql, sizeof(sql), "CREATE TABLE %s (chunk_id INTEGER PRIMARY KEY, chunk BLOB)",
+           t->name);
+  if (!exec(w, sql))
+    return -1;
+  snprintf(sql, sizeof(sql), "INSERT INTO %s VALUES (?, ?)", t->name);
+  if (sqlite3_prepare_v2(w->db, sql, -1, &t->insert, 0) != SQLITE_OK) {
+    fail(w, "Unable to prepare chunk insert");
+    return -1;
+  }
+  return w->table_count++;
+}
+
+int tsf_writer_add_source(tsf_writer* w, const tsf_writer_source* source)
+{
+  w->sources = tsf_realloc(w->sources, sizeof(w_source) * (w->source_count + 1));
+  w_source* s = &w->sources[w->source_count];
+  memset(s, 0, sizeof(w_source));
+  s->def = *source;
+  s->def.name = str_copy(source->name ? source->name : "");
+  s->def.uuid = str_copy(source->uuid);
+  s->def.docs_json = str_copy(source->docs_json);
+  s->def.coord_sys_id = str_copy(source->coord_sys_id);
+  s->def.curated = str_copy(source->curated);
+  s->def.meta_json = str_copy(source->meta_json);
+  if (s->def.entity_count < 0)
+    s->def.entity_count = 0;
+  s->locus_table = -1;
+  s->entity_table = -1;
+  s->chr_field = -1;
+  s->start_field = -1;
+  s->stop_field = -1;
+  s->cur_chr = -1;
+  return ++w->source_count;
+}
+
+int tsf_writer_add_field(tsf_writer* w, int source_id, const tsf_writer_field* field)
+{
+  w_source* s = get_source(w, source_id);
+  if (!s)
+    return -1;
+  if (s->appending) {
+    fail(w, "Fields must be added before appending data");
+    return -1;
+  }
+  int type_size;
+  const char* format = value_type_format(field->value_type, &type_size);
+  if (!format || !field->name) {
+    fail(w, "Field requires a name and value type");
+    return -1;
+  }
+  if (field->field_type != FieldLocusAttribute && field->field_type != FieldEntityAttribute &&
+      field->field_type != FieldMatrix && field->field_type != FieldSparseArray) {
+    fail(w, "Unsupported field type");
+    return -1;
+  }
+  if (field->field_type == FieldMatrix &&
+      (s->def.entity_count <= 0 || tsf_value_type_is_array(field->value_type))) {
+    fail(w, "Matrix fields require entities and a non-array value type");
+    return -1;
+  }
+  if (field->field_type == FieldSparseArray &&
+      (s->def.entity_count <= 0 || !tsf_value_type_is_array(field->value_type) ||
+       field->value_type == TypeStringArray)) {
+    fail(w, "Sparse array fields require entities and a fixed size array value type");
+    return -1;
+  }
+  if (!encoding_applies(field->encoding, field->value_type)) {
+    fail(w, "Encoding does not apply to the field's value type");
+    return -1;
+  }
+
+  // Locus and entity attributes share a table per source, each matrix
+  // field has its own with a chunk field per entity and each sparse array
+  // field its own with the values then their entity indices
+  int table;
+  if (field->field_type == FieldLocusAttribute) {
+    if (s->locus_table < 0)
+      s->locus_table = add_table(w, 0);
+    table = s->locus_table;
+  } else if (field->field_type == FieldEntityAttribute) {
+    if (s->entity_table < 0)
+      s->entity_table = add_table(w, s->def.entity_count);
+    table = s->entity_table;
+  } else {
+    table = add_table(w, 0);
+  }
+  if (table < 0)
+    return -1;
+
+  s->fields = tsf_realloc(s->fields, sizeof(w_field) * (s->field_count + 1));
+  w_field* f = &s->fields[s->field_count];
+  memset(f, 0, sizeof(w_field));
+  f->def = *field;
+  f->def.name = str_copy(field->name);
+  f->def.symbol = str_copy(field->symbol);
+  f->def.meta_json = str_copy(field->meta_json);
+  if (field->enum_count > 0) {
+    f->def.enum_names = tsf_malloc(sizeof(char*) * field->enum_count);
+    for (int i = 0; i < field->enum_count; i++)
+      f->def.enum_names[i] = str_copy(field->enum_names[i]);
+  } else {
+    f->def.enum_count = 0;
+    f->def.enum_names = NULL;
+  }
+  strcpy(f->format, format);
+  f->type_size = type_size;
+  f->table = table;
+  f->table_field_idx = field->field_type == FieldMatrix ? 0 : w->tables[table].field_count;
+  w->tables[table].field_count += field->field_type == FieldMatrix        ? s->def.entity_count
+                                  : field->field_type == FieldSparseArray ? 2
+                                                                          : 1;
+  f->codec = field->codec >= 0 && field->codec <= CompressionNone ? field->codec : w->opts.codec;
+  if (field->level >= 0)
+    f->level = field->level;
+  else
+    f->level = f->codec == w->opts.codec ? w->opts.level : default_level(f->codec);
+  f->encoding = field->encoding;
+  if (f->codec == CompressionZstd &&
+      (field->value_type == TypeString || field->value_type == TypeStringArray))
+    f->dict_size = field->zstd_dict_size ? field->zstd_dict_size : w->opts.zstd_dict_size;
+  f->stream_count = field->field_type == FieldMatrix        ? s->def.entity_count
+                    : field->field_type == FieldSparseArray ? 2
+                                                            : 1;
+  f->streams = tsf_calloc(f->stream_count, sizeof(w_stream));
+
+  int idx = s->field_count++;
+  if (s->def.genomic_order && field->field_type == FieldLocusAttribute) {
+    const char* key = field->symbol ? field->symbol : field->name;
+    if (strcmp(key, "Chr") == 0 && field->value_type == TypeEnum)
+      s->chr_field = idx;
+    if (strcmp(key, "Start") == 0 && field->value_type == TypeInt32)
+      s->start_field = idx;
+    if (strcmp(key, "Stop") == 0 && field->value_type == TypeInt32)
+      s->stop_field = idx;
+  }
+  return idx;
+}
+
+/*
+ * Genomic index. Records are grouped into rows of group_size records in
+ * the same chromosome keyed chr << 16 | group, so when a chromosome
+ * reaches 2^16 rows, its rows are merged pairwise and group_size doubled.
+ */
+static void gidx_add_row(w_source* s, int chr, int start, int stop, int64_t record)
+{
+  gidx_row* row = s->row_count > 0 ? &s->rows[s->row_count - 1] : NULL;
+  if (row && row->chr == chr && row->n < s->group_size) {
+    if (start < row->min_start)
+      row->min_start = start;
+    if (stop > row->max_stop)
+      row->max_stop = stop;
+    row->n++;
+    return;
+  }
+  if (!row || row->chr != chr) {
+    s->chr_first_row = s->row_count;
+    s->group_size = GIDX_GROUP_SIZE;
+  } else if (s->row_count - s->chr_first_row == 0x10000) {
+    int rows = s->row_count - s->chr_first_row;
+    gidx_row* first = &s->rows[s->chr_first_row];
+    for (int i = 0; i < rows / 2; i++) {
+      gidx_row merged = first[2 * i];
+      gidx_row* b = &first[2 * i + 1];
+      if (b->min_start < merged.min_start)
+        merged.min_start = b->min_start;
+      if (b->max_stop > merged.max_stop)
+        merged.max_stop = b->max_stop;
+      merged.n += b->n;
+      merged.group = i;
+      first[i] = merged;
+    }
+    s->row_count = s->chr_first_row + rows / 2;
+    s->group_size *= 2;
+    gidx_add_row(s, chr, start, stop, record);
+    return;
+  }
+  if (s->row_count == s->row_capacity) {
+    s->row_capacity = s->row_capacity ? s->row_capacity * 2 : 64;
+    s->rows = tsf_realloc(s->rows, sizeof(gidx_row) * s->row_capacity);
+  }
+  row = &s->rows[s->row_count];
+  row->chr = chr;
+  row->group = s->row_count - s->chr_first_row;
+  row->min_start = start;
+  row->max_stop = stop;
+  row->offset = (int)record;
+  row->n = 1;
+  s->row_count++;
+}
+
+// Indexes the records appended to all of Chr, Start and Stop
+static bool gidx_update(tsf_writer* w, w_source* s)
+{
+  size_t n = s->gidx_pending[0].len;
+  for (int i = 1; i < 3; i++)
+    if (s->gidx_pending[i].len < n)
+      n = s->gidx_pending[i].len;
+  n /= sizeof(int);
+  if (n == 0)
+    return true;
+
+  const int* chrs = (const int*)s->gidx_pending[0].data;
+  const int* starts = (const int*)s->gidx_pending[1].data;
+  const int* stops = (const int*)s->gidx_pending[2].data;
+  w_field* chr_field = &s->fields[s->chr_field];
+  for (size_t i = 0; i < n; i++) {
+    int chr = chrs[i];
+    if (chr < 0 || chr >= chr_field->def.enum_count || starts[i] == INT_MISSING ||
+        stops[i] == INT_MISSING)
+      return fail(w, "Chr, Start and Stop of genomic sources must not be missing");
+    if (chr != s->cur_chr) {
+      if (!s->chr_seen)
+        s->chr_seen = tsf_calloc(chr_field->def.enum_count, sizeof(bool));
+      if (s->chr_seen[chr])
+        return fail(w, "Records of a genomic source must be appended in genomic order");
+      s->chr_seen[chr] = true;
+      s->cur_chr = chr;
+    } else if (starts[i] < s->cur_start) {
+      return fail(w, "Records of a genomic source must be appended in genomic order");
+    }
+    s->cur_start = starts[i];
+    gidx_add_row(s, chr, starts[i], stops[i], s->gidx_records++);
+  }
+  for (int i = 0; i < 3; i++) {
+    wbuf* b = &s->gidx_pending[i];
+    b->len -= n * sizeof(int);
+    memmove(b->data, b->data + n * sizeof(int), b->len);
+  }
+  return true;
+}
+
+static bool append_values(tsf_writer* w, w_source* s, int field_idx, int stream_idx, int count,
+                          const int* sizes, const void* values)
+{
+  w_field* f = &s->fields[field_idx];
+  w_stream* st = &f->streams[stream_idx];
+  tsf_value_type type = f->def.value_type;
+  int type_size = f->type_size;
+  if (f->def.field_type == FieldSparseArray && stream_idx == 1)
+    type_size = 4;  // Entity indices
+  bool is_array = tsf_value_type_is_array(type);
+  bool is_string = type == TypeString || type == TypeStringArray;
+  int chunk_size = 1 << w->opts.chunk_bits;
+  s->appending = true;
+
+  if (f->def.field_type == FieldEntityAttribute && st->total + count > s->def.entity_count)
+    return fail(w, "More entity attribute values than entities");
+
+  int gidx_col = field_idx == s->chr_field ? 0 : (field_idx == s->start_field ? 1 :
+                 (field_idx == s->stop_field ? 2 : -1));
+  if (s->chr_field < 0 || s->start_field < 0 || s->stop_field < 0)
+    gidx_col = -1;
+  if (gidx_col >= 0)
+    wbuf_put(&s->gidx_pending[gidx_col], values, sizeof(int) * count);
+
+  const char* v = values;
+  const char** strs = (const char**)values;
+  for (int i = 0; i < count; i++) {
+    int elements = 1;
+    if (is_array) {
+      elements = sizes[i];
+      if (elements < 0 || elements > 0xFFFF)
+        return fail(w, "Array values are limited to 65535 elements");
+      wbuf_put(&st->sizes, &elements, sizeof(int));
+    }
+    if (is_string) {
+      for (int j = 0; j < elements; j++) {
+        const char* str = *strs++;
+        if (!str)
+          str = STR_MISSING;
+        wbuf_put(&st->values, str, strlen(str) + 1);
+      }
+    } else {
+      size_t bytes = (size_t)elements * type_size;
+      wbuf_put(&st->values, v, bytes);
+      if (!is_array && !f->def.meta_json) {
+        double d;
+        bool missing;
+        switch (type) {
+          case TypeInt32: d = *(const int*)v; missing = *(const int*)v == INT_MISSING; break;
+          case TypeInt64: d = *(const int64_t*)v; missing = *(const int64_t*)v == INT64_MISSING; break;
+          case TypeFloat32: d = *(const float*)v; missing = *(const float*)v == FLOAT_MISSING; break;
+          case TypeFloat64: d = *(const double*)v; missing = *(const double*)v == DOUBLE_MISSING; break;
+          default: d = 0; missing = true; break;
+        }
+        if (!missing) {
+          if (!f->has_extents || d < f->extents_min)
+            f->extents_min = d;
+          if (!f->has_extents || d > f->extents_max)
+            f->extents_max = d;
+          f->has_extents = true;
+        }
+      }
+      v += bytes;
+    }
+    st->rows++;
+    st->total++;
+    if (st->rows == chunk_size && !flush_stream(w, f, stream_idx))
+      return false;
+  }
+  return gidx_col < 0 || gidx_update(w, s);
+}
+
+bool tsf_writer_append(tsf_writer* w, int source_id, int field, int count, const void* values)
+{
+  w_source* s = get_source(w, source_id);
+  if (!s || field < 0 || field >= s->field_count)
+    return fail(w, "Invalid field");
+  if (s->fields[field].def.field_type == FieldMatrix ||
+      tsf_value_type_is_array(s->fields[field].def.value_type))
+    return fail(w, "Use tsf_writer_append_matrix or tsf_writer_append_array for this field");
+  return append_values(w, s, field, 0, count, NULL, values);
+}
+
+bool tsf_writer_append_array(tsf_writer* w, int source_id, int field, int count,
+                             const int* sizes, const void* values)
+{
+  w_source* s = get_source(w, source_id);
+  if (!s || field < 0 || field >= s->field_count)
+    return fail(w, "Invalid field");
+  if (!tsf_value_type_is_array(s->fields[field].def.value_type) ||
+      s->fields[field].def.field_type == FieldSparseArray)
+    return fail(w, "tsf_writer_append_array requires an array field");
+  return append_values(w, s, field, 0, count, sizes, values);
+}
+
+bool tsf_writer_append_sparse(tsf_writer* w, int source_id, int field, int count,
+                              const int* sizes, const int* entity_idxs, const void* values)
+{
+  w_source* s = get_source(w, source_id);
+  if (!s || field < 0 || field >= s->field_count)
+    return fail(w, "Invalid field");
+  if (s->fields[field].def.field_type != FieldSparseArray)
+    return fail(w, "tsf_writer_append_sparse requires a sparse array field");
+  const int* e = entity_idxs;
+  for (int i = 0; i < count; i++) {
+    for (int j = 0; j < sizes[i]; j++) {
+      if (e[j] < 0 || e[j] >= s->def.entity_count || (j > 0 && e[j] <= e[j - 1]))
+        return fail(w, "Sparse array entity indices must be ascending entities");
+    }
+    e += sizes[i];
+  }
+  return append_values(w, s, field, 0, count, sizes, values) &&
+         append_values(w, s, field, 1, count, sizes, entity_idxs);
+}
+
+bool tsf_writer_append_matrix(tsf_writer* w, int source_id, int field, int entity_idx, int count,
+                              const void* values)
+{
+  w_source* s = get_source(w, source_id);
+  if (!s || field < 0 || field >= s->field_count)
+    return fail(w, "Invalid field");
+  if (s->fields[field].def.field_type != FieldMatrix)
+    return fail(w, "tsf_writer_append_matrix requires a matrix field");
+  if (entity_idx < 0 || entity_idx >= s->def.entity_count)
+    return fail(w, "Invalid entity_idx");
+  return append_values(w, s, field, entity_idx, count, NULL, values);
+}
+
+/*
+ * Meta-data, written once all chunks are
+ */
+static char* field_meta(w_field* f)
+{
+  if (f->def.meta_json)
+    return str_copy(f->def.meta_json);
+  json_t* meta = json_object();
+  json_object_set_new(meta, "name", json_string(f->def.name));
+  if (f->def.symbol)
+    json_object_set_new(meta, "symbol", json_string(f->def.symbol));
+  if (f->def.enum_count > 0) {
+    json_t* names = json_array();
+    for (int i = 0; i < f->def.enum_count; i++)
+      json_array_append_new(names, json_pack("[s, []]", f->def.enum_names[i]));
+    json_object_set_new(meta, "enum", names);
+  }
+  if (f->has_extents)
+    json_object_set_new(meta, "props",
+                        json_pack("[[s, f], [s, f]]", "ExtentsMin", f->extents_min,
+                                  "ExtentsMax", f->extents_max));
+  char* str = json_dumps(meta, JSON_PRESERVE_ORDER);
+  json_decref(meta);
+  return str;
+}
+
+static bool write_source(tsf_writer* w, int source_id, w_source* s)
+{
+  // Every locus field and matrix entity must have the same record count
+  int64_t locus_count = -1;
+  for (int i = 0; i < s->field_count; i++) {
+    w_field* f = &s->fields[i];
+    for (int j = 0; j < f->stream_count; j++) {
+      int64_t total = f->streams[j].total;
+      if (f->def.field_type == FieldEntityAttribute) {
+        if (total != s->def.entity_count)
+          return fail(w, "Entity attribute fields must have a value per entity");
+      } else if (locus_count < 0) {
+        locus_count = total;
+      } else if (total != locus_count) {
+        return fail(w, "Locus and matrix fields must have the same number of records");
+      }
+    }
+  }
+  if (locus_count < 0)
+    locus_count = 0;
+  if (locus_count > INT_MAX)
+    return fail(w, "Sources are limited to 2^31 records");
+  for (int i = 0; i < s->field_count; i++)
+    if (s->fields[i].def.field_type != FieldEntityAttribute)
+      w->tables[s->fields[i].table].record_count = locus_count;
+
+  bool genomic = s->def.genomic_order;
+  bool has_gidx = genomic && s->chr_field >= 0 && s->start_field >= 0 && s->stop_field >= 0;
+  char uuid[40];
+  if (!s->def.uuid)
+    make_uuid(w, uuid);
+  time_t now = time(NULL);
+  char curated[32];
+  strftime(curated, sizeof(curated), "%Y-%m-%d %H:%M:%S", localtime(&now));
+
+  sqlite3_stmt* q;
+  if (sqlite3_prepare_v2(w->db,
+                         "INSERT INTO source (id, name, entity_dim, locus_dim, uuid, curated, "
+                         "docs, source_meta) VALUES (?, ?, ?, ?, ?, ?, ?, ?)",
+                         -1, &q, 0) != SQLITE_OK)
+    return fail(w, "Unable to prepare source insert");
+  sqlite3_bind_int(q, 1, source_id);
+  sqlite3_bind_text(q, 2, s->def.name, -1, SQLITE_STATIC);
+  sqlite3_bind_int(q, 3, s->def.entity_count);
+  sqlite3_bind_int(q, 4, (int)locus_count);
+  sqlite3_bind_text(q, 5, s->def.uuid ? s->def.uuid : uuid, -1, SQLITE_STATIC);
+  sqlite3_bind_text(q, 6, s->def.curated ? s->def.curated : curated, -1, SQLITE_STATIC);
+  sqlite3_bind_text(q, 7, s->def.docs_json ? s->def.docs_json : "{}", -1, SQLITE_STATIC);
+  if (s->def.meta_json)
+    sqlite3_bind_text(q, 8, s->def.meta_json, -1, SQLITE_STATIC);
+  else
+    sqlite3_bind_text(q, 8, genomic ? "{\"FeaturesInGenomicOrder\": true}" : "{}", -1,
+                      SQLITE_STATIC);
+  bool ok = sqlite3_step(q) == SQLITE_DONE;
+  sqlite3_finalize(q);
+  if (!ok)
+    return fail(w, "Unable to write source");
+
+  if (sqlite3_prepare_v2(w->db, "INSERT INTO field VALUES (?, ?, ?, ?, ?, ?, ?, ?)", -1, &q,
+                         0) != SQLITE_OK)
+    return fail(w, "Unable to prepare field insert");
+  for (int i = 0; i < s->field_count && ok; i++) {
+    w_field* f = &s->fields[i];
+    char* meta = field_meta(f);
+    sqlite3_reset(q);
+    sqlite3_bind_int(q, 1, source_id);
+    sqlite3_bind_int(q, 2, i);
+    sqlite3_bind_int(q, 3, f->table + 1);
+    sqlite3_bind_text(q, 4, f->def.field_type == FieldEntityAttribute ? ""
+                            : f->def.field_type == FieldSparseArray   ? "SPARSE_ARRAY"
+                                                                      : "IDX_IS_ID",
+                      -1, SQLITE_STATIC);
+    sqlite3_bind_text(q, 5, f->def.field_type == FieldLocusAttribute ? "" : "IDX_IS_ID", -1,
+                      SQLITE_STATIC);
+    sqlite3_bind_int(q, 6, f->table_field_idx);
+    sqlite3_bind_text(q, 7, f->format, -1, SQLITE_STATIC);
+    sqlite3_bind_text(q, 8, meta, -1, SQLITE_TRANSIENT);
+    ok = sqlite3_step(q) == SQLITE_DONE;
+    tsf_free(meta);
+  }
+  sqlite3_finalize(q);
+  if (!ok)
+    return fail(w, "Unable to write fields");
+  if (!has_gidx)
+    return true;
+
+  // Genomic index query table, named after the data table
+  if (!gidx_update(w, s))
+    return false;
+  const char* table = w->tables[s->locus_table].name;
+  char sql[512];
+  snprintf(sql, sizeof(sql),
+           "CREATE TABLE %s_gidx (id INTEGER PRIMARY KEY, min_start INTEGER, max_stop INTEGER, "
+           "field_offset INTEGER, n INTEGER)",
+           table);
+  if (!exec(w, sql))
+    return false;
+  snprintf(sql, sizeof(sql), "INSERT INTO %s_gidx VALUES (?, ?, ?, ?, ?)", table);
+  if (sqlite3_prepare_v2(w->db, sql, -1, &q, 0) != SQLITE_OK)
+    return fail(w, "Unable to prepare genomic index insert");
+  for (int i = 0; i < s->row_count && ok; i++) {
+    gidx_row* row = &s->rows[i];
+    sqlite3_reset(q);
+    sqlite3_bind_int64(q, 1, ((int64_t)row->chr << 16) | row->group);
+    sqlite3_bind_int(q, 2, row->min_start);
+    sqlite3_bind_int(q, 3, row->max_stop);
+    sqlite3_bind_int(q, 4, row->offset);
+    sqlite3_bind_int(q, 5, row->n);
+    ok = sqlite3_step(q) == SQLITE_DONE;
+  }
+  sqlite3_finalize(q);
+  if (!ok)
+    return fail(w, "Unable to write genomic index");
+  snprintf(sql, sizeof(sql), "CREATE INDEX %s_gidx_idx ON %s_gidx(id, min_start, max_stop)",
+           table, table);
+  if (!exec(w, sql))
+    return false;
+
+  json_t* meta = json_object();
+  if (s->def.coord_sys_id)
+    json_object_set_new(meta, "coordSysId", json_string(s->def.coord_sys_id));
+  char* meta_str = json_dumps(meta, JSON_PRESERVE_ORDER);
+  json_decref(meta);
+  if (sqlite3_prepare_v2(w->db, "INSERT INTO idx VALUES (?, ?, 'idx_gidx', ?, ?, ?)", -1, &q,
+                         0) != SQLITE_OK) {
+    tsf_free(meta_str);
+    return fail(w, "Unable to prepare idx insert");
+  }
+  snprintf(sql, sizeof(sql), "%s_gidx", table);
+  sqlite3_bind_int(q, 1, source_id);
+  sqlite3_bind_int(q, 2, s->chr_field);
+  sqlite3_bind_text(q, 3, sql, -1, SQLITE_STATIC);
+  sqlite3_bind_int(q, 4, s->locus_table + 1);
+  sqlite3_bind_text(q, 5, meta_str, -1, SQLITE_STATIC);
+  ok = sqlite3_step(q) == SQLITE_DONE;
+  sqlite3_finalize(q);
+  tsf_free(meta_str);
+  return ok || fail(w, "Unable to write genomic index");
+}
+
+static bool write_tables(tsf_writer* w)
+{
+  sqlite3_stmt* q;
+  if (sqlite3_prepare_v2(w->db,
+                         "INSERT INTO tbl (id, uuid, table_uri, table_format, table_meta) "
+                         "VALUES (?, ?, ?, 'chunk_table', ?)",
+                         -1, &q, 0) != SQLITE_OK)
+    return fail(w, "Unable to prepare table insert");
+  bool ok = true;
+  for (int i = 0; i < w->table_count && ok; i++) {
+    w_table* t = &w->tables[i];
+    char uri[128], meta[128];
+    // Braces of the uuid are URL encoded
+    snprintf(uri, sizeof(uri), "table://this/?table=%s&uuid=%%7B%.36s%%7D", t->name,
+             t->uuid + 1);
+    snprintf(meta, sizeof(meta),
+             "{\"chunk_bits\": %d, \"field_count\": %d, \"record_count\": %lld}",
+             w->opts.chunk_bits, t->field_count, (long long)t->record_count);
+    sqlite3_reset(q);
+    sqlite3_bind_int(q, 1, i + 1);
+    sqlite3_bind_text(q, 2, t->uuid, -1, SQLITE_STATIC);
+    sqlite3_bind_text(q, 3, uri, -1, SQLITE_STATIC);
+    sqlite3_bind_text(q, 4, meta, -1, SQLITE_STATIC);
+    ok = sqlite3_step(q) == SQLITE_DONE;
+  }
+  sqlite3_finalize(q);
+  return ok || fail(w, "Unable to write tables");
+}
+
+bool tsf_writer_close(tsf_writer* w)
+{
+  if (!w)
+    return false;
+  bool ok = !w->errmsg;
+
+  // Partial chunks at the end of each field
+  for (int i = 0; i < w->source_count && ok; i++) {
+    w_source* s = &w->sources[i];
+    for (int j = 0; j < s->field_count && ok; j++)
+      for (int k = 0; k < s->fields[j].stream_count && ok; k++)
+        ok = flush_stream(w, &s->fields[j], k);
+    // Dictionaries of fields with fewer chunks than needed to train
+    for (int j = 0; j < s->field_count && ok; j++)
+      if (s->fields[j].held_head)
+        ok = train_dict(w, &s->fields[j]);
+  }
+
+  if (w->thread_count > 0) {
+    pthread_mutex_lock(&w->mutex);
+    w->stopping = true;
+    pthread_cond_broadcast(&w->job_ready);
+    pthread_mutex_unlock(&w->mutex);
+    for (int i = 0; i < w->thread_count; i++)
+      pthread_join(w->threads[i], NULL);
+    ok = drain_done(w, false) && ok;
+    tsf_free(w->threads);
+  }
+
+  for (int i = 0; i < w->source_count && ok; i++)
+    ok = write_source(w, i + 1, &w->sources[i]);
+  ok = ok && write_tables(w) && exec(w, "COMMIT");
+  if (!ok)
+    fprintf(stderr, "TSF writer failed: %s\n", w->errmsg ? w->errmsg : "unknown error");
+
+  // Free everything
+  for (int i = 0; i < w->table_count; i++)
+    sqlite3_finalize(w->tables[i].insert);
+  sqlite3_finalize(w->dict_insert);
+  if (w->cctx)
+    ZSTD_freeCCtx(w->cctx);
+  tsf_free(w->tables);
+  for (int i = 0; i < w->source_count; i++) {
+    w_source* s = &w->sources[i];
+    for (int j = 0; j < s->field_count; j++) {
+      w_field* f = &s->fields[j];
+      for (int k = 0; k < f->stream_count; k++) {
+        tsf_free(f->streams[k].values.data);
+        tsf_free(f->streams[k].sizes.data);
+      }
+      tsf_free(f->streams);
+      while (f->held_head) {
+        chunk_job* job = f->held_head;
+        f->held_head = job->next;
+        tsf_free(job->raw.data);
+        tsf_free(job->encoded.data);
+        tsf_free(job->out.data);
+        tsf_free(job);
+      }
+      if (f->cdict)
+        ZSTD_freeCDict(f->cdict);
+      for (int k = 0; k < f->def.enum_count; k++)
+        tsf_free((char*)f->def.enum_names[k]);
+      tsf_free(f->def.enum_names);
+      tsf_free((char*)f->def.name);
+      tsf_free((char*)f->def.symbol);
+      tsf_free((char*)f->def.meta_json);
+    }
+    tsf_free(s->fields);
+    for (int j = 0; j < 3; j++)
+      tsf_free(s->gidx_pending[j].data);
+    tsf_free(s->chr_seen);
+    tsf_free(s->rows);
+    tsf_free((char*)s->def.name);
+    tsf_free((char*)s->def.uuid);
+    tsf_free((char*)s->def.docs_json);
+    tsf_free((char*)s->def.coord_sys_id);
+    tsf_free((char*)s->def.curated);
+    tsf_free((char*)s->def.meta_json);
+  }
+  tsf_free(w->sources);
+  while (w->free_jobs) {
+    chunk_job* job = w->free_jobs;
+    w->free_jobs = job->next;
+    tsf_free(job->raw.data);
+    tsf_free(job->encoded.data);
+    tsf_free(job->out.data);
+    tsf_free(job);
+  }
+  pthread_mutex_destroy(&w->mutex);
+  pthread_cond_destroy(&w->job_ready);
+  pthread_cond_destroy(&w->job_done);
+  sqlite3_close(w->db);
+  tsf_free(w->errmsg);
+  tsf_free(w);
+  return ok;
+}
@@ -0,0 +1,116 @@
+/*-------------------------------------------------------------------------
+ *
+ * tsf_writer.h
+ *
+ * TSF file C writer interface.
+ *
+ * Copyright (c) 2012-2015 Golden Helix, Inc.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#ifndef TSF_WRITER_H
+#define TSF_WRITER_H
+
+#include "tsf.h"
+
+// Columns are appended in batches and cut into chunks of 2^chunk_bits
+// records. Full chunks are compressed by a pool of worker threads and
+// written by the appending thread, all in a single transaction that is
+// committed by tsf_writer_close.
+//
+// A writer is not itself thread-safe: append from one thread.
+typedef struct tsf_writer tsf_writer;
+
+typedef struct tsf_writer_opts {
+  int chunk_bits;   // Records per chunk as a power of 2 (default 12)
+  int codec;        // compression_method (default CompressionZstd)
+  int level;        // Compression level, -1 for the codec default
+  int threads;      // Compression workers, 0 for one per CPU, 1 to compress inline
+
+  // Bytes of the zstd dictionary trained per string and string array
+  // field compressed with zstd, 0 for none (default)
+  int zstd_dict_size;
+
+  // Store chunks of non-array fields whose records all have the same
+  // value, such as all missing, once as EncodingConstant (default false)
+  bool constant_chunks;
+} tsf_writer_opts;
+
+typedef struct tsf_writer_source {
+  const char* name;
+  const char* uuid;         // NULL to generate one
+  const char* docs_json;    // "docs" object, such as {"curatedBy": "Me"}, or NULL
+  const char* coord_sys_id; // Genomic index coordinate system, or NULL
+  int entity_count;         // 0 if the source has no entities
+
+  // Records are appended sorted by Chr then Start. A genomic index is
+  // built if the source has enum Chr and int Start and Stop locus fields.
+  bool genomic_order;
+
+  const char* curated;   // YYYY-MM-DD HH:MM:SS, or NULL for now
+  const char* meta_json; // Replaces the generated source_meta if set
+} tsf_writer_source;
+
+typedef struct tsf_writer_field {
+  const char* name;
+  const char* symbol;          // NULL to derive one from name when read
+  tsf_value_type value_type;
+  tsf_field_type field_type;   // Locus or entity attribute, matrix or sparse array
+  int enum_count;              // Enum and enum array types only
+  const char** enum_names;
+  const char* meta_json;       // Replaces the generated field_meta if set
+  int codec;                   // -1 for the writer default
+  int level;                   // -1 for the writer default
+  int zstd_dict_size;          // 0 for the writer default, -1 for none
+  int encoding;                // tsf_chunk_encoding applied before the codec
+} tsf_writer_field;
+
+// Fills opts with the defaults
+void tsf_writer_opts_init(tsf_writer_opts* opts);
+
+// Creates (or replaces) the file at path. Pass NULL opts for defaults.
+// Returns NULL if the file could not be created. An existing file at path
+// is deleted first, so is lost even when creating the new one fails.
+tsf_writer* tsf_writer_open(const char* path, const tsf_writer_opts* opts);
+
+// Returns the 1-based source_id, or -1 on error
+int tsf_writer_add_source(tsf_writer* w, const tsf_writer_source* source);
+
+// Returns the field index (as in tsf_source.fields once read), or -1 on
+// error. All fields must be added before data is appended to the source.
+int tsf_writer_add_field(tsf_writer* w, int source_id, const tsf_writer_field* field);
+
+// Appends count values to a locus or entity attribute field. values is an
+// array of the field's C type (int, int64_t, float, double, char for
+// bools, int for enums), using the *_MISSING sentinels for nulls, or a
+// const char* array for strings, where NULL is missing.
+bool tsf_writer_append(tsf_writer* w, int source_id, int field, int count, const void* values);
+
+// Appends count array values: sizes[i] elements each, with values holding
+// all elements back to back (const char* elements for string arrays).
+bool tsf_writer_append_array(tsf_writer* w, int source_id, int field, int count,
+                             const int* sizes, const void* values);
+
+// Appends count records of one entity of a (non-array) matrix field.
+// Every entity must be given the same records; memory is best bounded by
+// appending all entities a block of records at a time.
+bool tsf_writer_append_matrix(tsf_writer* w, int source_id, int field, int entity_idx, int count,
+                              const void* values);
+
+// Appends count records of a sparse array field (see tsf_sparse_batch):
+// sizes[i] non-missing cells each, with entity_idxs (ascending within a
+// record) and values holding all cells back to back, values as elements
+// of the field's array value type.
+bool tsf_writer_append_sparse(tsf_writer* w, int source_id, int field, int count,
+                              const int* sizes, const int* entity_idxs, const void* values);
+
+// Description of the first error, or NULL
+const char* tsf_writer_errmsg(tsf_writer* w);
+
+// Flushes all chunks, writes the meta-data and genomic indexes and commits.
+// Returns false (and prints the error) if anything failed, in which case
+// the file is incomplete. Frees the writer either way.
+bool tsf_writer_close(tsf_writer* w);
+
+#endif
@@ -1,9 +1,912 @@
 #include "tsf.h"
+#include "tsf_writer.h"
+#include "blosc/blosc.h"
+
+#include <pthread.h>
 
 // Unit testing framework, but we are just using their convenient assert
 // functions.
 #include "test_helper.h"
 
+static int alloc_count = 0;
+
+static void* counting_malloc(size_t size)
+{
+  alloc_count++;
+  return malloc(size);
+}
+
+static void* counting_realloc(void* p, size_t size)
+{
+  if (!p)
+    alloc_count++;
+  return realloc(p, size);
+}
+
+static void counting_free(void* p)
+{
+  alloc_count--;
+  free(p);
+}
+
+// Writes a small genomic source with every value type and a matrix
+// through the writer, then checks every value read back.
+static void test_writer_round_trip(int codec, int threads)
+{
+  static const char* chrs[] = {"1", "2", "X"};
+  static const char* words[] = {"alpha", "beta", "gamma"};
+  const int n = 100;
+
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.chunk_bits = 4;
+  opts.codec = codec;
+  opts.threads = threads;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  assert_non_null(w);
+
+  tsf_writer_source src = {"Round Trip", NULL, "{\"curatedBy\": \"tests\"}", NULL, 3, true};
+  int source_id = tsf_writer_add_source(w, &src);
+  assert_int_equal(source_id, 1);
+  tsf_writer_field def = {"Chr", NULL, TypeEnum, FieldLocusAttribute, 3, chrs, NULL, -1, -1};
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 0);
+  def.enum_count = 0;
+  def.enum_names = NULL;
+  tsf_value_type types[] = {TypeInt32,        TypeInt32,      TypeInt64,       TypeFloat32,
+                            TypeFloat64,      TypeBool,       TypeString,      TypeInt32Array,
+                            TypeFloat64Array, TypeBoolArray,  TypeStringArray};
+  const char* names[] = {"Start", "Stop", "I8", "F4", "F8", "Bool", "Str", "IntArray",
+                         "DoubleArray", "BoolArray", "StrArray"};
+  for (int i = 0; i < 11; i++) {
+    def.name = names[i];
+    def.value_type = types[i];
+    def.codec = i == 6 ? CompressionZlib : -1; // Per field codec
+    assert_int_equal(tsf_writer_add_field(w, source_id, &def), i + 1);
+  }
+  def.codec = -1;
+  def.name = "GT";
+  def.value_type = TypeEnum;
+  def.field_type = FieldMatrix;
+  def.enum_count = 3;
+  def.enum_names = words;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 12);
+  def.name = "Sample";
+  def.value_type = TypeString;
+  def.field_type = FieldEntityAttribute;
+  def.enum_count = 0;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 13);
+
+  // Appended in uneven batches, crossing chunk boundaries
+  for (int first = 0; first < n; first += 37) {
+    int count = n - first < 37 ? n - first : 37;
+    int chr[37], start[37], stop[37], sizes[37], ints[37 * 3];
+    int64_t i8[37];
+    float f4[37];
+    double f8[37], doubles[37 * 3];
+    char bools[37], bool_elems[37 * 3];
+    const char* strs[37];
+    const char* str_elems[37 * 3];
+    int elems = 0;
+    for (int i = 0; i < count; i++) {
+      int r = first + i;
+      chr[i] = r * 3 / n;
+      start[i] = r * 10;
+      stop[i] = r * 10 + 5;
+      i8[i] = r % 7 == 0 ? INT64_MISSING : (int64_t)r << 33;
+      f4[i] = r % 5 == 0 ? FLOAT_MISSING : r / 4.0f;
+      f8[i] = r / 8.0;
+      bools[i] = r % 3 == 0 ? BOOL_MISSING : r % 2;
+      strs[i] = r % 4 == 0 ? NULL : words[r % 3];
+      sizes[i] = r % 4;
+      for (int j = 0; j < sizes[i]; j++, elems++) {
+        ints[elems] = r * 100 + j;
+        doubles[elems] = r + j / 2.0;
+        bool_elems[elems] = j % 2;
+        str_elems[elems] = words[j % 3];
+      }
+    }
+    assert_true(tsf_writer_append(w, source_id, 0, count, chr));
+    assert_true(tsf_writer_append(w, source_id, 1, count, start));
+    assert_true(tsf_writer_append(w, source_id, 2, count, stop));
+    assert_true(tsf_writer_append(w, source_id, 3, count, i8));
+    assert_true(tsf_writer_append(w, source_id, 4, count, f4));
+    assert_true(tsf_writer_append(w, source_id, 5, count, f8));
+    assert_true(tsf_writer_append(w, source_id, 6, count, bools));
+    assert_true(tsf_writer_append(w, source_id, 7, count, strs));
+    assert_true(tsf_writer_append_array(w, source_id, 8, count, sizes, ints));
+    assert_true(tsf_writer_append_array(w, source_id, 9, count, sizes, doubles));
+    assert_true(tsf_writer_append_array(w, source_id, 10, count, sizes, bool_elems));
+    assert_true(tsf_writer_append_array(w, source_id, 11, count, sizes, str_elems));
+    for (int e = 0; e < 3; e++) {
+      for (int i = 0; i < count; i++)
+        chr[i] = (first + i + e) % 3;
+      assert_true(tsf_writer_append_matrix(w, source_id, 12, e, count, chr));
+    }
+  }
+  const char* samples[] = {"S1", "S2", "S3"};
+  assert_true(tsf_writer_append(w, source_id, 13, 3, samples));
+  assert_true(tsf_writer_close(w));
+
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  assert_non_null(tsf);
+  assert_null(tsf->errmsg);
+  tsf_source* s = &tsf->sources[0];
+  assert_string_equal(s->name, "Round Trip");
+  assert_string_equal(s->curated_by, "tests");
+  assert_int_equal(s->locus_count, n);
+  assert_int_equal(s->entity_count, 3);
+  assert_int_equal(s->field_count, 14);
+  assert_true(s->records_in_genomic_order);
+  assert_string_equal(s->fields[7].symbol, "Str");
+  assert_int_equal(s->fields[12].field_type, FieldMatrix);
+  assert_float_equal(s->fields[1].extents_max, 990.0);
+
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  assert_int_equal(iter->field_count, 12);
+  while (tsf_iter_next(iter)) {
+    int r = iter->cur_record_id;
+    tsf_v* v = iter->cur_values;
+    assert_string_equal(v_enum_as_str(v[0], iter->fields[0]->enum_names), chrs[r * 3 / n]);
+    assert_int_equal(v_int32(v[1]), r * 10);
+    assert_int_equal(v_int32(v[2]), r * 10 + 5);
+    assert_true(iter->cur_nulls[3] == (r % 7 == 0));
+    if (r % 7 != 0)
+      assert_true(v_int64(v[3]) == (int64_t)r << 33);
+    assert_true(iter->cur_nulls[4] == (r % 5 == 0));
+    assert_float_equal(v_float64(v[5]), (r / 8.0));
+    assert_true(iter->cur_nulls[6] == (r % 3 == 0));
+    assert_true(iter->cur_nulls[7] == (r % 4 == 0));
+    if (r % 4 != 0)
+      assert_string_equal(v_str(v[7]), words[r % 3]);
+    for (int f = 8; f < 12; f++)
+      assert_int_equal(va_size(v[f]), r % 4);
+    for (int j = 0; j < r % 4; j++) {
+      assert_int_equal(va_int32(v[8], j), r * 100 + j);
+      assert_float_equal(va_float64(v[9], j), (r + j / 2.0));
+      assert_int_equal(va_bool(v[10], j), j % 2);
+      assert_string_equal(va_str(v[11], j), words[j % 3]);
+    }
+  }
+  assert_int_equal(iter->cur_record_id, n);
+  tsf_iter_close(iter);
+
+  int gt = 12;
+  iter = tsf_query_table(tsf, 1, 1, &gt, -1, NULL, FieldMatrix);
+  int cells = 0;
+  while (tsf_iter_next(iter)) {
+    assert_int_equal(v_int32(iter->cur_values[0]),
+                     (iter->cur_record_id + iter->entity_ids[iter->cur_entity_idx]) % 3);
+    cells++;
+  }
+  assert_int_equal(cells, n * 3);
+  tsf_iter_close(iter);
+
+  // Entity-major: every record of entity 2, then of entity 0, through
+  // a single resident chunk
+  int gt_entities[] = {2, 0};
+  iter = tsf_query_table(tsf, 1, 1, &gt, 2, gt_entities, FieldMatrix);
+  iter->entity_major = true;
+  cells = 0;
+  while (tsf_iter_next(iter)) {
+    assert_int_equal(iter->cur_entity_idx, cells / n);
+    assert_int_equal(iter->cur_record_id, cells % n);
+    assert_int_equal(v_int32(iter->cur_values[0]),
+                     (iter->cur_record_id + iter->entity_ids[iter->cur_entity_idx]) % 3);
+    cells++;
+  }
+  assert_int_equal(cells, n * 2);
+  assert_int_equal(iter->stats.read_chunks, 2 * ((n + 15) / 16));
+  assert_int_equal(iter->matrix_resident_bytes, 0);
+  tsf_iter_close(iter);
+
+  // Scattered and repeated entities are fetched once per block in
+  // storage order, and still visited in the order given
+  int scattered[] = {2, 0, 2, 1};
+  iter = tsf_query_table(tsf, 1, 1, &gt, 4, scattered, FieldMatrix);
+  cells = 0;
+  while (tsf_iter_next(iter)) {
+    assert_int_equal(iter->cur_entity_idx, cells % 4);
+    assert_int_equal(v_int32(iter->cur_values[0]),
+                     (iter->cur_record_id + scattered[iter->cur_entity_idx]) % 3);
+    cells++;
+  }
+  assert_int_equal(cells, n * 4);
+  assert_int_equal(iter->stats.read_chunks, 4 * ((n + 15) / 16));
+  tsf_iter_close(iter);
+
+  // A single cell lookup reads only that entity's chunk
+  iter = tsf_query_table(tsf, 1, 1, &gt, -1, NULL, FieldMatrix);
+  assert_true(tsf_iter_id_matrix(iter, 20, 0));
+  assert_int_equal(v_int32(iter->cur_values[0]), (20 + iter->entity_ids[0]) % 3);
+  assert_int_equal(iter->stats.read_chunks, 1);
+  tsf_iter_close(iter);
+
+  // A budget of one chunk rereads each entity's chunk for every record
+  for (int budget = 0; budget <= 1; budget++) {
+    iter = tsf_query_table(tsf, 1, 1, &gt, -1, NULL, FieldMatrix);
+    iter->matrix_budget = budget;
+    while (tsf_iter_next(iter))
+      assert_int_equal(v_int32(iter->cur_values[0]),
+                       (iter->cur_record_id + iter->entity_ids[iter->cur_entity_idx]) % 3);
+    assert_int_equal(iter->stats.read_chunks, budget ? n * 3 : 3 * ((n + 15) / 16));
+    assert_true(iter->matrix_resident_bytes <= (budget ? 16 * 4 : 3 * 16 * 4));
+    tsf_iter_close(iter);
+  }
+
+  // Dense block of records 10-59 across four chunks by two entities,
+  // decompressed serially and by three threads
+  iter = tsf_query_table(tsf, 1, 1, &gt, 2, gt_entities, FieldMatrix);
+  for (int threads = 1; threads <= 3; threads += 2) {
+    int block[50 * 2];
+    bool block_nulls[50 * 2];
+    assert_true(tsf_iter_read_matrix_block(iter, 0, 10, 50, threads, block, block_nulls));
+    for (int r = 0; r < 50; r++) {
+      for (int e = 0; e < 2; e++) {
+        assert_false(block_nulls[r * 2 + e]);
+        assert_int_equal(block[r * 2 + e], (10 + r + gt_entities[e]) % 3);
+      }
+    }
+  }
+  assert_int_equal(iter->stats.read_chunks, 2 * 4 * 2);
+  assert_false(tsf_iter_read_matrix_block(iter, 0, 90, 11, 0, NULL, NULL));
+  tsf_iter_close(iter);
+
+  iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldEntityAttribute);
+  assert_true(tsf_iter_id(iter, 2));
+  assert_string_equal(v_str(iter->cur_values[0]), "S3");
+  tsf_iter_close(iter);
+
+  const tsf_entity_table* entities = tsf_source_entities(tsf, 1);
+  assert_non_null(entities);
+  assert_true(tsf_source_entities(tsf, 1) == entities);
+  assert_int_equal(entities->entity_count, 3);
+  assert_int_equal(entities->field_count, 1);
+  assert_int_equal(entities->name_field, 0);
+  assert_string_equal(((const char**)entities->columns[0])[1], "S2");
+  assert_false(entities->nulls[0][2]);
+  assert_int_equal(tsf_entity_by_name(tsf, 1, "S3"), 2);
+  assert_int_equal(tsf_entity_by_name(tsf, 1, "S4"), -1);
+
+  // Records 40-59 are on chr "2" at 400-595
+  tsf_gidx_iter* gidx = tsf_query_genomic_index(tsf, 1, "2", 452, 503, -1, NULL, -1, NULL);
+  assert_non_null(gidx);
+  int found = 0;
+  while (tsf_gidx_iter_next(gidx))
+    assert_int_equal(gidx->iter.cur_record_id, 45 + found++);
+  assert_int_equal(found, 6);
+  tsf_gidx_iter_close(gidx);
+
+  tsf_close_file(tsf);
+  remove("test_writer.tsf");
+}
+
+// Writes 4096 short strings in chunks of 32 records, optionally with a
+// zstd dictionary, checks them and returns the compressed chunk bytes
+static int64_t test_writer_strings(int dict_size)
+{
+  static const char* terms[] = {"missense_variant", "synonymous_variant", "intron_variant",
+                                "stop_gained", "splice_region_variant", "3_prime_UTR_variant"};
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.chunk_bits = 5;
+  opts.threads = 2;
+  opts.zstd_dict_size = dict_size;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  tsf_writer_source src = {"Strings", NULL, NULL, NULL, 0, false};
+  int source_id = tsf_writer_add_source(w, &src);
+  tsf_writer_field def = {"Term", NULL, TypeString, FieldLocusAttribute, 0, NULL, NULL, -1, -1};
+  tsf_writer_add_field(w, source_id, &def);
+  char str[64];
+  const char* value = str;
+  for (int i = 0; i < 4096; i++) {
+    snprintf(str, sizeof(str), "GENE%d:%s", i % 97, terms[(i * 7) % 6]);
+    assert_true(tsf_writer_append(w, source_id, 0, 1, &value));
+  }
+  assert_true(tsf_writer_close(w));
+
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  assert_non_null(tsf);
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  while (tsf_iter_next(iter)) {
+    int i = iter->cur_record_id;
+    snprintf(str, sizeof(str), "GENE%d:%s", i % 97, terms[(i * 7) % 6]);
+    assert_string_equal(v_str(iter->cur_values[0]), str);
+  }
+  assert_int_equal(iter->cur_record_id, 4096);
+  tsf_explain* e = tsf_explain_iter(iter, 0, -1);
+  int64_t bytes = e->compressed_bytes;
+  tsf_explain_free(e);
+  tsf_iter_close(iter);
+  tsf_close_file(tsf);
+  remove("test_writer.tsf");
+  return bytes;
+}
+
+// Writes int32, enum and float32 fields with each lightweight encoding
+// (and one uncompressed), including missing values, and reads them back
+static void test_writer_encodings(int codec)
+{
+  static const char* chrs[] = {"1", "2", "X"};
+  const int n = 1000;
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.chunk_bits = 8;
+  opts.codec = codec;
+  opts.threads = 2;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  tsf_writer_source src = {"Encodings", NULL, NULL, NULL, 0, false};
+  int source_id = tsf_writer_add_source(w, &src);
+  tsf_writer_field def = {"Pos", NULL, TypeInt32, FieldLocusAttribute, 0, NULL, NULL, -1, -1};
+  def.encoding = EncodingDelta;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 0);
+  def.name = "Offset";
+  def.encoding = EncodingFOR;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 1);
+  def.name = "Chr";
+  def.value_type = TypeEnum;
+  def.enum_count = 3;
+  def.enum_names = chrs;
+  def.encoding = EncodingRLE;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 2);
+  def.name = "AF";
+  def.value_type = TypeFloat32;
+  def.enum_count = 0;
+  def.enum_names = NULL;
+  def.encoding = EncodingDict;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 3);
+  def.name = "Raw";
+  def.value_type = TypeInt32;
+  def.encoding = EncodingNone;
+  def.codec = CompressionNone;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 4);
+  def.name = "Sorted";
+  def.codec = -1;
+  def.encoding = EncodingDeltaFOR;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 5);
+  def.name = "Gaps";
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 6);
+  def.name = "Score";
+  def.value_type = TypeFloat32;
+  def.encoding = EncodingShuffle;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 7);
+  def.name = "Score64";
+  def.value_type = TypeFloat64;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 8);
+  def.name = "Phred";
+  def.value_type = TypeFloat32;
+  def.encoding = EncodingDecimal;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 9);
+  def.name = "AF64";
+  def.value_type = TypeFloat64;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 10);
+  for (int r = 0; r < n; r++) {
+    int pos = r % 50 == 7 ? INT_MISSING : 1000000 + r * 13;
+    int offset = r % 9 == 0 ? INT_MISSING : (r % 17) - 8;
+    int chr = r >= 600 && r < 700 ? INT_MISSING : r * 3 / n;
+    float af = r % 11 == 0 ? FLOAT_MISSING : (r % 4) / 8.0f;
+    int raw = r * r;
+    int sorted = 5000 + r * 7 + r % 3;
+    int gaps = r % 13 == 0 ? INT_MISSING : -r * 1000;
+    float score = r / 1000.0f;
+    double score64 = r % 5 == 0 ? DOUBLE_MISSING : r * 0.125;
+    // Two decimal places, with missing values and thirds as exceptions
+    float phred = r % 7 == 0 ? FLOAT_MISSING : (r % 10 == 0 ? r / 3.0f : (r - 500) / 100.0f);
+    double af64 = r % 9 == 0 ? r / 3.0 : r / 1000.0;
+    assert_true(tsf_writer_append(w, source_id, 0, 1, &pos));
+    assert_true(tsf_writer_append(w, source_id, 1, 1, &offset));
+    assert_true(tsf_writer_append(w, source_id, 2, 1, &chr));
+    assert_true(tsf_writer_append(w, source_id, 3, 1, &af));
+    assert_true(tsf_writer_append(w, source_id, 4, 1, &raw));
+    assert_true(tsf_writer_append(w, source_id, 5, 1, &sorted));
+    assert_true(tsf_writer_append(w, source_id, 6, 1, &gaps));
+    assert_true(tsf_writer_append(w, source_id, 7, 1, &score));
+    assert_true(tsf_writer_append(w, source_id, 8, 1, &score64));
+    assert_true(tsf_writer_append(w, source_id, 9, 1, &phred));
+    assert_true(tsf_writer_append(w, source_id, 10, 1, &af64));
+  }
+  assert_true(tsf_writer_close(w));
+
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  assert_non_null(tsf);
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  while (tsf_iter_next(iter)) {
+    int r = iter->cur_record_id;
+    tsf_v* v = iter->cur_values;
+    assert_true(iter->cur_nulls[0] == (r % 50 == 7));
+    if (r % 50 != 7)
+      assert_int_equal(v_int32(v[0]), 1000000 + r * 13);
+    assert_true(iter->cur_nulls[1] == (r % 9 == 0));
+    if (r % 9 != 0)
+      assert_int_equal(v_int32(v[1]), (r % 17) - 8);
+    assert_true(iter->cur_nulls[2] == (r >= 600 && r < 700));
+    if (!iter->cur_nulls[2])
+      assert_int_equal(v_int32(v[2]), r * 3 / n);
+    assert_true(iter->cur_nulls[3] == (r % 11 == 0));
+    if (r % 11 != 0)
+      assert_float_equal(v_float32(v[3]), ((r % 4) / 8.0f));
+    assert_int_equal(v_int32(v[4]), r * r);
+    assert_int_equal(v_int32(v[5]), 5000 + r * 7 + r % 3);
+    assert_true(iter->cur_nulls[6] == (r % 13 == 0));
+    if (r % 13 != 0)
+      assert_int_equal(v_int32(v[6]), -r * 1000);
+    assert_true(v_float32(v[7]) == r / 1000.0f);
+    assert_true(iter->cur_nulls[8] == (r % 5 == 0));
+    if (r % 5 != 0)
+      assert_true(v_float64(v[8]) == r * 0.125);
+    assert_true(iter->cur_nulls[9] == (r % 7 == 0));
+    if (r % 7 != 0)
+      assert_true(v_float32(v[9]) == (r % 10 == 0 ? r / 3.0f : (r - 500) / 100.0f));
+    assert_true(v_float64(v[10]) == (r % 9 == 0 ? r / 3.0 : r / 1000.0));
+  }
+  assert_int_equal(iter->cur_record_id, n);
+  tsf_iter_close(iter);
+  tsf_close_file(tsf);
+  remove("test_writer.tsf");
+
+  // Delta and FOR apply to int32 and enum fields only
+  w = tsf_writer_open("test_writer.tsf", &opts);
+  source_id = tsf_writer_add_source(w, &src);
+  def.name = "Bad";
+  def.value_type = TypeFloat32;
+  def.encoding = EncodingDelta;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), -1);
+  assert_non_null(tsf_writer_errmsg(w));
+  assert_false(tsf_writer_close(w));
+  remove("test_writer.tsf");
+}
+
+// Chunks of 16 records: all missing, constant, then varied values. The
+// first two are written once as constant chunks and read as batches.
+static void test_writer_constant_chunks(void)
+{
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.chunk_bits = 4;
+  opts.threads = 1;
+  opts.constant_chunks = true;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  tsf_writer_source src = {"Constant", NULL, NULL, NULL, 0, false};
+  int source_id = tsf_writer_add_source(w, &src);
+  tsf_writer_field def = {"Score", NULL, TypeFloat32, FieldLocusAttribute, 0, NULL, NULL, -1, -1};
+  tsf_writer_add_field(w, source_id, &def);
+  def.name = "Note";
+  def.value_type = TypeString;
+  tsf_writer_add_field(w, source_id, &def);
+  for (int r = 0; r < 48; r++) {
+    float score = r < 16 ? FLOAT_MISSING : (r < 32 ? 2.5f : r);
+    const char* note = r < 16 ? NULL : (r < 32 || r % 2 ? "same" : "other");
+    assert_true(tsf_writer_append(w, source_id, 0, 1, &score));
+    assert_true(tsf_writer_append(w, source_id, 1, 1, &note));
+  }
+  assert_true(tsf_writer_close(w));
+
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  while (tsf_iter_next(iter)) {
+    int r = iter->cur_record_id;
+    assert_true(iter->cur_nulls[0] == (r < 16));
+    if (r >= 16)
+      assert_float_equal(v_float32(iter->cur_values[0]), (r < 32 ? 2.5 : r));
+    assert_true(iter->cur_nulls[1] == (r < 16));
+    if (r >= 16)
+      assert_string_equal(v_str(iter->cur_values[1]), r < 32 || r % 2 ? "same" : "other");
+  }
+  assert_int_equal(iter->stats.codecs[CompressionNone].chunks, 4);
+
+  tsf_batch b;
+  for (int i = 0; i < 2; i++) {
+    assert_true(tsf_iter_read_batch(iter, i, 4, 100, &b));
+    assert_int_equal(b.first_record_id, 4);
+    assert_int_equal(b.count, 12);
+    assert_true(b.is_constant && b.all_null);
+    assert_true(tsf_iter_read_batch(iter, i, 16, 100, &b));
+    assert_true(b.is_constant && !b.all_null);
+    assert_true(tsf_iter_read_batch(iter, i, 40, 3, &b));
+    assert_int_equal(b.count, 3);
+    assert_true(!b.is_constant && !b.all_null);
+    assert_false(b.nulls[2]);
+    if (i == 0)
+      assert_float_equal(v_float32(b.values[0]), 40.0);
+  }
+  assert_string_equal(v_str(b.values[1]), "same");
+  assert_false(tsf_iter_read_batch(iter, 0, 48, 1, &b));
+  tsf_iter_close(iter);
+  tsf_close_file(tsf);
+  remove("test_writer.tsf");
+}
+
+// Low cardinality strings, stored dictionary coded or coded as read,
+// come back from batches as codes into a per chunk dictionary
+// Sums the single Int32 field of a file, opened by each reader thread
+static void* blosc_reader(void* arg)
+{
+  int64_t* sum = arg;
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  while (tsf_iter_next(iter))
+    *sum += v_int32(iter->cur_values[0]);
+  tsf_iter_close(iter);
+  tsf_close_file(tsf);
+  return NULL;
+}
+
+// Reentrant blosc decompression, split across internal threads and from
+// concurrent readers
+static void test_blosc_threads(void)
+{
+  const int n = 1 << 20;
+  int* values = malloc(sizeof(int) * n);
+  for (int i = 0; i < n; i++)
+    values[i] = i * 7 % 1000;
+  size_t packed_size = sizeof(int) * n + BLOSC_MAX_OVERHEAD;
+  void* packed = malloc(packed_size);
+  int cbytes = blosc_compress(5, 1, sizeof(int), sizeof(int) * n, values, packed, packed_size);
+  assert_true(cbytes > 0);
+  int* out = malloc(sizeof(int) * n);
+  for (int threads = 1; threads <= 4; threads += 3) {
+    memset(out, 0, sizeof(int) * n);
+    assert_int_equal(blosc_decompress_ctx(packed, out, sizeof(int) * n, threads), sizeof(int) * n);
+    assert_int_equal(memcmp(out, values, sizeof(int) * n), 0);
+  }
+  assert_true(blosc_decompress_ctx(packed, out, sizeof(int) * n - 1, 1) < 0);
+  free(out);
+  free(packed);
+
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.codec = CompressionBlosc;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  tsf_writer_source src = {"Blosc", NULL, NULL, NULL, 0, false};
+  int source_id = tsf_writer_add_source(w, &src);
+  tsf_writer_field def = {"Value", NULL, TypeInt32, FieldLocusAttribute, 0, NULL, NULL, -1, -1};
+  tsf_writer_add_field(w, source_id, &def);
+  assert_true(tsf_writer_append(w, source_id, 0, 100000, values));
+  assert_true(tsf_writer_close(w));
+  int64_t expected = 0;
+  for (int i = 0; i < 100000; i++)
+    expected += values[i];
+  free(values);
+
+  pthread_t threads[4];
+  int64_t sums[4] = {0};
+  for (int i = 0; i < 4; i++)
+    pthread_create(&threads[i], NULL, blosc_reader, &sums[i]);
+  for (int i = 0; i < 4; i++) {
+    pthread_join(threads[i], NULL);
+    assert_true(sums[i] == expected);
+  }
+}
+
+// Matrix reductions of enum, float and int64 fields with nulls against
+// values computed here, over a range that starts and ends mid-chunk
+static void test_matrix_reductions(void)
+{
+  static const char* gts[] = {"0/0", "0/1", "1/1"};
+  const int n = 300, entities = 5;
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.chunk_bits = 6;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  tsf_writer_source src = {"Reductions", NULL, NULL, NULL, entities, false};
+  int source_id = tsf_writer_add_source(w, &src);
+  tsf_writer_field def = {"GT", NULL, TypeEnum, FieldMatrix, 3, gts, NULL, -1, -1};
+  tsf_writer_add_field(w, source_id, &def);
+  def.name = "DP";
+  def.value_type = TypeFloat32;
+  def.enum_count = 0;
+  def.enum_names = NULL;
+  tsf_writer_add_field(w, source_id, &def);
+  def.name = "Big";
+  def.value_type = TypeInt64;
+  tsf_writer_add_field(w, source_id, &def);
+  for (int e = 0; e < entities; e++) {
+    int gt[300];
+    float dp[300];
+    int64_t big[300];
+    for (int r = 0; r < n; r++) {
+      gt[r] = (r + e) % 7 == 0 ? INT_MISSING : (r * e) % 3;
+      dp[r] = (r + e) % 4 == 0 ? FLOAT_MISSING : r * 0.5f - e;
+      big[r] = e == 1 ? INT64_MISSING : ((int64_t)r << 20) + e;
+    }
+    assert_true(tsf_writer_append_matrix(w, source_id, 0, e, n, gt));
+    assert_true(tsf_writer_append_matrix(w, source_id, 1, e, n, dp));
+    assert_true(tsf_writer_append_matrix(w, source_id, 2, e, n, big));
+  }
+  assert_true(tsf_writer_close(w));
+
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  int entity_ids[] = {4, 1, 2, 0};
+  int fields[] = {0, 1, 2};
+  tsf_iter* iter = tsf_query_table(tsf, 1, 3, fields, 4, entity_ids, FieldMatrix);
+  const int first = 30, count = 201;
+  int counts[201], histogram[201 * 3];
+  double sums[201], mins[201], maxs[201];
+  tsf_matrix_reduction red = {counts, sums, mins, maxs, histogram};
+  for (int i = 0; i < 3; i++) {
+    assert_true(tsf_iter_reduce_matrix(iter, i, first, count, i + 1, &red));
+    for (int j = 0; j < count; j++) {
+      int r = first + j, expect_count = 0, expect_hist[3] = {0};
+      double expect_sum = 0, expect_min = INFINITY, expect_max = -INFINITY;
+      for (int k = 0; k < 4; k++) {
+        int e = entity_ids[k];
+        double x;
+        if (i == 0 && (r + e) % 7 != 0) {
+          x = (r * e) % 3;
+          expect_hist[(r * e) % 3]++;
+        } else if (i == 1 && (r + e) % 4 != 0) {
+          x = r * 0.5f - e;
+        } else if (i == 2 && e != 1) {
+          x = (double)(((int64_t)r << 20) + e);
+        } else {
+          continue;
+        }
+        expect_count++;
+        expect_sum += x;
+        expect_min = x < expect_min ? x : expect_min;
+        expect_max = x > expect_max ? x : expect_max;
+      }
+      assert_int_equal(counts[j], expect_count);
+      assert_true(sums[j] == expect_sum);
+      assert_true(mins[j] == expect_min);
+      assert_true(maxs[j] == expect_max);
+      if (i == 0) {
+        for (int v = 0; v < 3; v++)
+          assert_int_equal(histogram[j * 3 + v], expect_hist[v]);
+      }
+    }
+  }
+  // Only counts, of record 0 where DP is null for entities 4 and 0
+  tsf_matrix_reduction only_counts = {counts, NULL, NULL, NULL, NULL};
+  assert_true(tsf_iter_reduce_matrix(iter, 1, 0, 1, 0, &only_counts));
+  assert_int_equal(counts[0], 2);
+  assert_false(tsf_iter_reduce_matrix(iter, 1, 250, 51, 0, &only_counts));
+  tsf_iter_close(iter);
+
+  // A budget of one chunk still keeps every field's chunk of the cell
+  iter = tsf_query_table(tsf, 1, 3, fields, 4, entity_ids, FieldMatrix);
+  iter->matrix_budget = 1;
+  while (tsf_iter_next(iter)) {
+    int r = iter->cur_record_id, e = iter->entity_ids[iter->cur_entity_idx];
+    float dp = r * 0.5f - e;
+    assert_int_equal(iter->cur_nulls[0], (r + e) % 7 == 0);
+    if (!iter->cur_nulls[0])
+      assert_int_equal(v_int32(iter->cur_values[0]), (r * e) % 3);
+    assert_int_equal(iter->cur_nulls[1], (r + e) % 4 == 0);
+    if (!iter->cur_nulls[1])
+      assert_float_equal(v_float32(iter->cur_values[1]), dp);
+    assert_true(iter->cur_nulls[2] || v_int64(iter->cur_values[2]) == ((int64_t)r << 20) + e);
+  }
+  assert_true(iter->matrix_resident_bytes <= 64 * (4 + 4 + 8));
+  tsf_iter_close(iter);
+
+  // Genotypes packed 2 bits per call read back as the same values
+  iter = tsf_query_table(tsf, 1, 1, fields, 4, entity_ids, FieldMatrix);
+  iter->pack_enums = true;
+  while (tsf_iter_next(iter)) {
+    int r = iter->cur_record_id, e = iter->entity_ids[iter->cur_entity_idx];
+    assert_int_equal(iter->cur_nulls[0], (r + e) % 7 == 0);
+    if (!iter->cur_nulls[0])
+      assert_int_equal(v_int32(iter->cur_values[0]), (r * e) % 3);
+  }
+  assert_int_equal(iter->matrix_resident_bytes, 4 * 16);  // 64 records of 4 entities
+
+  // Counts and dot products of entities 4 and 2 over records 64-127
+  tsf_packed a, b;
+  assert_true(tsf_iter_read_packed(iter, 0, 70, 0, &a));
+  assert_true(tsf_iter_read_packed(iter, 0, 127, 2, &b));
+  assert_int_equal(a.first_record_id, 64);
+  assert_int_equal(a.count, 64);
+  int packed_counts[4], expect_counts[4] = {0}, pairs, expect_pairs = 0;
+  int64_t expect_dot = 0;
+  for (int r = 64; r < 128; r++) {
+    int x = (r + 4) % 7 == 0 ? TSF_PACKED_NULL : (r * 4) % 3;
+    int y = (r + 2) % 7 == 0 ? TSF_PACKED_NULL : (r * 2) % 3;
+    expect_counts[x]++;
+    if (x != TSF_PACKED_NULL && y != TSF_PACKED_NULL) {
+      expect_dot += x * y;
+      expect_pairs++;
+    }
+  }
+  tsf_packed_count(a.bits, a.count, packed_counts);
+  for (int v = 0; v < 4; v++)
+    assert_int_equal(packed_counts[v], expect_counts[v]);
+  assert_true(tsf_packed_dot(a.bits, b.bits, 64, &pairs) == expect_dot);
+  assert_int_equal(pairs, expect_pairs);
+  // The last chunk's padding counts for nothing
+  assert_true(tsf_iter_read_packed(iter, 0, 299, 1, &a));
+  assert_int_equal(a.count, 300 - 256);
+  tsf_packed_count(a.bits, a.count, packed_counts);
+  assert_int_equal(packed_counts[0] + packed_counts[1] + packed_counts[2] + packed_counts[3], 44);
+  tsf_packed_dot(a.bits, a.bits, a.count, &pairs);
+  assert_int_equal(pairs, 44 - packed_counts[3]);
+  assert_false(tsf_iter_read_packed(iter, 0, 300, 0, &a));
+  tsf_iter_close(iter);
+  tsf_close_file(tsf);
+  remove("test_writer.tsf");
+}
+
+static void test_string_codes(void)
+{
+  static const char* genes[] = {"BRCA1", "TP53", "EGFR", NULL};
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.chunk_bits = 6;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  tsf_writer_source src = {"Codes", NULL, NULL, NULL, 0, false};
+  int source_id = tsf_writer_add_source(w, &src);
+  tsf_writer_field def = {"Gene", NULL, TypeString, FieldLocusAttribute, 0, NULL, NULL, -1, -1};
+  def.encoding = EncodingStringDict;
+  tsf_writer_add_field(w, source_id, &def);
+  def.name = "Plain";
+  def.encoding = EncodingNone;
+  tsf_writer_add_field(w, source_id, &def);
+  for (int r = 0; r < 200; r++) {
+    assert_true(tsf_writer_append(w, source_id, 0, 1, &genes[r % 4]));
+    assert_true(tsf_writer_append(w, source_id, 1, 1, &genes[r % 3]));
+  }
+  assert_true(tsf_writer_close(w));
+
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  while (tsf_iter_next(iter)) {
+    int r = iter->cur_record_id;
+    assert_true(iter->cur_nulls[0] == (r % 4 == 3));
+    if (r % 4 != 3)
+      assert_string_equal(v_str(iter->cur_values[0]), genes[r % 4]);
+    assert_string_equal(v_str(iter->cur_values[1]), genes[r % 3]);
+  }
+  tsf_batch b;
+  assert_true(tsf_iter_read_batch(iter, 0, 64, 64, &b));
+  assert_non_null(b.codes);
+  assert_int_equal(b.dict_count, 4);
+  int counts[4] = {0, 0, 0, 0};
+  for (int j = 0; j < b.count; j++) {
+    assert_true(b.nulls[j] == (j % 4 == 3));
+    assert_string_equal(b.dict[b.codes[j]], v_str(b.values[j]));
+    counts[b.codes[j]]++;
+  }
+  assert_int_equal(counts[0], 16);
+  assert_true(tsf_iter_read_batch(iter, 1, 64, 64, &b));
+  assert_null(b.codes);
+  tsf_iter_close(iter);
+
+  // Coded as read
+  iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  iter->string_codes = true;
+  assert_true(tsf_iter_read_batch(iter, 1, 130, 100, &b));
+  assert_int_equal(b.count, 62);
+  assert_int_equal(b.dict_count, 3);
+  for (int j = 0; j < b.count; j++)
+    assert_string_equal(b.dict[b.codes[j]], genes[(130 + j) % 3]);
+  while (tsf_iter_next(iter))
+    assert_string_equal(v_str(iter->cur_values[1]), genes[iter->cur_record_id % 3]);
+  tsf_iter_close(iter);
+  tsf_close_file(tsf);
+  remove("test_writer.tsf");
+
+  w = tsf_writer_open("test_writer.tsf", &opts);
+  source_id = tsf_writer_add_source(w, &src);
+  def.name = "Count";
+  def.value_type = TypeInt32;
+  def.encoding = EncodingStringDict;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), -1);
+  assert_false(tsf_writer_close(w));
+  remove("test_writer.tsf");
+}
+
+// Sparse array cells of record r: entities whose square is r modulo 3,
+// none for every seventh record
+static bool sparse_cell(int r, int e)
+{
+  return r % 7 != 0 && (r + e * e) % 3 == 0;
+}
+
+// Writes two sparse array fields of 10 entities and reads them back
+// record by record and in CSR batches
+static void test_sparse_arrays(int codec)
+{
+  const int n = 100, entities = 10;
+  tsf_writer_opts opts;
+  tsf_writer_opts_init(&opts);
+  opts.chunk_bits = 5;
+  opts.codec = codec;
+  tsf_writer* w = tsf_writer_open("test_writer.tsf", &opts);
+  tsf_writer_source src = {"Sparse", NULL, NULL, NULL, entities, false};
+  int source_id = tsf_writer_add_source(w, &src);
+  tsf_writer_field def = {"Start", NULL, TypeInt32, FieldLocusAttribute, 0, NULL, NULL, -1, -1};
+  tsf_writer_add_field(w, source_id, &def);
+  def.name = "AF";
+  def.value_type = TypeFloat32Array;
+  def.field_type = FieldSparseArray;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 1);
+  def.name = "DP";
+  def.value_type = TypeFloat64Array;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), 2);
+  for (int r = 0; r < n; r++) {
+    int idxs[10], size = 0;
+    float af[10];
+    double dp[10];
+    for (int e = 0; e < entities; e++) {
+      if (!sparse_cell(r, e))
+        continue;
+      idxs[size] = e;
+      af[size] = r + e / 10.0f;
+      dp[size++] = r * 100.0 + e;
+    }
+    assert_true(tsf_writer_append(w, source_id, 0, 1, &r));
+    assert_true(tsf_writer_append_sparse(w, source_id, 1, 1, &size, idxs, af));
+    assert_true(tsf_writer_append_sparse(w, source_id, 2, 1, &size, idxs, dp));
+  }
+  assert_true(tsf_writer_close(w));
+
+  tsf_file* tsf = tsf_open_file("test_writer.tsf");
+  assert_non_null(tsf);
+  assert_int_equal(tsf->sources[0].fields[1].field_type, FieldSparseArray);
+  tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldSparseArray);
+  assert_int_equal(iter->field_count, 2);
+  while (tsf_iter_next(iter)) {
+    int r = iter->cur_record_id, cells = 0;
+    for (int e = 0; e < entities; e++) {
+      if (sparse_cell(r, e)) {
+        float af = r + e / 10.0f;
+        assert_float_equal(va_float32(iter->cur_values[0], cells), af);
+        cells++;
+      }
+    }
+    assert_int_equal(va_size(iter->cur_values[0]), cells);
+    assert_int_equal(va_size(iter->cur_values[1]), cells);
+  }
+
+  // Batches end at chunk boundaries
+  tsf_sparse_batch b;
+  int total = 0;
+  for (int r = 0; tsf_iter_read_sparse(iter, 1, r, 40, &b); r += b.count) {
+    assert_int_equal(b.first_record_id, r);
+    assert_int_equal(b.count, r == 96 ? 4 : 32);
+    const double* dp = b.values;
+    for (int j = 0; j < b.count; j++) {
+      int cell = b.row_offsets[j];
+      for (int e = 0; e < entities; e++) {
+        if (sparse_cell(r + j, e)) {
+          double expected = (r + j) * 100.0 + e;
+          assert_int_equal(b.entity_idxs[cell], e);
+          assert_float_equal(dp[cell], expected);
+          cell++;
+        }
+      }
+      assert_int_equal(b.row_offsets[j + 1], cell);
+    }
+    assert_int_equal(b.nnz, b.row_offsets[b.count]);
+    total += b.nnz;
+  }
+  assert_int_equal(total, 284);
+  assert_true(tsf_iter_read_sparse(iter, 0, 5, 1, &b));
+  assert_int_equal(b.row_offsets[1], 6);
+  assert_int_equal(b.entity_idxs[2], 4);
+  assert_float_equal(((const float*)b.values)[2], 5.4f);
+  tsf_iter_close(iter);
+  iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  assert_false(tsf_iter_read_sparse(iter, 0, 0, 10, &b));
+  tsf_iter_close(iter);
+  tsf_close_file(tsf);
+
+  // String arrays and unordered entities are rejected
+  w = tsf_writer_open("test_writer.tsf", &opts);
+  source_id = tsf_writer_add_source(w, &src);
+  def.value_type = TypeStringArray;
+  assert_int_equal(tsf_writer_add_field(w, source_id, &def), -1);
+  assert_false(tsf_writer_close(w));
+  w = tsf_writer_open("test_writer.tsf", &opts);
+  source_id = tsf_writer_add_source(w, &src);
+  def.value_type = TypeFloat64Array;
+  tsf_writer_add_field(w, source_id, &def);
+  int size = 2, idxs[] = {3, 3};
+  double dp[] = {1, 2};
+  assert_false(tsf_writer_append_sparse(w, source_id, 0, 1, &size, idxs, dp));
+  assert_false(tsf_writer_close(w));
+  remove("test_writer.tsf");
+}
+
 int main(int argc, char** argv)
 {
   tsf_file* tmp = tsf_open_file("does_not_exist.tsf");
@@ -13,9 +916,14 @@ int main(int argc, char** argv)
   assert_non_null(tmp->errmsg);
   tsf_close_file(tmp);
 
+  // Route allocations through a custom allocator
+  assert_false(tsf_set_allocator(counting_malloc, NULL, NULL));
+  assert_true(tsf_set_allocator(counting_malloc, counting_realloc, counting_free));
+
   // Assume run from parent directory where compiled to
   tsf_file* tsf = tsf_open_file("tests/low_level.tsf");
   assert_non_null(tsf);
+  assert_true(alloc_count > 0);
   assert_int_equal(tsf->source_count, 1);
   assert_non_null(tsf->sources);
 
@@ -93,6 +1001,19 @@ int main(int argc, char** argv)
   assert_string_equal(s->fields[14].enum_names[1], "E2");
   assert_string_equal(s->fields[14].enum_names[2], "E3");
 
+  // Hashed lookups
+  assert_true(tsf_source_by_uuid(tsf, "{160faaab-81e6-48a7-bee6-24f35959b499}") == s);
+  assert_null(tsf_source_by_uuid(tsf, "{not-a-uuid}"));
+  assert_true(tsf_field_by_symbol(s, "IntField") == &s->fields[3]);
+  assert_true(tsf_field_by_symbol(s, "Int64Field") == &s->fields[4]);
+  assert_true(tsf_field_by_name(s, "Int64 Field") == &s->fields[4]);
+  assert_null(tsf_field_by_symbol(s, "Int64 Field"));
+  assert_null(tsf_field_by_name(s, "NotAField"));
+  assert_int_equal(tsf_enum_value_by_name(&s->fields[13], "E3"), 2);
+  assert_int_equal(tsf_enum_value_by_name(&s->fields[13], ""), 3);
+  assert_int_equal(tsf_enum_value_by_name(&s->fields[13], "E4"), -1);
+  assert_int_equal(tsf_enum_value_by_name(&s->fields[3], "E1"), -1);
+
   // Read some records
   tsf_iter* iter = tsf_query_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
   assert_non_null(iter);
@@ -231,6 +1152,34 @@ int main(int argc, char** argv)
   assert_int_equal( va_size(iter->cur_values[12]), 0 );
   assert_int_equal( va_size(iter->cur_values[14]), 0 );
 
+  // Stats: every chunk of the 15 fields was read at least once
+  tsf_stats stats;
+  tsf_field_stats* field_stats = calloc(sizeof(tsf_field_stats), iter->field_count);
+  tsf_iter_stats_snapshot(iter, &stats, field_stats);
+  assert_true(stats.read_chunks >= 15);
+  assert_int_equal(stats.chunk_fetch.count, stats.read_chunks);
+  assert_int_equal(stats.decompress.count, stats.read_chunks);
+  assert_true(stats.codecs[CompressionZlib].chunks > 0);
+  assert_true(stats.codecs[CompressionBlosc].chunks > 0);
+  assert_true(stats.codecs[CompressionZlib].decompressed_bytes <= stats.decompressed_bytes);
+  assert_true(stats.read_time_ns > 0);
+  assert_true(tsf_histogram_percentile(&stats.chunk_fetch, 50) <=
+              tsf_histogram_percentile(&stats.chunk_fetch, 100));
+  assert_true(tsf_histogram_percentile(&stats.chunk_fetch, 100) <= stats.chunk_fetch.max_ns);
+  assert_int_equal(stats.value_access.count, 0);
+  int64_t field_chunks = 0;
+  for(int i=0; i<iter->field_count; i++)
+    field_chunks += field_stats[i].read_chunks;
+  assert_true(field_chunks == stats.read_chunks);
+  free(field_stats);
+
+  iter->time_value_access = true;
+  assert_true(tsf_iter_id(iter, 0));
+  assert_int_equal(iter->stats.value_access.count, iter->field_count);
+  tsf_iter_stats_reset(iter);
+  assert_int_equal(iter->stats.read_chunks, 0);
+  assert_int_equal(iter->field_stats[0].read_chunks, 0);
+
   tsf_iter_close(iter);
 
   // Test subset of fields
@@ -239,6 +1188,8 @@ int main(int argc, char** argv)
   fields[1] = 5;
   fields[2] = 6;
   fields[3] = 8;
+  tsf_trace* trace = tsf_trace_create();
+  tsf_set_trace(tsf, trace);
   iter = tsf_query_table(tsf, 1, 4, fields, -1, NULL, FieldLocusAttribute);
   free(fields);
   assert_non_null(iter);
@@ -252,13 +1203,161 @@ int main(int argc, char** argv)
   assert_float_equal( v_float64(iter->cur_values[2]), ((double)160471650054570.0) );
   assert_string_equal( v_str(iter->cur_values[3]), "tashcr0r1_" );
 
+  // The first block is decompressed, the second must be read
+  tsf_explain* e = tsf_explain_iter(iter, 0, 100);
+  assert_non_null(e);
+  assert_int_equal(e->chunk_count, 4);
+  assert_int_equal(e->resident_chunks, 4);
+  assert_true(e->compressed_bytes > 0 && e->bytes_to_read == 0);
+  tsf_explain_free(e);
+  e = tsf_explain_iter(iter, 0, -1);
+  assert_int_equal(e->estimated_records, 4098);
+  assert_int_equal(e->chunk_count, 8);
+  assert_true(e->bytes_to_read > 0 && e->bytes_to_read < e->compressed_bytes);
+  tsf_explain_free(e);
+
+  tsf_iter_close(iter);
+
+  // 4 chunks each with fetch, decompress and read_chunk spans + the iter
+  tsf_set_trace(tsf, NULL);
+  assert_int_equal(tsf_trace_span_count(trace), 4 * 3 + 1);
+  assert_true(tsf_trace_write_json(trace, "test_trace.json"));
+  FILE* trace_file = fopen("test_trace.json", "r");
+  assert_non_null(trace_file);
+  char trace_head[16] = {0};
+  assert_true(fread(trace_head, 1, 15, trace_file) == 15);
+  fclose(trace_file);
+  remove("test_trace.json");
+  assert_string_equal(trace_head, "{\"traceEvents\":");
+  tsf_trace_free(trace);
+
+  // Chr, Start and Stop read an idx map chunk and their backend chunk
+  e = tsf_explain_table(tsf, 1, -1, NULL, -1, NULL, FieldLocusAttribute, 0, -1);
+  assert_non_null(e);
+  assert_int_equal(e->field_count, 15);
+  assert_int_equal(e->chunk_count, 12 * 2 + 3 * 2);
+  assert_true(e->bytes_to_read == e->compressed_bytes);
+  tsf_explain_free(e);
+
+  e = tsf_explain_genomic(tsf, 1, "1", 0, 100063, -1, NULL, -1, NULL);
+  assert_non_null(e);
+  assert_true(e->gidx_bins > 0 && e->estimated_records > 0);
+  tsf_explain_free(e);
+
+  // Genomic index query matches a scan of Chr, Start and Stop
+  int pos_fields[3] = {0, 1, 2};
+  iter = tsf_query_table(tsf, 1, 3, pos_fields, -1, NULL, FieldLocusAttribute);
+  int overlapping = 0;
+  while (tsf_iter_next(iter)) {
+    if (strcmp(v_enum_as_str(iter->cur_values[0], iter->fields[0]->enum_names), "2") == 0 &&
+        v_int32(iter->cur_values[1]) < 600000 && v_int32(iter->cur_values[2]) > 500000)
+      overlapping++;
+  }
+  tsf_iter_close(iter);
+  assert_true(overlapping > 0);
+
+  tsf_gidx_iter* gidx = tsf_query_genomic_index(tsf, 1, "2", 500000, 600000, 3, pos_fields,
+                                                -1, NULL);
+  assert_non_null(gidx);
+  assert_non_null(gidx->record_ids);  // Not in genomic order, mapped through Chr's locus_idx_map
+  int found = 0;
+  while (tsf_gidx_iter_next(gidx)) {
+    assert_int_equal(v_int32(gidx->iter.cur_values[0]), 1);
+    assert_true(v_int32(gidx->iter.cur_values[1]) < 600000);
+    assert_true(v_int32(gidx->iter.cur_values[2]) > 500000);
+    found++;
+  }
+  assert_int_equal(found, overlapping);
+  tsf_gidx_iter_close(gidx);
+
+  // A second scan collates Chr, Start and Stop from the file's cache
+  iter = tsf_query_table(tsf, 1, 3, pos_fields, -1, NULL, FieldLocusAttribute);
+  found = 0;
+  while (tsf_iter_next(iter)) {
+    if (strcmp(v_enum_as_str(iter->cur_values[0], iter->fields[0]->enum_names), "2") == 0 &&
+        v_int32(iter->cur_values[1]) < 600000 && v_int32(iter->cur_values[2]) > 500000)
+      found++;
+  }
+  assert_int_equal(found, overlapping);
+  assert_int_equal(iter->stats.read_chunks, 0);
   tsf_iter_close(iter);
 
   tsf_close_file(tsf);
+  assert_int_equal(alloc_count, 0);  // Everything freed through counting_free
+  assert_true(tsf_set_allocator(NULL, NULL, NULL));
+
+  // File pool with a single connection shared by two handles
+  tsf_pool* pool = tsf_pool_create(1);
+  tsf_file* a = tsf_pool_open(pool, "tests/low_level.tsf");
+  assert_non_null(a);
+  assert_null(a->errmsg);
+  assert_true(tsf_pool_open(pool, "tests/low_level.tsf") == a);
+  assert_int_equal(tsf_pool_connection_count(pool), 1);
+
+  tsf_file* b = tsf_pool_open(pool, "tests/../tests/low_level.tsf");
+  assert_non_null(b);
+  assert_true(b != a);
+  assert_int_equal(tsf_pool_connection_count(pool), 1);
+  assert_null(a->db); // Evicted, but meta-data still resident
+  assert_int_equal(a->sources[0].field_count, 15);
+
+  iter = tsf_query_table(a, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  assert_non_null(iter);
+  assert_non_null(a->db);
+  assert_null(b->db);
+  assert_true(tsf_iter_id(iter, 750));
+  assert_int_equal( v_int32(iter->cur_values[1]), 433 );
+
+  // Both pinned, cap is exceeded rather than failing
+  tsf_iter* iter_b = tsf_query_table(b, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  assert_non_null(iter_b);
+  assert_int_equal(tsf_pool_connection_count(pool), 2);
+  assert_true(tsf_iter_next(iter_b));
+  assert_int_equal( v_int32(iter_b->cur_values[1]), 89719 );
+  tsf_iter_close(iter);
+  assert_int_equal(tsf_pool_connection_count(pool), 1);
+  assert_null(a->db);
+  tsf_iter_close(iter_b);
+  assert_int_equal(tsf_pool_connection_count(pool), 1);
+
+  tsf_close_file(b);
+  assert_int_equal(tsf_pool_connection_count(pool), 0);
+
+  // a was opened twice, so stays pooled until closed twice
+  tsf_close_file(a);
+  iter = tsf_query_table(a, 1, -1, NULL, -1, NULL, FieldLocusAttribute);
+  assert_true(tsf_iter_id(iter, 750));
+  assert_int_equal( v_int32(iter->cur_values[1]), 433 );
+  tsf_iter_close(iter);
+  assert_int_equal(tsf_pool_connection_count(pool), 1);
+  tsf_close_file(a);
+  assert_int_equal(tsf_pool_connection_count(pool), 0);
+  a = tsf_pool_open(pool, "tests/low_level.tsf");
+  assert_int_equal(tsf_pool_connection_count(pool), 1);
+  tsf_pool_close(pool);
+
+  test_writer_round_trip(CompressionZstd, 2);
+  test_writer_round_trip(CompressionZlib, 1);
+  test_writer_round_trip(CompressionBlosc, 0);
+  test_writer_round_trip(CompressionLZ4, 3);
+
+  // Small string chunks share a trained zstd dictionary
+  int64_t plain_bytes = test_writer_strings(0);
+  int64_t dict_bytes = test_writer_strings(4096);
+  assert_true(dict_bytes < plain_bytes * 9 / 10);
+
+  // Extended chunk headers with encodings, alone and under a codec
+  test_writer_encodings(CompressionNone);
+  test_writer_encodings(CompressionZstd);
+  test_writer_encodings(CompressionBlosc);
+  test_writer_constant_chunks();
+  test_string_codes();
+  test_blosc_threads();
+  test_matrix_reductions();
+  test_sparse_arrays(CompressionZstd);
+  test_sparse_arrays(CompressionBlosc);
 
   printf("ALL TESTS COMPLETE\n");
 
   // TODO: Test matrix fields
-
-  // TODO: Test gidx query
 }
@@ -0,0 +1,505 @@
+/*-------------------------------------------------------------------------
+ *
+ * tsf_transcode.c
+ *
+ * Rewrites a TSF file with a different chunk size, compression codec and
+ * level (per field if needed) and optionally a subset of its fields.
+ *
+ * Values are streamed from the reader into tsf_writer a block of records
+ * at a time, so memory stays bounded by the block size and the writer's
+ * compression queue, and chunks are compressed on the writer's worker
+ * threads. Source docs, source_meta and field_meta are copied verbatim,
+ * and genomic indexes are rebuilt by the writer for sources whose records
+ * are in genomic order.
+ *
+ *-------------------------------------------------------------------------
+ */
+
+#include "tsf_writer.h"
+#include "sqlite3/sqlite3.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define BLOCK_SIZE 4096
+#define MAX_FIELD_CODECS 64
+
+typedef struct field_codec {
+  char symbol[128];
+  int codec;     // -1 to keep the default
+  int level;
+  int encoding;  // tsf_chunk_encoding
+} field_codec;
+
+typedef struct xcode_opts {
+  const char* in_path;
+  const char* out_path;
+  tsf_writer_opts writer;
+  const char* fields;  // Comma separated symbols, or NULL for all
+  field_codec field_codecs[MAX_FIELD_CODECS];
+  int field_codec_count;
+} xcode_opts;
+
+typedef struct xbuf {
+  char* data;
+  size_t len;
+  size_t cap;
+} xbuf;
+
+// A block of values of one field in the writer's layout. Strings are
+// copied into text as the chunks they point into are replaced while
+// reading, with their offsets in values until the block is appended.
+typedef struct xcol {
+  tsf_field* field;
+  int out_idx;
+  xbuf values;
+  xbuf text;
+  xbuf ptrs;
+  int sizes[BLOCK_SIZE];
+  int rows;
+} xcol;
+
+static void xbuf_put(xbuf* b, const void* p, size_t n)
+{
+  if (b->len + n > b->cap) {
+    while (b->len + n > b->cap)
+      b->cap = b->cap ? b->cap * 2 : 4096;
+    b->data = realloc(b->data, b->cap);
+  }
+  memcpy(b->data + b->len, p, n);
+  b->len += n;
+}
+
+static int parse_codec(const char* name)
+{
+  if (strcmp(name, "zstd") == 0)
+    return CompressionZstd;
+  if (strcmp(name, "zlib") == 0)
+    return CompressionZlib;
+  if (strcmp(name, "blosc") == 0)
+    return CompressionBlosc;
+  if (strcmp(name, "lz4") == 0)
+    return CompressionLZ4;
+  if (strcmp(name, "none") == 0)
+    return CompressionNone;
+  return -1;
+}
+
+// Parses symbol=codec[:level]
+static bool parse_field_codec(const char* arg, field_codec* fc)
+{
+  const char* eq = strchr(arg, '=');
+  if (!eq || eq == arg || eq - arg >= (int)sizeof(fc->symbol))
+    return false;
+  memcpy(fc->symbol, arg, eq - arg);
+  fc->symbol[eq - arg] = '\0';
+  char codec[16];
+  snprintf(codec, sizeof(codec), "%s", eq + 1);
+  char* colon = strchr(codec, ':');
+  fc->level = -1;
+  if (colon) {
+    *colon = '\0';
+    fc->level = atoi(colon + 1);
+  }
+  fc->codec = parse_codec(codec);
+  return fc->codec >= 0;
+}
+
+// Parses symbol=encoding
+static bool parse_field_encoding(const char* arg, field_codec* fc)
+{
+  const char* eq = strchr(arg, '=');
+  if (!eq || eq == arg || eq - arg >= (int)sizeof(fc->symbol))
+    return false;
+  memcpy(fc->symbol, arg, eq - arg);
+  fc->symbol[eq - arg] = '\0';
+  fc->codec = -1;
+  fc->level = -1;
+  const char* names[] = {"none", "delta", "for", "rle", "dict", "delta_for"};
+  for (int i = 0; i < 6; i++) {
+    if (strcmp(eq + 1, names[i]) == 0) {
+      fc->encoding = i;
+      return true;
+    }
+  }
+  if (strcmp(eq + 1, "shuffle") == 0) {
+    fc->encoding = EncodingShuffle;
+    return true;
+  }
+  if (strcmp(eq + 1, "decimal") == 0) {
+    fc->encoding = EncodingDecimal;
+    return true;
+  }
+  return false;
+}
+
+static bool field_selected(const xcode_opts* o, const tsf_field* f)
+{
+  if (!o->fields)
+    return true;
+  size_t len = strlen(f->symbol);
+  for (const char* p = o->fields; p; p = strchr(p, ',')) {
+    if (*p == ',')
+      p++;
+    if (strncmp(p, f->symbol, len) == 0 && (p[len] == ',' || p[len] == '\0'))
+      return true;
+  }
+  return false;
+}
+
+// Returns a text column of a source or field row, or NULL
+static char* query_text(sqlite3* db, const char* sql, int source_id, int field_id)
+{
+  sqlite3_stmt* q;
+  if (sqlite3_prepare_v2(db, sql, -1, &q, 0) != SQLITE_OK)
+    return NULL;
+  sqlite3_bind_int(q, 1, source_id);
+  if (sqlite3_bind_parameter_count(q) > 1)
+    sqlite3_bind_int(q, 2, field_id);
+  char* text = NULL;
+  if (sqlite3_step(q) == SQLITE_ROW && sqlite3_column_text(q, 0))
+    text = strdup((const char*)sqlite3_column_text(q, 0));
+  sqlite3_finalize(q);
+  return text;
+}
+
+static void put_string(xcol* c, const char* s)
+{
+  size_t offset = c->text.len;
+  xbuf_put(&c->text, s, strlen(s) + 1);
+  xbuf_put(&c->values, &offset, sizeof(offset));
+}
+
+// Appends the current value of a field to its column
+static void put_value(xcol* c, tsf_v v)
+{
+  int size;
+  switch (c->field->value_type) {
+    case TypeInt32:
+    case TypeFloat32:
+    case TypeEnum:
+      xbuf_put(&c->values, v, 4);
+      break;
+    case TypeInt64:
+    case TypeFloat64:
+      xbuf_put(&c->values, v, 8);
+      break;
+    case TypeBool:
+      xbuf_put(&c->values, v, 1);
+      break;
+    case TypeString:
+      put_string(c, v_str(v));
+      break;
+    case TypeInt32Array:
+    case TypeFloat32Array:
+    case TypeEnumArray:
+      size = va_size(v);
+      xbuf_put(&c->values, va_array_size32(v), (size_t)size * 4);
+      c->sizes[c->rows] = size;
+      break;
+    case TypeFloat64Array:
+      size = va_size(v);
+      xbuf_put(&c->values, va_array(v), (size_t)size * 8);
+      c->sizes[c->rows] = size;
+      break;
+    case TypeBoolArray:
+      size = va_size(v);
+      xbuf_put(&c->values, va_array(v), size);
+      c->sizes[c->rows] = size;
+      break;
+    case TypeStringArray:
+      size = va_size(v);
+      for (int j = 0; j < size; j++)
+        put_string(c, va_str(v, j));
+      c->sizes[c->rows] = size;
+      break;
+    default:
+      break;
+  }
+  c->rows++;
+}
+
+// Appends the buffered block of a column to the writer
+static bool flush_col(tsf_writer* w, int source_id, xcol* c, int entity_idx)
+{
+  if (c->rows == 0)
+    return true;
+  const void* values = c->values.data;
+  tsf_value_type type = c->field->value_type;
+  if (type == TypeString || type == TypeStringArray) {
+    c->ptrs.len = 0;
+    size_t* offsets = (size_t*)c->values.data;
+    for (size_t i = 0; i < c->values.len / sizeof(size_t); i++) {
+      const char* s = c->text.data + offsets[i];
+      xbuf_put(&c->ptrs, &s, sizeof(s));
+    }
+    values = c->ptrs.data;
+  }
+  bool ok;
+  if (entity_idx >= 0)
+    ok = tsf_writer_append_matrix(w, source_id, c->out_idx, entity_idx, c->rows, values);
+  else if (tsf_value_type_is_array(type))
+    ok = tsf_writer_append_array(w, source_id, c->out_idx, c->rows, c->sizes, values);
+  else
+    ok = tsf_writer_append(w, source_id, c->out_idx, c->rows, values);
+  c->rows = 0;
+  c->values.len = 0;
+  c->text.len = 0;
+  return ok;
+}
+
+// Streams every record of the fields in cols through one iterator
+static bool copy_fields(tsf_file* tsf, tsf_writer* w, int source_id, int out_source_id,
+                        tsf_field_type field_type, xcol** cols, int col_count, int entity_id)
+{
+  if (col_count == 0)
+    return true;
+  int* field_idxs = malloc(sizeof(int) * col_count);
+  for (int i = 0; i < col_count; i++)
+    field_idxs[i] = (int)(cols[i]->field - tsf->sources[source_id - 1].fields);
+  bool is_matrix = field_type == FieldMatrix;
+  tsf_iter* iter = tsf_query_table(tsf, source_id, col_count, field_idxs, is_matrix ? 1 : -1,
+                                   is_matrix ? &entity_id : NULL, field_type);
+  free(field_idxs);
+  if (!iter)
+    return false;
+  bool ok = true;
+  while (ok && tsf_iter_next(iter)) {
+    for (int i = 0; i < col_count; i++)
+      put_value(cols[i], iter->cur_values[i]);
+    if (cols[0]->rows == BLOCK_SIZE)
+      for (int i = 0; i < col_count && ok; i++)
+        ok = flush_col(w, out_source_id, cols[i], is_matrix ? entity_id : -1);
+  }
+  for (int i = 0; i < col_count && ok; i++)
+    ok = flush_col(w, out_source_id, cols[i], is_matrix ? entity_id : -1);
+  tsf_iter_close(iter);
+  return ok;
+}
+
+// Copies a sparse array field a chunk of records at a time, keeping the
+// cells in compressed sparse row form
+static bool copy_sparse(tsf_file* tsf, tsf_writer* w, int source_id, int out_source_id,
+                        xcol* col)
+{
+  int field_idx = (int)(col->field - tsf->sources[source_id - 1].fields);
+  tsf_iter* iter = tsf_query_table(tsf, source_id, 1, &field_idx, -1, NULL, FieldSparseArray);
+  if (!iter)
+    return false;
+  bool ok = true;
+  int* sizes = malloc(sizeof(int) * BLOCK_SIZE);
+  tsf_sparse_batch b;
+  for (int r = 0; ok && tsf_iter_read_sparse(iter, 0, r, BLOCK_SIZE, &b); r += b.count) {
+    for (int j = 0; j < b.count; j++)
+      sizes[j] = b.row_offsets[j + 1] - b.row_offsets[j];
+    ok = tsf_writer_append_sparse(w, out_source_id, col->out_idx, b.count, sizes, b.entity_idxs,
+                                  b.values);
+  }
+  free(sizes);
+  tsf_iter_close(iter);
+  return ok;
+}
+
+static bool transcode_source(tsf_file* tsf, tsf_source* s, tsf_writer* w, const xcode_opts* o)
+{
+  tsf_writer_source def;
+  memset(&def, 0, sizeof(def));
+  def.name = s->name;
+  def.uuid = s->uuid;
+  def.coord_sys_id = s->coord_sys_id;
+  def.entity_count = s->entity_count;
+  def.genomic_order = s->records_in_genomic_order;
+  def.curated = s->date_curated;
+  char* docs = query_text(tsf->db, "SELECT docs FROM source WHERE id = ?", s->source_id, 0);
+  char* meta =
+      query_text(tsf->db, "SELECT source_meta FROM source WHERE id = ?", s->source_id, 0);
+  def.docs_json = docs;
+  def.meta_json = meta;
+  int out_source_id = tsf_writer_add_source(w, &def);
+  free(docs);
+  free(meta);
+  if (s->gidx_query_table && !s->records_in_genomic_order)
+    fprintf(stderr, "%s: records are not in genomic order, the genomic index is not kept\n",
+            s->name);
+
+  // Fields keep their order, then are read in groups of one field type
+  xcol* cols = calloc(s->field_count, sizeof(xcol));
+  int col_count = 0;
+  bool ok = out_source_id > 0;
+  for (int i = 0; i < s->field_count && ok; i++) {
+    tsf_field* f = &s->fields[i];
+    if (!field_selected(o, f))
+      continue;
+    if (f->field_type == FieldMatrix && tsf_value_type_is_array(f->value_type)) {
+      fprintf(stderr, "%s: skipping array matrix field %s\n", s->name, f->symbol);
+      continue;
+    }
+    tsf_writer_field fdef;
+    memset(&fdef, 0, sizeof(fdef));
+    fdef.name = f->name;
+    fdef.symbol = f->symbol;
+    fdef.value_type = f->value_type;
+    fdef.field_type = f->field_type;
+    fdef.enum_count = f->enum_count;
+    fdef.enum_names = f->enum_names;
+    fdef.codec = -1;
+    fdef.level = -1;
+    for (int j = 0; j < o->field_codec_count; j++) {
+      const field_codec* fc = &o->field_codecs[j];
+      if (strcmp(fc->symbol, f->symbol) != 0)
+        continue;
+      if (fc->codec >= 0) {
+        fdef.codec = fc->codec;
+        fdef.level = fc->level;
+      } else {
+        fdef.encoding = fc->encoding;
+        if (fc->encoding == EncodingDict && f->value_type == TypeString)
+          fdef.encoding = EncodingStringDict;
+      }
+    }
+    char* field_meta =
+        query_text(tsf->db, "SELECT field_meta FROM field WHERE source_id = ? AND field_id = ?",
+                   s->source_id, f->idx);
+    fdef.meta_json = field_meta;
+    xcol* c = &cols[col_count++];
+    c->field = f;
+    c->out_idx = tsf_writer_add_field(w, out_source_id, &fdef);
+    free(field_meta);
+    ok = c->out_idx >= 0;
+  }
+
+  xcol** group = malloc(sizeof(xcol*) * (col_count + 1));
+  tsf_field_type types[2] = {FieldLocusAttribute, FieldEntityAttribute};
+  for (int t = 0; t < 2 && ok; t++) {
+    int n = 0;
+    for (int i = 0; i < col_count; i++)
+      if (cols[i].field->field_type == types[t])
+        group[n++] = &cols[i];
+    ok = copy_fields(tsf, w, s->source_id, out_source_id, types[t], group, n, -1);
+  }
+  // Each matrix field is read an entity at a time, as entities are
+  // chunked separately, and each sparse array field a chunk at a time
+  for (int i = 0; i < col_count && ok; i++) {
+    group[0] = &cols[i];
+    if (cols[i].field->field_type == FieldMatrix)
+      for (int e = 0; e < s->entity_count && ok; e++)
+        ok = copy_fields(tsf, w, s->source_id, out_source_id, FieldMatrix, group, 1, e);
+    else if (cols[i].field->field_type == FieldSparseArray)
+      ok = copy_sparse(tsf, w, s->source_id, out_source_id, &cols[i]);
+  }
+  free(group);
+
+  for (int i = 0; i < col_count; i++) {
+    free(cols[i].values.data);
+    free(cols[i].text.data);
+    free(cols[i].ptrs.data);
+  }
+  free(cols);
+  return ok;
+}
+
+static bool transcode(const xcode_opts* o)
+{
+  tsf_file* tsf = tsf_open_file(o->in_path);
+  if (!tsf || tsf->errmsg) {
+    fprintf(stderr, "Unable to open %s: %s\n", o->in_path, tsf ? tsf->errmsg : "");
+    tsf_close_file(tsf);
+    return false;
+  }
+  tsf_writer_opts wopts = o->writer;
+  if (wopts.chunk_bits <= 0)
+    wopts.chunk_bits = tsf->chunk_table_count > 0 ? tsf->chunk_tables[0].chunk_bits : 12;
+  tsf_writer* w = tsf_writer_open(o->out_path, &wopts);
+  bool ok = w != NULL;
+  for (int i = 0; i < tsf->source_count && ok; i++) {
+    tsf_source* s = &tsf->sources[i];
+    if (s->err) {
+      fprintf(stderr, "%s: skipping source (%s)\n", s->name, s->err);
+      continue;
+    }
+    ok = transcode_source(tsf, s, w, o);
+  }
+  if (w)
+    ok = tsf_writer_close(w) && ok;
+  tsf_close_file(tsf);
+  return ok;
+}
+
+static void usage(void)
+{
+  fprintf(stderr,
+          "Usage: tsf_transcode [options] in.tsf out.tsf\n"
+          "  -b chunk_bits      Records per chunk as a power of 2 (default as in.tsf)\n"
+          "  -c codec           zstd, zlib, lz4, blosc or none (default zstd)\n"
+          "  -l level           Compression level (default per codec)\n"
+          "  -t threads         Compression threads (default one per CPU)\n"
+          "  -d bytes           zstd dictionary size of string fields (default none)\n"
+          "  -k                 Store chunks of one repeated (or missing) value once\n"
+          "  -f symbols         Comma separated fields to keep (default all); keep\n"
+          "                     Chr, Start and Stop to keep the genomic index\n"
+          "  -F symbol=codec[:level]\n"
+          "                     Codec of a field, may be repeated\n"
+          "  -E symbol=encoding Encoding of an int32, enum or float32 field before\n"
+          "                     compression: delta, for (frame of reference, bit\n"
+          "                     packed), delta_for (bit packed deltas, for sorted\n"
+          "                     positions), rle or dict (float32: rle and dict only;\n"
+          "                     string: dict only), shuffle (byte planes of\n"
+          "                     float32, float64 and other 4 and 8-byte scalars) or\n"
+          "                     decimal (float32 and float64 of few decimal places)\n");
+}
+
+int main(int argc, char** argv)
+{
+  xcode_opts o;
+  memset(&o, 0, sizeof(o));
+  tsf_writer_opts_init(&o.writer);
+  o.writer.chunk_bits = 0;
+
+  int c;
+  while ((c = getopt(argc, argv, "b:c:l:t:d:kf:F:E:h")) != -1) {
+    switch (c) {
+      case 'b': o.writer.chunk_bits = atoi(optarg); break;
+      case 'c': o.writer.codec = parse_codec(optarg); break;
+      case 'l': o.writer.level = atoi(optarg); break;
+      case 't': o.writer.threads = atoi(optarg); break;
+      case 'd': o.writer.zstd_dict_size = atoi(optarg); break;
+      case 'k': o.writer.constant_chunks = true; break;
+      case 'f': o.fields = optarg; break;
+      case 'F':
+        if (o.field_codec_count == MAX_FIELD_CODECS ||
+            !parse_field_codec(optarg, &o.field_codecs[o.field_codec_count++])) {
+          usage();
+          return 1;
+        }
+        break;
+      case 'E':
+        if (o.field_codec_count == MAX_FIELD_CODECS ||
+            !parse_field_encoding(optarg, &o.field_codecs[o.field_codec_count++])) {
+          usage();
+          return 1;
+        }
+        break;
+      default: usage(); return 1;
+    }
+  }
+  if (optind + 2 != argc || o.writer.codec < 0 || o.writer.chunk_bits < 0 ||
+      o.writer.chunk_bits > 20) {
+    usage();
+    return 1;
+  }
+  o.in_path = argv[optind];
+  o.out_path = argv[optind + 1];
+  if (strcmp(o.in_path, o.out_path) == 0) {
+    fprintf(stderr, "Output must be a different file\n");
+    return 1;
+  }
+
+  int64_t start = tsf_clock_ns();
+  if (!transcode(&o))
+    return 1;
+  fprintf(stderr, "Transcoded %s to %s in %.2fs\n", o.in_path, o.out_path,
+          (tsf_clock_ns() - start) / 1e9);
+  return 0;
+}